@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+/*
+ * Benchmarks for the obstacle and collision checking hot paths.
+ *
+ * Runs without a ROS master: the sensors are fed straight into the
+ * callbacks, and the sensor transforms into the tf buffer.  Each query
+ * reports its time, the heap allocations it made and its throughput.
+ *
+ * The queries run against a snapshot whose sensors haven't changed,
+ * which the collision checker can answer from its per-sensor cache,
+ * and against a snapshot whose sensors are all new on every query.
+ *
+ * Pass --scan=FILE to also run the queries against a recorded scan,
+ * FILE holding its ranges as printed by rostopic echo.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <ros/ros.h>
+#include <move_basic/collision_checker.h>
+#include <move_basic/obstacle_points.h>
+#include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/Range.h>
+#include <tf2_ros/buffer.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Count the heap allocations made while a CountAllocations is in
+// scope, so that the benchmarks can report how many each query makes
+// without counting those of the benchmark library between iterations
+static std::atomic<size_t> allocations(0);
+static thread_local bool counting = false;
+
+struct CountAllocations
+{
+    CountAllocations() { counting = true; }
+    ~CountAllocations() { counting = false; }
+};
+
+void* operator new(size_t size)
+{
+    if (counting) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+// Ranges of the recorded scan, if one was given
+static std::vector<float> recorded_ranges;
+
+// Read the ranges of a scan, skipping the brackets, commas and
+// anything else around them that isn't a number
+static bool read_ranges(const std::string& path, std::vector<float>& ranges)
+{
+    std::ifstream file(path.c_str());
+    if (!file) {
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string text = contents.str();
+    for (char& c : text) {
+        if (c == '[' || c == ']' || c == ',') {
+            c = ' ';
+        }
+    }
+    std::istringstream values(text);
+    std::string value;
+    while (values >> value) {
+        char* end;
+        float range = std::strtof(value.c_str(), &end);
+        if (*end == '\0') {
+            ranges.push_back(range);
+        }
+    }
+    return !ranges.empty();
+}
+
+// A wall at 2m in front, and the sides of a corridor 0.5m to each side
+static float synthetic_range(float angle)
+{
+    float c = std::cos(angle);
+    float s = std::sin(angle);
+    float range = 10.0;
+    if (c > 0.01) {
+        range = std::min(range, 2.0f / c);
+    }
+    if (std::fabs(s) > 0.01) {
+        range = std::min(range, 0.5f / std::fabs(s));
+    }
+    return range;
+}
+
+static geometry_msgs::TransformStamped sensor_tf(const std::string& frame,
+                                                 double x, double y, double yaw)
+{
+    geometry_msgs::TransformStamped tf;
+    tf.header.frame_id = "base_link";
+    tf.child_frame_id = frame;
+    tf.transform.translation.x = x;
+    tf.transform.translation.y = y;
+    tf.transform.rotation.z = std::sin(yaw / 2);
+    tf.transform.rotation.w = std::cos(yaw / 2);
+    return tf;
+}
+
+// A lidar over the middle of the robot, and sonars evenly
+// spaced around the edge of its footprint
+class BenchRobot
+{
+public:
+    tf2_ros::Buffer tf_buffer;
+    ObstaclePoints obstacle_points;
+    CollisionChecker collision_checker;
+    sensor_msgs::LaserScan::Ptr scan;
+    std::vector<sensor_msgs::Range::Ptr> sonars;
+    ObstacleSnapshot snapshot;
+
+    // With reserve set the buffers are sized for the sensors before
+    // they come in, as max_scan_beams and max_sonars do
+    BenchRobot(int beams, int num_sonars, const std::vector<float>* ranges = NULL,
+               bool reserve = false) :
+        obstacle_points(tf_buffer),
+        collision_checker(tf_buffer, obstacle_points),
+        scan(new sensor_msgs::LaserScan())
+    {
+        if (reserve) {
+            obstacle_points.reserve(1, ranges ? ranges->size() : beams, num_sonars);
+            obstacle_points.reserve_snapshot(snapshot);
+        }
+        tf_buffer.setTransform(sensor_tf("laser", 0, 0, 0), "bench", true);
+
+        scan->header.stamp = ros::Time::now();
+        scan->header.frame_id = "laser";
+        if (ranges) {
+            beams = ranges->size();
+        }
+        scan->angle_min = -M_PI;
+        scan->angle_increment = 2 * M_PI / beams;
+        scan->range_min = 0.05;
+        scan->range_max = 10;
+        if (ranges) {
+            scan->ranges = *ranges;
+        }
+        else {
+            for (int i = 0; i < beams; i++) {
+                scan->ranges.push_back(synthetic_range(scan->angle_min +
+                                                       i * scan->angle_increment));
+            }
+        }
+        obstacle_points.scan_callback(scan);
+
+        for (int i = 0; i < num_sonars; i++) {
+            std::string frame = "sonar_" + std::to_string(i);
+            double yaw = 2 * M_PI * i / num_sonars;
+            tf_buffer.setTransform(sensor_tf(frame, 0.1 * std::cos(yaw),
+                                             0.1 * std::sin(yaw), yaw),
+                                   "bench", true);
+            sensor_msgs::Range::Ptr sonar(new sensor_msgs::Range());
+            sonar->header.stamp = ros::Time::now();
+            sonar->header.frame_id = frame;
+            sonar->radiation_type = sensor_msgs::Range::ULTRASOUND;
+            sonar->field_of_view = 0.5;
+            sonar->min_range = 0.05;
+            sonar->max_range = 5;
+            sonar->range = 1.0 + 0.1 * i;
+            obstacle_points.range_callback(sonar);
+            sonars.push_back(sonar);
+        }
+
+        obstacle_points.get_snapshot(ros::Duration(10), snapshot);
+    }
+
+    // Make every sensor in the snapshot look new, so that nothing
+    // can be answered from the collision checker's cache
+    void refresh(int tick)
+    {
+        ros::Time stamp(1.0 + 0.001 * tick);
+        for (auto& lidar_stamp : snapshot.lidar_stamps) {
+            lidar_stamp = stamp;
+        }
+        for (auto& source : snapshot.line_sources) {
+            source.stamp = stamp;
+        }
+    }
+};
+
+// Report the allocations per query, and the queries as the items processed
+static void report(benchmark::State& state, size_t allocs_before)
+{
+    state.counters["allocs"] = benchmark::Counter(
+        allocations.load() - allocs_before, benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_ScanCallback(benchmark::State& state)
+{
+    BenchRobot robot(state.range(0), state.range(1));
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        robot.obstacle_points.scan_callback(robot.scan);
+    }
+    report(state, allocs);
+}
+
+static void BM_GetSnapshot(benchmark::State& state)
+{
+    BenchRobot robot(state.range(0), state.range(1));
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        robot.obstacle_points.get_snapshot(ros::Duration(10), robot.snapshot);
+        benchmark::DoNotOptimize(robot.snapshot.lidars.data());
+    }
+    report(state, allocs);
+}
+
+static void BM_GetPoints(benchmark::State& state)
+{
+    BenchRobot robot(state.range(0), state.range(1));
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        std::vector<tf2::Vector3> points =
+            robot.obstacle_points.get_points(ros::Duration(10));
+        benchmark::DoNotOptimize(points.data());
+    }
+    report(state, allocs);
+}
+
+static void obstacle_dist(benchmark::State& state, BenchRobot& robot, bool fresh)
+{
+    float left, right;
+    tf2::Vector3 fl, fr;
+    int tick = 0;
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        if (fresh) {
+            robot.refresh(tick++);
+        }
+        benchmark::DoNotOptimize(robot.collision_checker.obstacle_dist(
+            robot.snapshot, true, left, right, fl, fr));
+    }
+    report(state, allocs);
+}
+
+static void obstacle_angle(benchmark::State& state, BenchRobot& robot, bool fresh)
+{
+    int tick = 0;
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        if (fresh) {
+            robot.refresh(tick++);
+        }
+        benchmark::DoNotOptimize(robot.collision_checker.obstacle_angle(
+            robot.snapshot, tick & 1));
+    }
+    report(state, allocs);
+}
+
+static void obstacle_arc_angle(benchmark::State& state, BenchRobot& robot, bool fresh)
+{
+    int tick = 0;
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        if (fresh) {
+            robot.refresh(tick++);
+        }
+        benchmark::DoNotOptimize(robot.collision_checker.obstacle_arc_angle(
+            robot.snapshot, 0.3, 0.5));
+    }
+    report(state, allocs);
+}
+
+typedef void (*Query)(benchmark::State&, BenchRobot&, bool);
+
+static void synthetic_query(benchmark::State& state, Query query, bool fresh)
+{
+    BenchRobot robot(state.range(0), state.range(1));
+    query(state, robot, fresh);
+}
+
+static void recorded_query(benchmark::State& state, Query query, bool fresh)
+{
+    BenchRobot robot(0, state.range(0), &recorded_ranges);
+    query(state, robot, fresh);
+}
+
+// Beams from a low end lidar to a dense one, and from no sonars to 16
+static void sensor_counts(benchmark::internal::Benchmark* b)
+{
+    b->ArgNames({"beams", "sonars"});
+    b->ArgsProduct({{360, 1000, 4000}, {0, 4, 16}});
+}
+
+// The distance checks of the scan points alone, for the rectangle and
+// for the same rectangle as a polygon
+template <class Footprint>
+static void points_dist(benchmark::State& state, const Footprint& footprint)
+{
+    BenchRobot robot(state.range(0), 0);
+    const PlanarPoints& points = *robot.snapshot.lidars[0];
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        FootprintDistances dist = {10, 10, 10, 10};
+        footprint.points_dist(points.x.data(), points.y.data(), points.size(), dist);
+        benchmark::DoNotOptimize(dist);
+    }
+    report(state, allocs);
+}
+
+static void BM_RectanglePointsDist(benchmark::State& state)
+{
+    const FootprintBand band = {0.08, 0.09, 0.19};
+    points_dist(state, RectangleFootprint(band));
+}
+
+static void BM_PolygonPointsDist(benchmark::State& state)
+{
+    PolygonFootprint polygon;
+    polygon.set({0.09, -0.19, -0.19, 0.09}, {0.08, 0.08, -0.08, -0.08});
+    points_dist(state, polygon);
+}
+
+// A whole control cycle as the node runs it with its buffers sized up
+// front: a scan and a reading from each sonar come in, then a snapshot
+// is taken and checked.  Once the collision checker has seen each
+// sensor, a cycle must not allocate.
+static void BM_ControlCycle(benchmark::State& state)
+{
+    BenchRobot robot(state.range(0), state.range(1), NULL, true);
+    float left, right;
+    tf2::Vector3 fl, fr;
+    int tick = 0;
+    auto cycle = [&]() {
+        robot.obstacle_points.scan_callback(robot.scan);
+        for (const auto& sonar : robot.sonars) {
+            robot.obstacle_points.range_callback(sonar);
+        }
+        robot.obstacle_points.get_snapshot(ros::Duration(10), robot.snapshot);
+        benchmark::DoNotOptimize(robot.collision_checker.obstacle_dist(
+            robot.snapshot, true, left, right, fl, fr));
+        benchmark::DoNotOptimize(robot.collision_checker.obstacle_angle(
+            robot.snapshot, tick++ & 1));
+        benchmark::DoNotOptimize(robot.collision_checker.obstacle_arc_angle(
+            robot.snapshot, 0.3, 0.5));
+    };
+    cycle();
+
+    size_t allocs = allocations.load();
+    for (auto _ : state) {
+        CountAllocations counted;
+        cycle();
+    }
+    report(state, allocs);
+    if (allocations.load() != allocs) {
+        state.SkipWithError("a control cycle allocated in the steady state");
+    }
+}
+
+BENCHMARK(BM_ScanCallback)->Apply(sensor_counts);
+BENCHMARK(BM_GetSnapshot)->Apply(sensor_counts);
+BENCHMARK(BM_GetPoints)->Apply(sensor_counts);
+BENCHMARK(BM_RectanglePointsDist)->ArgName("beams")->Arg(360)->Arg(1000)->Arg(4000);
+BENCHMARK(BM_PolygonPointsDist)->ArgName("beams")->Arg(360)->Arg(1000)->Arg(4000);
+BENCHMARK(BM_ControlCycle)->Apply(sensor_counts);
+
+int main(int argc, char** argv)
+{
+    ros::Time::init();
+
+    const struct {
+        const char* name;
+        Query query;
+    } queries[] = {
+        {"obstacle_dist", obstacle_dist},
+        {"obstacle_angle", obstacle_angle},
+        {"obstacle_arc_angle", obstacle_arc_angle},
+    };
+
+    // Take out our own arguments before the benchmark library sees them
+    std::string scan_path;
+    int args = 1;
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "--scan=", 7) == 0) {
+            scan_path = argv[i] + 7;
+        }
+        else {
+            argv[args++] = argv[i];
+        }
+    }
+    argc = args;
+
+    if (!scan_path.empty() && !read_ranges(scan_path, recorded_ranges)) {
+        fprintf(stderr, "Could not read the ranges from %s\n", scan_path.c_str());
+        return 1;
+    }
+
+    for (const auto& q : queries) {
+        for (bool fresh : {false, true}) {
+            std::string name = std::string("BM_") + q.name +
+                               (fresh ? "/fresh" : "/cached");
+            benchmark::RegisterBenchmark(name.c_str(), synthetic_query,
+                                         q.query, fresh)->Apply(sensor_counts);
+            if (!recorded_ranges.empty()) {
+                benchmark::RegisterBenchmark((name + "/recorded").c_str(),
+                                             recorded_query, q.query, fresh)
+                    ->ArgName("sonars")->Arg(0)->Arg(16);
+            }
+        }
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
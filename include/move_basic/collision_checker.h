@@ -36,42 +36,94 @@
 #include <tf2_ros/buffer.h>
 #include <sensor_msgs/Range.h>
 #include <sensor_msgs/LaserScan.h>
+#include <visualization_msgs/Marker.h>
 
+#include <atomic>
 #include <mutex>
 
 #include "move_basic/obstacle_points.h"
+#include "move_basic/footprint.h"
 
 class CollisionChecker
 {
    std::string baseFrame;
    ros::Publisher line_pub;
    tf2_ros::Buffer& tf_buffer;
-   // footprint
+   // footprint, the polygon is used if the footprint parameter sets one
+   RectangleFootprint rectangle;
+   PolygonFootprint polygon;
+   bool use_polygon;
+   // extent of the footprint either side of base_frame
    float robot_width;
    float robot_front_length;
    float robot_back_length;
 
-   float robot_width_sq;
-   float robot_front_length_sq;
-   float robot_back_length_sq;
-   float front_diag, back_diag;
-
    float max_age;
    float no_obstacle_dist;
    std::mutex obstacle_mutex;
 
    ObstaclePoints& ob_points;
-
-   void draw_line(const tf2::Vector3 &p1, const tf2::Vector3 &p2,
-                  float r, float g, float b, int id);
-   void clear_line(int id);
-
-   void check_dist(float x, bool forward, float& min_dist) const;
-   void check_angle(float theta, float x, float y,
-                    bool left, float& min_dist) const;
+   // used by the queries that don't take a snapshot, guarded by obstacle_mutex
+   ObstacleSnapshot snapshot;
+
+   // Minima of the obstacles from one sensor, kept until it publishes
+   // again or its geometry changes
+   struct SourceMinima
+   {
+       ros::Time stamp;
+       uint32_t geometry;
+       bool has_dist;
+       FootprintDistances lines_dist;
+       FootprintDistances points_dist;
+       // rotation limit to the right and left
+       bool has_angle[2];
+       float angle[2];
+
+       SourceMinima();
+   };
+   // by lidar and sonar id, guarded by minima_mutex
+   std::mutex minima_mutex;
+   std::vector<SourceMinima> lidar_minima;
+   std::vector<SourceMinima> sonar_minima;
+
+   SourceMinima& source_minima(std::vector<SourceMinima>& table,
+                               const ObstacleSnapshot::Source& source,
+                               SourceMinima& scratch);
+   size_t sonar_point_count(const ObstacleSnapshot& obstacles) const;
+
+   // Debug geometry, one LINE_LIST marker per query
+   enum { DIST_MARKER, ANGLE_MARKER, NUM_MARKERS };
+   float viz_rate;
+   std::mutex viz_mutex;
+   ros::Time last_viz[NUM_MARKERS];
+
+   bool start_lines(visualization_msgs::Marker& lines, int id);
+   void add_line(visualization_msgs::Marker& lines,
+                 const tf2::Vector3 &p1, const tf2::Vector3 &p2,
+                 float r, float g, float b) const;
+
+   void add_footprint(visualization_msgs::Marker& lines, const FootprintEdges& edges,
+                      float rotation, float r, float g, float b) const;
+
+   // The queries for each footprint, chosen once per query so that the
+   // checks of the points are inlined
+   template <class Footprint>
+   float obstacle_dist_for(const Footprint& footprint,
+                           const ObstacleSnapshot& obstacles,
+                           bool forward, float &left_dist, float &right_dist,
+                           tf2::Vector3 &fl, tf2::Vector3 &fr, ros::Time* stamp);
+   template <class Footprint>
+   float obstacle_angle_for(const Footprint& footprint,
+                            const ObstacleSnapshot& obstacles, bool left);
+   template <class Footprint>
+   float obstacle_arc_angle_for(const Footprint& footprint,
+                                const ObstacleSnapshot& obstacles,
+                                double linear, double angular);
 
    float degrees(float radians) const;
 
+   void init(ros::NodeHandle* nh);
+
 public:
    // Note that we take in refrences to tf_buffer and op, we expect these to outlive
    // the useful life of this class, if they don't then you have a big issue.
@@ -79,16 +131,40 @@ public:
    // We don't store the NodeHandle, so that doesn't apply to it.
    CollisionChecker(ros::NodeHandle& nh, tf2_ros::Buffer& tf_buffer, ObstaclePoints& op);
 
-   // return distance in meters to closest obstacle
+   // Use the default parameters and publish nothing, for tools that
+   // run without a ROS master
+   CollisionChecker(tf2_ros::Buffer& tf_buffer, ObstaclePoints& op);
+
+   // whether anyone is subscribed to the debug markers
+   bool viz_subscribed() const { return line_pub.getNumSubscribers() > 0; }
+
+   // fill the snapshot with the obstacles that are no older than max_age,
+   // looking up the robot's pose in tf_cache if one is given
+   void get_snapshot(ObstacleSnapshot& obstacles, TransformCache* tf_cache = NULL);
+
+   // return distance in meters to closest obstacle.  If stamp is given
+   // it is set to when that obstacle was seen, or zero if there is none.
    float obstacle_dist(bool forward, float &left_dist, float &right_dist,
                        tf2::Vector3 &fl, tf2::Vector3 &fr);
+   float obstacle_dist(const ObstacleSnapshot& obstacles,
+                       bool forward, float &left_dist, float &right_dist,
+                       tf2::Vector3 &fl, tf2::Vector3 &fr,
+                       ros::Time* stamp = NULL);
 
    // return distance in radians to closest obstacle
    float obstacle_angle(bool left);
+   float obstacle_angle(const ObstacleSnapshot& obstacles, bool left);
 
+   // return the angle in radians that the robot can turn through, driving
+   // the arc given by linear and angular velocity, before its footprint
+   // touches an obstacle.  M_PI if there is nothing within half a turn.
    float obstacle_arc_angle(double linear, double angular);
+   float obstacle_arc_angle(const ObstacleSnapshot& obstacles,
+                            double linear, double angular);
 
-   double min_side_dist;
+   // Only drawn in the debug markers.  Set by the obstacle loop while the
+   // action thread runs its own queries, so it is atomic.
+   std::atomic<double> min_side_dist;
    double max_side_dist;
 };
 
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef FOOTPRINT_H
+#define FOOTPRINT_H
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "move_basic/footprint_kernels.h"
+#include "move_basic/obstacle_grid.h"
+
+/*
+ * Robot footprints, as policies for the queries of CollisionChecker,
+ * which are templated on them.  RectangleFootprint keeps the closed form
+ * checks of the rectangle given by robot_width, robot_front_length and
+ * robot_back_length.  PolygonFootprint handles any convex polygon from
+ * the edges, precomputed when it is set.  Both have the same members:
+ *
+ *   bounds()       the extent of the footprint either side of base_frame
+ *   edges()        the corners and the half planes of the edges
+ *   points_dist()  lower the distances for points, as footprint_dist()
+ *   line_dist()    lower the distances for a line segment
+ *   grid_dist()    lower the distances for the occupied cells of a grid
+ *   rotation()     lower the angle the robot can turn in place before
+ *                  its footprint hits a point
+ *   inside()       whether a point is in the footprint
+ *   dist_sq()      the squared distance from a point to the footprint
+ *   circle_crossings()  where a circle crosses the edges
+ *
+ * The distances are those of footprint_dist() for the bounds, so the
+ * clearance ahead is dist.forward - bounds().front_length and so on,
+ * whichever footprint is used.
+ */
+
+// Convex polygon, counterclockwise.  Edge k runs from corner k to corner
+// k+1, with the outward unit normal (nx, ny), so that the inside is
+// where nx*x + ny*y <= c for every edge.
+struct FootprintEdges
+{
+    enum { MAX_CORNERS = 16 };
+
+    int n;
+    float x[MAX_CORNERS], y[MAX_CORNERS];
+    float dx[MAX_CORNERS], dy[MAX_CORNERS], len_sq[MAX_CORNERS];
+    float nx[MAX_CORNERS], ny[MAX_CORNERS], c[MAX_CORNERS];
+
+    FootprintEdges() : n(0) {}
+
+    // Set the corners, in either direction.  Returns false, leaving the
+    // edges as they were, if they don't make a convex polygon.
+    bool set(const std::vector<float>& x, const std::vector<float>& y);
+
+    bool inside(float px, float py) const;
+    float dist_sq(float px, float py) const;
+
+    // Call f(x, y) for each point where the circle about (0, cy) crosses
+    // an edge
+    template <typename F>
+    void circle_crossings(float cy, float r_sq, F f) const;
+};
+
+// Parse a footprint in the format of costmap_2d's footprint parameter,
+// for example "[[0.2, 0.15], [-0.2, 0.15], [-0.2, -0.15], [0.2, -0.15]]".
+// Returns false if the text isn't a list of at least three points.
+bool parse_footprint(const std::string& text, std::vector<float>& x,
+                     std::vector<float>& y);
+
+// Lower min_angle to the rotation that takes a point at angle theta to
+// (x, y), turning left or right
+inline void check_rotation_angle(float theta, float x, float y,
+                                 bool left, float& min_angle)
+{
+    float theta_int = theta - std::atan2(y, x);
+    if (theta_int < -M_PI) {
+        theta_int += 2.0 * M_PI;
+    }
+    if (theta_int > M_PI) {
+        theta_int -= 2.0 * M_PI;
+    }
+    if (left && theta_int > 0 && theta_int < min_angle) {
+        min_angle = theta_int;
+    }
+    if (!left && theta_int < 0 && -theta_int < min_angle) {
+        min_angle = -theta_int;
+    }
+}
+
+class RectangleFootprint
+{
+    FootprintBand band;
+    FootprintEdges corners;
+
+    float width_sq;
+    float front_length_sq;
+    float back_length_sq;
+    float front_diag, back_diag;
+    float r_sq_min;
+
+    void check_dist(float x, FootprintDistances& dist) const;
+
+public:
+    RectangleFootprint();
+    explicit RectangleFootprint(const FootprintBand& band);
+
+    const FootprintBand& bounds() const { return band; }
+    const FootprintEdges& edges() const { return corners; }
+
+    // Points outside this annulus about base_frame can't limit rotation
+    // in place, those inside it are in the footprint at every angle
+    float rotation_r_sq_min() const { return r_sq_min; }
+    float rotation_r_sq_max() const { return std::max(front_diag, back_diag); }
+
+    void points_dist(const float* x, const float* y, size_t n,
+                     FootprintDistances& dist) const
+    {
+        footprint_dist(x, y, n, band, dist);
+    }
+    void line_dist(float x0, float y0, float x1, float y1,
+                   FootprintDistances& dist) const;
+    void grid_dist(const ObstacleGrid& grid, FootprintDistances& dist) const
+    {
+        grid.footprint_dist(band, dist);
+    }
+    void rotation(float x, float y, float r_sq, bool left, float& min_angle) const;
+
+    bool inside(float x, float y) const
+    {
+        return -band.back_length <= x && x <= band.front_length &&
+               -band.width <= y && y <= band.width;
+    }
+    float dist_sq(float px, float py) const
+    {
+        float x = std::max(-band.back_length, std::min(band.front_length, px)) - px;
+        float y = std::max(-band.width, std::min(band.width, py)) - py;
+        return x * x + y * y;
+    }
+
+    template <typename F>
+    void circle_crossings(float cy, float r_sq, F f) const;
+};
+
+class PolygonFootprint
+{
+    FootprintBand band;
+    FootprintEdges corners;
+    float x_min, x_max, y_min, y_max;
+    float r_sq_min, r_sq_max;
+
+    // The edges bounding the footprint ahead and behind, as x = a + b*y,
+    // and on the left and right, as y = a + b*x
+    struct Bound
+    {
+        int n;
+        float a[FootprintEdges::MAX_CORNERS];
+        float b[FootprintEdges::MAX_CORNERS];
+    };
+    Bound ahead, behind, left_side, right_side;
+
+    float front_at(float y) const;
+    float back_at(float y) const;
+    float left_at(float x) const;
+    float right_at(float x) const;
+    void check_side(float x, float y, FootprintDistances& dist) const;
+    void check_point(float x, float y, FootprintDistances& dist) const;
+
+public:
+    PolygonFootprint() : x_min(0), x_max(0), y_min(0), y_max(0),
+                         r_sq_min(0), r_sq_max(0) {}
+
+    // Returns false, leaving the footprint as it was, if the corners
+    // don't make a convex polygon of at most MAX_CORNERS corners
+    bool set(const std::vector<float>& x, const std::vector<float>& y);
+
+    const FootprintBand& bounds() const { return band; }
+    const FootprintEdges& edges() const { return corners; }
+
+    float rotation_r_sq_min() const { return r_sq_min; }
+    float rotation_r_sq_max() const { return r_sq_max; }
+
+    void points_dist(const float* x, const float* y, size_t n,
+                     FootprintDistances& dist) const;
+    void line_dist(float x0, float y0, float x1, float y1,
+                   FootprintDistances& dist) const;
+    void grid_dist(const ObstacleGrid& grid, FootprintDistances& dist) const;
+    void rotation(float x, float y, float r_sq, bool left, float& min_angle) const;
+
+    bool inside(float x, float y) const { return corners.inside(x, y); }
+    float dist_sq(float px, float py) const { return corners.dist_sq(px, py); }
+
+    template <typename F>
+    void circle_crossings(float cy, float r_sq, F f) const
+    {
+        corners.circle_crossings(cy, r_sq, f);
+    }
+};
+
+template <typename F>
+void FootprintEdges::circle_crossings(float cy, float r_sq, F f) const
+{
+    for (int k = 0; k < n; k++) {
+        // |a + t d|^2 = r^2, with a relative to the center
+        const float ay = y[k] - cy;
+        const float b = x[k] * dx[k] + ay * dy[k];
+        const float disc = b * b - len_sq[k] * (x[k] * x[k] + ay * ay - r_sq);
+        if (disc < 0) {
+            continue;
+        }
+        const float root = std::sqrt(disc);
+        for (float t : {(-b - root) / len_sq[k], (-b + root) / len_sq[k]}) {
+            if (0 <= t && t <= 1) {
+                f(x[k] + t * dx[k], y[k] + t * dy[k]);
+            }
+        }
+    }
+}
+
+/*
+ Determine how far the robot can rotate before the point at (x, y),
+ at a squared distance of r_squared, hits the footprint, and store
+ the smallest value
+*/
+inline void RectangleFootprint::rotation(float x, float y, float r_squared,
+                                         bool left, float& min_angle) const
+{
+    const float robot_width = band.width;
+    const float robot_front_length = band.front_length;
+    const float robot_back_length = band.back_length;
+
+    if (r_squared < r_sq_min || r_squared > rotation_r_sq_max()) {
+        return;
+    }
+
+    // initial orientation wrt base_link
+    float theta = std::atan2(y, x);
+
+    // left line segment:
+    //   y = robot_width, -robot_back_length <= x <= robot_front_length
+    // right line segment:
+    //   y = -robot_width, -robot_back_length <= x <= robot_front_length
+    if (width_sq <= r_squared) {
+        float xi = std::sqrt(r_squared - width_sq);
+        if (-robot_back_length <= xi && xi <= robot_front_length) {
+            check_rotation_angle(theta, xi, robot_width, left, min_angle);
+            check_rotation_angle(theta, xi, -robot_width, left, min_angle);
+        }
+        if (-robot_back_length <= -xi && -xi <= robot_front_length) {
+            check_rotation_angle(theta, -xi, robot_width, left, min_angle);
+            check_rotation_angle(theta, -xi, -robot_width, left, min_angle);
+        }
+    }
+
+    // back line segment:
+    //   x = -robot_back_length, -robot_width <= y <= robot_width
+    if (x < 0 && back_length_sq <= r_squared) {
+        float yi = std::sqrt(r_squared - back_length_sq);
+        if (-robot_width <= yi && yi <= robot_width) {
+            check_rotation_angle(theta, -robot_back_length, yi, left, min_angle);
+        }
+        if (-robot_width <= -yi && -yi <= robot_width) {
+            check_rotation_angle(theta, -robot_back_length, -yi, left, min_angle);
+        }
+    }
+
+    // front line segment:
+    //   x = robot_front_length, -robot_width <= y <= robot_width
+    if (x > 0 && r_squared <= front_diag && front_length_sq <= r_squared) {
+        float yi = std::sqrt(r_squared - front_length_sq);
+        if (-robot_width <= yi && yi <= robot_width) {
+            check_rotation_angle(theta, robot_front_length, yi, left, min_angle);
+        }
+        if (-robot_width <= -yi && -yi <= robot_width) {
+            check_rotation_angle(theta, robot_front_length, -yi, left, min_angle);
+        }
+    }
+}
+
+template <typename F>
+void RectangleFootprint::circle_crossings(float cy, float r_sq, F f) const
+{
+    const float front = band.front_length;
+    const float back = -band.back_length;
+    const float width = band.width;
+
+    // front and back edges
+    for (float x : {front, back}) {
+        float h = r_sq - x * x;
+        if (h >= 0) {
+            float root = std::sqrt(h);
+            for (float y : {cy - root, cy + root}) {
+                if (-width <= y && y <= width) {
+                    f(x, y);
+                }
+            }
+        }
+    }
+    // side edges
+    for (float y : {width, -width}) {
+        float h = r_sq - (y - cy) * (y - cy);
+        if (h >= 0) {
+            float root = std::sqrt(h);
+            for (float x : {-root, root}) {
+                if (back <= x && x <= front) {
+                    f(x, y);
+                }
+            }
+        }
+    }
+}
+
+// The x of the front and back edges at y, and the y of the side edges
+// at x, which are only meaningful within the footprint's extent
+
+inline float PolygonFootprint::front_at(float y) const
+{
+    float x = ahead.a[0] + ahead.b[0] * y;
+    for (int k = 1; k < ahead.n; k++) {
+        x = std::min(x, ahead.a[k] + ahead.b[k] * y);
+    }
+    return x;
+}
+
+inline float PolygonFootprint::back_at(float y) const
+{
+    float x = behind.a[0] + behind.b[0] * y;
+    for (int k = 1; k < behind.n; k++) {
+        x = std::max(x, behind.a[k] + behind.b[k] * y);
+    }
+    return x;
+}
+
+inline float PolygonFootprint::left_at(float x) const
+{
+    float y = left_side.a[0] + left_side.b[0] * x;
+    for (int k = 1; k < left_side.n; k++) {
+        y = std::min(y, left_side.a[k] + left_side.b[k] * x);
+    }
+    return y;
+}
+
+inline float PolygonFootprint::right_at(float x) const
+{
+    float y = right_side.a[0] + right_side.b[0] * x;
+    for (int k = 1; k < right_side.n; k++) {
+        y = std::max(y, right_side.a[k] + right_side.b[k] * x);
+    }
+    return y;
+}
+
+// Lower the left or right distance for a point within the length of
+// the footprint, by which side of its middle the point is on, as the
+// rectangle does with base_frame's x axis
+inline void PolygonFootprint::check_side(float x, float y,
+                                         FootprintDistances& dist) const
+{
+    const float left = left_at(x);
+    const float right = right_at(x);
+    if (y > 0.5f * (left + right)) {
+        dist.left = std::min(dist.left, y - left + band.width);
+    }
+    else if (y < 0.5f * (left + right)) {
+        dist.right = std::min(dist.right, right - y + band.width);
+    }
+}
+
+// Lower dist for a point, compared to the edges either side of it
+inline void PolygonFootprint::check_point(float x, float y,
+                                          FootprintDistances& dist) const
+{
+    // Forward and rear
+    if (y_min < y && y < y_max) {
+        const float front = front_at(y);
+        const float back = back_at(y);
+        if (x > front) {
+            dist.forward = std::min(dist.forward, x - front + band.front_length);
+        }
+        if (x < back) {
+            dist.back = std::min(dist.back, back - x + band.back_length);
+        }
+    }
+    // Sides
+    if (x_min < x && x < x_max) {
+        check_side(x, y, dist);
+    }
+}
+
+inline void PolygonFootprint::points_dist(const float* x, const float* y, size_t n,
+                                          FootprintDistances& dist) const
+{
+    for (size_t i = 0; i < n; i++) {
+        check_point(x[i], y[i], dist);
+    }
+}
+
+inline void PolygonFootprint::rotation(float x, float y, float r_sq,
+                                       bool left, float& min_angle) const
+{
+    if (r_sq < r_sq_min || r_sq > r_sq_max) {
+        return;
+    }
+    const float theta = std::atan2(y, x);
+    corners.circle_crossings(0, r_sq, [&](float cx, float cy) {
+        check_rotation_angle(theta, cx, cy, left, min_angle);
+    });
+}
+
+#endif
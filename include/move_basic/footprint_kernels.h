@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef FOOTPRINT_KERNELS_H
+#define FOOTPRINT_KERNELS_H
+
+#include <cstddef>
+
+// Rectangular robot footprint, relative to base_frame
+struct FootprintBand
+{
+    float width;          // either side of base_frame
+    float front_length;   // forward of base_frame
+    float back_length;    // behind base_frame
+};
+
+// Running minimum distances to obstacles around the footprint
+struct FootprintDistances
+{
+    float forward;  // x of the closest point ahead, within the width
+    float back;     // -x of the closest point behind, within the width
+    float left;     // y of the closest point to the left, within the length
+    float right;    // -y of the closest point to the right, within the length
+};
+
+/*
+ * Lowers the distances in `dist` to account for the n points given by
+ * the x and y arrays.  The result is identical to checking each point
+ * in turn, whichever implementation is used.
+ */
+void footprint_dist(const float* x, const float* y, size_t n,
+                    const FootprintBand& band, FootprintDistances& dist);
+
+// Plain C++ implementation, used when no vector unit is available
+void footprint_dist_scalar(const float* x, const float* y, size_t n,
+                           const FootprintBand& band, FootprintDistances& dist);
+
+// Name of the implementation selected for this CPU by footprint_dist()
+const char* footprint_kernel_name();
+
+#endif
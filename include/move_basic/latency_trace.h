@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Timestamps of the stages between a sensor reading and the velocity
+// command that was worked out from it.  The last few hundred of each are
+// kept in ring buffers, to report the latencies as percentiles or dump as
+// a trace.  While disabled nothing is recorded, and the callers only pay
+// for checking enabled() before they take the time.
+class LatencyTrace
+{
+public:
+    // The stages of a velocity command: the newest sensor reading in its
+    // snapshot, taking the snapshot, the collision queries on it, and
+    // publishing the command
+    enum Stage {SENSOR, SNAPSHOT, QUERY_START, QUERY_END, COMMAND, NUM_STAGES};
+    static const char* const STAGE_NAMES[NUM_STAGES];
+
+    // Times [s] of the stages of one command, 0 for those it didn't reach
+    struct Cycle
+    {
+        double time[NUM_STAGES];
+
+        Cycle() { clear(); }
+        void clear();
+    };
+
+    struct Percentiles
+    {
+        size_t count;
+        double p50, p90, p99, max;   // [s]
+    };
+
+    struct Summary
+    {
+        // From the sensor stamp to the callback that received it
+        Percentiles callback;
+        // interval[k] from stage k to stage k+1 of the commands
+        Percentiles interval[NUM_STAGES - 1];
+        // From the sensor stamp to the command
+        Percentiles end_to_end;
+    };
+
+    // Keep the latest capacity callbacks and commands
+    explicit LatencyTrace(size_t capacity = 512);
+
+    void enable(bool on) { on_flag.store(on, std::memory_order_relaxed); }
+    bool enabled() const { return on_flag.load(std::memory_order_relaxed); }
+
+    // A sensor message stamped stamp [s] reached its callback at entry [s]
+    void record_callback(double stamp, double entry);
+
+    // A command went through the stages of cycle
+    void record_cycle(const Cycle& cycle);
+
+    // Latencies of the callbacks and commands in the buffers
+    Summary summarize() const;
+
+    // The buffers in the Chrome trace event format, for chrome://tracing
+    // and Perfetto
+    void write_chrome_trace(std::ostream& out) const;
+
+private:
+    std::atomic<bool> on_flag;
+    size_t capacity;
+
+    mutable std::mutex mutex;
+    struct Callback
+    {
+        double stamp, entry;
+    };
+    std::vector<Callback> callbacks;
+    size_t next_callback;
+    std::vector<Cycle> cycles;
+    size_t next_cycle;
+};
+
+#endif
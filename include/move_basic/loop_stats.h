@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef LOOP_STATS_H
+#define LOOP_STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+// Timing of a periodic control loop.  The loop calls record() once per
+// iteration, and another thread can collect the figures with take().
+class LoopStats
+{
+public:
+    // Iteration durations are binned as fractions of the period, bucket
+    // k holding those up to BUCKET_LIMITS[k], the last one the rest
+    static const size_t NUM_BUCKETS = 6;
+    static const double BUCKET_LIMITS[NUM_BUCKETS - 1];
+
+    struct Summary
+    {
+        double period;             // [s]
+        uint64_t iterations;
+        uint64_t overruns;         // iterations that took longer than period
+        uint64_t total_overruns;   // since the loop was created
+        double mean_duration;      // [s]
+        double max_duration;       // [s]
+        // deviation of the time between iterations from period [s]
+        double mean_jitter;
+        double max_jitter;
+        uint64_t histogram[NUM_BUCKETS];
+    };
+
+    LoopStats();
+
+    // Start timing a loop running at period [s].  The gap since any
+    // previous iteration doesn't count towards the jitter.
+    void start(double period);
+
+    // Record an iteration that did duration [s] of work, called at the
+    // same point in each iteration
+    void record(double duration);
+
+    // The figures since the last call, which then start again
+    Summary take();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::mutex mutex;
+    Summary current;
+    bool running;
+    Clock::time_point last;
+    double total_duration;
+    double total_jitter;
+    uint64_t intervals;
+
+    void clear();
+};
+
+#endif
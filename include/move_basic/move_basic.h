@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2017-21, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef MOVE_BASIC_H
+#define MOVE_BASIC_H
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <tf2/LinearMath/Transform.h>
+#include <tf2_ros/buffer.h>
+#include <tf2_ros/transform_listener.h>
+#include <geometry_msgs/PoseStamped.h>
+#include <std_msgs/Bool.h>
+#include <move_base_msgs/MoveBaseAction.h>
+#include <dynamic_reconfigure/server.h>
+#include "move_basic/collision_checker.h"
+#include "move_basic/latency_trace.h"
+#include "move_basic/loop_stats.h"
+#include "move_basic/obstacle_points.h"
+#include "move_basic/queued_action_server.h"
+#include "move_basic/transform_cache.h"
+#include <move_basic/MovebasicConfig.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <atomic>
+
+typedef actionlib::QueuedActionServer<move_base_msgs::MoveBaseAction> MoveBaseActionServer;
+
+class MoveBasic {
+  private:
+    ros::Subscriber goalSub;
+    ros::Subscriber stopSub;
+
+    ros::Publisher goalPub;
+    ros::Publisher cmdPub;
+    ros::Publisher pathPub;
+    ros::Publisher obstacleDistPub;
+    ros::Publisher errorPub;
+    ros::Publisher localizationWaitPub;
+    ros::Publisher diagnosticsPub;
+
+    std::unique_ptr<MoveBaseActionServer> actionServer;
+    std::unique_ptr<CollisionChecker> collision_checker;
+    std::unique_ptr<ObstaclePoints> obstacle_points;
+
+    tf2_ros::Buffer tfBuffer;
+    tf2_ros::TransformListener listener;
+    // Only used from the action thread
+    TransformCache tfCache;
+    // Only used from the obstacle thread, in run()
+    TransformCache runTfCache;
+
+    // Stages from the sensors to each velocity command, the callbacks
+    // record into it so it is declared before their threads
+    LatencyTrace latencyTrace;
+    // The command being worked out, only used from the action thread
+    LatencyTrace::Cycle traceCycle;
+    std::string latencyTraceFile;
+
+    // Sensor callbacks are served by their own threads, so that they
+    // aren't delayed by the control loops or the other callbacks.
+    // Declared after what the callbacks use, so the threads stop first.
+    ros::CallbackQueue sensorQueue;
+    std::unique_ptr<ros::AsyncSpinner> sensorSpinner;
+
+    double minTurningVelocity;
+    double maxTurningVelocity;
+    double turningAcceleration;
+    double angularTolerance;
+    double maxLateralVelocity;
+
+    double maxLinearVelocity;
+    double minLinearVelocity;
+    double linearAcceleration;
+    double linearTolerance;
+
+    double lateralKp;
+    double lateralKi;
+    double lateralKd;
+
+    double obstacleWaitThreshold;
+    double forwardObstacleThreshold;
+    double minSideDist;
+    double localizationLatency;
+    // Time spent waiting for localization after motions, since startup [s]
+    double localizationTimeWaited;
+    double runawayTimeoutSecs;
+    bool compensateSensorAge;
+    double blendHeadingCone;
+    double obstacleRate;
+    double idleObstacleRate;
+    double controlRate;
+
+    // Timing of run(), and of rotate() and moveLinear()
+    LoopStats obstacleLoopStats;
+    LoopStats controlLoopStats;
+    std::atomic<bool> stop;
+    std::atomic<bool> running;
+    // set while a goal is being executed
+    std::atomic<bool> goalActive;
+
+    // The results of run()'s last check, published and swapped in as a
+    // whole under obstacleDistMutex, so the action thread never sees
+    // half of one.  moveLinear() only logs them and takes its own snapshot.
+    struct ObstacleDistances
+    {
+        float forward;
+        float left;
+        float right;
+        tf2::Vector3 forwardLeft;
+        tf2::Vector3 forwardRight;
+
+        ObstacleDistances() : forward(0), left(0), right(0) {}
+    };
+    std::mutex obstacleDistMutex;
+    ObstacleDistances obstacleDistances;
+
+    // Reused every control cycle; run() and the action thread have their own
+    ObstacleSnapshot runObstacles;
+    ObstacleSnapshot driveObstacles;
+
+    std::string preferredPlanningFrame;
+    std::string alternatePlanningFrame;
+    std::string preferredDrivingFrame;
+    std::string alternateDrivingFrame;
+    std::string baseFrame;
+
+    dynamic_reconfigure::Server<move_basic::MovebasicConfig> dr_srv;
+
+    void dynamicReconfigCallback(move_basic::MovebasicConfig& config, uint32_t);
+    void stopCallback(const std_msgs::Bool::ConstPtr& msg);
+    void goalCallback(const geometry_msgs::PoseStamped::ConstPtr &msg);
+    void executeAction(const move_base_msgs::MoveBaseGoalConstPtr& goal);
+    void drawLine(double x0, double y0, double x1, double y1);
+    void sendCmd(double angular, double linear);
+    void traceStage(LatencyTrace::Stage stage);
+    void abortGoal(const std::string msg);
+    void waitForLocalization(const std::string& planningFrame);
+    void publishLoopStats();
+
+    bool getTransform(const std::string& from, const std::string& to,
+                      tf2::Transform& tf);
+    bool transformPose(const std::string& from, const std::string& to,
+                       const tf2::Transform& in, tf2::Transform& out);
+
+  public:
+    // nh is used for the action server, privateNh for the parameters
+    MoveBasic(ros::NodeHandle& nh, ros::NodeHandle& privateNh);
+    ~MoveBasic();
+
+    // Obstacle loop, returns after requestShutdown() or ROS shutdown
+    void run();
+    // Makes run() and any goal being executed return, so the node can
+    // be destroyed while ROS keeps running
+    void requestShutdown();
+
+    bool moveLinear(tf2::Transform& goalInDriving,
+                    const std::string& drivingFrame);
+    // Rotation ends within tolerance of requestedYaw.  A tolerance wider
+    // than angular_tolerance ends it without stopping, for blending.
+    bool rotate(double requestedYaw,
+                const std::string& drivingFrame,
+                double tolerance);
+
+    tf2::Transform goalInPlanning;
+};
+
+#endif
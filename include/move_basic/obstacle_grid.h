@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef OBSTACLE_GRID_H
+#define OBSTACLE_GRID_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "move_basic/footprint_kernels.h"
+
+/*
+ * Occupancy bitmap of the obstacles around the robot, in base_frame and
+ * centred on it.  Row r holds the cells with y in [y_min(r), y_min(r) +
+ * resolution), one bit per cell packed into 64 bit words along x.  The
+ * footprint queries then OR and scan a few words per row instead of
+ * visiting every point.  Obstacles outside the grid are dropped, and the
+ * results are only as good as the cell size.
+ */
+class ObstacleGrid
+{
+  float resolution;
+  int cells;
+  int words_per_row;
+  std::vector<uint64_t> bits;
+
+public:
+  // Widest grid, so that a row can be held on the stack
+  static const int MAX_CELLS = 1024;
+
+  ObstacleGrid() : resolution(0), cells(0), words_per_row(0) {}
+
+  // Use cells x cells cells, rounded up to a multiple of 64, of size
+  // resolution [m], and clear them.  A grid that was never reset is
+  // disabled.
+  void reset(float resolution, int cells);
+  bool enabled() const { return cells > 0; }
+  // Empty the cells, keeping the size
+  void clear();
+
+  float cell_size() const { return resolution; }
+  int size() const { return cells; }
+
+  // Cell index of a coordinate, -1 or size() for coordinates off the
+  // grid, and -1 for NaN
+  int index_of(float v) const;
+  // Lower edge and centre of cell i
+  float cell_min(int i) const { return (i - cells / 2) * resolution; }
+  float cell_center(int i) const { return cell_min(i) + 0.5f * resolution; }
+
+  void mark(float x, float y);
+  // Mark every cell that the segment passes through
+  void mark_line(float x0, float y0, float x1, float y1);
+  bool occupied(int col, int row) const;
+
+  /*
+   * Lowers the distances in `dist` to account for the occupied cells,
+   * as footprint_dist() does for points.  A cell counts if any part of
+   * it could, and its distance is that of its nearest edge but no
+   * closer than the front or back of the footprint.  So the distances
+   * are never more than those of the points in the cells, and at most
+   * one cell less.
+   */
+  void footprint_dist(const FootprintBand& band, FootprintDistances& dist) const;
+
+  // Call f(x, y) with the centre of each occupied cell overlapping the
+  // box [x_min, x_max] x [y_min, y_max]
+  template <typename F>
+  void for_each_cell(float x_min, float x_max, float y_min, float y_max, F f) const;
+
+private:
+  void row_range(float lo, float hi, int& first, int& last) const;
+};
+
+template <typename F>
+void ObstacleGrid::for_each_cell(float x_min, float x_max, float y_min, float y_max,
+                                 F f) const
+{
+  int col_first, col_last, row_first, row_last;
+  row_range(x_min, x_max, col_first, col_last);
+  row_range(y_min, y_max, row_first, row_last);
+  for (int row = row_first; row <= row_last; row++) {
+    const uint64_t* words = &bits[row * words_per_row];
+    for (int w = col_first / 64; w <= col_last / 64 && w < words_per_row; w++) {
+      uint64_t word = words[w];
+      while (word) {
+        int col = w * 64 + __builtin_ctzll(word);
+        word &= word - 1;
+        if (col_first <= col && col <= col_last) {
+          f(cell_center(col), cell_center(row));
+        }
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef OBSTACLE_MEMORY_H
+#define OBSTACLE_MEMORY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Recent obstacle segments in a fixed frame such as odom, so that an
+// obstacle that a sonar loses between pings is still seen for a while,
+// where it was, however the robot has moved since.  The segments are
+// kept in NUM_BUCKETS buckets by age, each with a fixed share of the
+// budget, so expiring drops whole buckets and the memory never grows.
+// Not thread safe.
+class ObstacleMemory
+{
+public:
+    static const size_t NUM_BUCKETS = 8;
+
+    struct Segment
+    {
+        float x0, y0, x1, y1;
+    };
+
+    ObstacleMemory();
+
+    // Keep the segments seen over the last duration [s], up to capacity
+    // of them, forgetting any held.  A duration of 0 disables the memory.
+    void reset(double duration, size_t capacity);
+    bool enabled() const { return duration > 0; }
+
+    // Forget the buckets that are older than duration at now [s]
+    void expire(double now);
+
+    // Remember a segment seen at stamp [s].  Returns false if it is
+    // already too old, or the bucket for its age is full.
+    bool add(const Segment& segment, double stamp);
+
+    size_t size() const;
+    // the most segments held at once
+    size_t capacity() const { return segments.size(); }
+    // segments that didn't fit since the reset
+    uint64_t dropped() const { return dropped_count; }
+
+    // Calls f(segment, start) for each segment held, where start [s] is
+    // when the bucket holding it began, so no later than it was seen
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (size_t k = 0; k < NUM_BUCKETS; k++) {
+            size_t bucket = (head + NUM_BUCKETS - k) % NUM_BUCKETS;
+            if (counts[bucket] == 0) {
+                continue;
+            }
+            double start = (head_index - static_cast<int64_t>(k)) * bucket_duration;
+            const Segment* first = &segments[bucket * bucket_capacity];
+            for (size_t i = 0; i < counts[bucket]; i++) {
+                f(first[i], start);
+            }
+        }
+    }
+
+private:
+    double duration;
+    double bucket_duration;
+    size_t bucket_capacity;
+    std::vector<Segment> segments;
+    size_t counts[NUM_BUCKETS];
+    // the bucket being filled, and which period of bucket_duration since
+    // time 0 it holds
+    size_t head;
+    int64_t head_index;
+    bool started;
+
+    int64_t index_of(double stamp) const;
+    uint64_t dropped_count;
+};
+
+#endif
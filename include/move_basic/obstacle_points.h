@@ -33,8 +33,13 @@
 #define OBSTACLE_POINTS_H
 
 #include <vector>
+#include <set>
+#include <unordered_map>
 #include <utility>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
 
 #include <ros/ros.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
@@ -42,25 +47,13 @@
 #include <tf2_ros/transform_listener.h>
 #include <sensor_msgs/Range.h>
 #include <sensor_msgs/LaserScan.h>
+#include <tf2_msgs/TFMessage.h>
+#include <move_basic/RangeArray.h>
 
-// lidar sensor
-class LidarSensor
-{
-public:
-    std::string frame_id;
-    double angle_increment;
-    double min_range;
-    double max_range;
-    double min_angle;
-    double max_angle;
-    LidarSensor() {};
-    void reset(const std::string & _frame,
-               const int _increment,
-               const double & _min_range,
-               const double & _max_range,
-               const double & _min_angle,
-               const double & _max_angle);
-};
+#include "move_basic/latency_trace.h"
+#include "move_basic/obstacle_grid.h"
+#include "move_basic/obstacle_memory.h"
+#include "move_basic/transform_cache.h"
 
 // a single sensor with current obstacles
 class RangeSensor
@@ -76,8 +69,10 @@ public:
     tf2::Vector3 left_vertex;
     tf2::Vector3 right_vertex;
     ros::Time stamp;
+    // how many times the geometry has changed since the sensor was added
+    uint32_t geometry;
 
-    RangeSensor() {};
+    RangeSensor() : geometry(0) {};
     RangeSensor(int id, std::string frame_id,
                 const tf2::Vector3& origin,
                 const tf2::Vector3& left_vec,
@@ -86,47 +81,331 @@ public:
     void update(float range, ros::Time stamp);
 };
 
-class ObstaclePoints
+// Obstacle points in base_frame, stored as a structure of arrays so
+// that the collision checks can stream over contiguous x and y values
+class PlanarPoints
 {
-private:
-  // Line in polar form
-  class PolarLine
+public:
+  // Width of the rings of the radius index [m], points further out
+  // than the last ring are all kept in the last ring
+  static const float RING_WIDTH;
+  static const size_t NUM_RINGS = 64;
+
+  std::vector<float> x;
+  std::vector<float> y;
+
+  // Optional index by distance from base_frame, see sort_by_radius().
+  // r_sq holds the squared distance of each point, and the points
+  // in ring k are those from ring_start[k] to ring_start[k+1].
+  std::vector<float> r_sq;
+  std::vector<uint32_t> ring_start;
+
+  size_t size() const { return x.size(); }
+  bool empty() const { return x.empty(); }
+  void clear() { x.clear(); y.clear(); r_sq.clear(); ring_start.clear(); }
+  void reserve(size_t n) { x.reserve(n); y.reserve(n); }
+  void push_back(float px, float py) { x.push_back(px); y.push_back(py); }
+  void push_back(const tf2::Vector3& p) { push_back(p.x(), p.y()); }
+  void swap(PlanarPoints& other) {
+    x.swap(other.x); y.swap(other.y);
+    r_sq.swap(other.r_sq); ring_start.swap(other.ring_start);
+  }
+
+  // The ring of the index that a squared distance falls in
+  static size_t ring_of(float r_sq);
+
+  // Replace the contents with the points of `unsorted`, ordered by ring.
+  // unsorted.r_sq and rings give the squared distance and ring of each
+  // point, so that they are only worked out once.
+  void sort_by_radius(const PlanarPoints& unsorted,
+                      const std::vector<uint8_t>& rings);
+
+  // The range of points that may have a squared distance between
+  // r_sq_min and r_sq_max.  That is all the points if there is no index.
+  void radius_range(float r_sq_min, float r_sq_max, size_t& begin, size_t& end) const;
+};
+
+// The points of one lidar scan
+class ScanPoints : public PlanarPoints
+{
+public:
+  ros::Time stamp;
+  // the geometry of the lidar that the scan was converted with
+  uint32_t geometry;
+
+  ScanPoints() : geometry(0) {}
+};
+
+// Which beams of a lidar are kept when its scans come in, the others
+// never reach the snapshots
+struct ScanRoi
+{
+    // beams further than this are dropped, 0 for no limit [m]
+    float max_range;
+    // the beams between these angles are kept, in the lidar's frame [rad].
+    // The window wraps around if min_angle > max_angle.
+    float min_angle;
+    float max_angle;
+    // beams between n and n+1 times this far are thinned to one in n,
+    // 0 to keep them all [m]
+    float decimation_range;
+
+    ScanRoi();
+    bool contains(double angle) const;
+};
+
+// The indexed scan buffers of a lidar, see LidarSensor
+struct ScanPool;
+
+// lidar sensor, with its position and the points from its last scan
+class LidarSensor
+{
+    // Direction in base_frame of each beam in the region of interest,
+    // from the scan angles and the orientation of the scanner, so a
+    // range maps straight to a point.  beam_index holds the index of
+    // each in the scan's ranges, and lut_beams the number of ranges in
+    // the scans they were built for.
+    std::vector<float> beam_x, beam_y;
+    std::vector<uint32_t> beam_index;
+    size_t lut_beams;
+    // bumped by set_geometry(), and given to each scan
+    uint32_t geometry;
+    // points from the last scan, and their rings, before they are indexed
+    PlanarPoints scan_points;
+    std::vector<uint8_t> scan_rings;
+    // A fixed set of buffers for the indexed scans, made with the
+    // sensor.  Readers keep a published scan for as long as they use it,
+    // and a buffer is only refilled once the last of them has let go.
+    // Each published scan keeps the pool alive, so it can outlive the
+    // sensor.
+    std::shared_ptr<ScanPool> pool;
+    // beams that the buffers were sized for, 0 if none.  reserve() asks
+    // for a size, which update() applies on the thread that fills them.
+    size_t reserved_beams;
+    void size_buffers(size_t beams);
+    // The latest complete scan, only accessed with atomic_load/store
+    std::shared_ptr<const ScanPoints> latest;
+
+public:
+    // Scans held at once by default.  One is the latest and one is
+    // being filled, the rest are for the snapshots that can hold a scan:
+    // the node's obstacle loop and drive loop, the collision checker's
+    // own, and one spare.  A scan that finds them all held is dropped.
+    static const size_t DEFAULT_SCAN_BUFFERS = 6;
+    // Fewer and the latest scan and a single reader would stall updates
+    static const size_t MIN_SCAN_BUFFERS = 3;
+
+    int id;
+    std::string frame_id;
+    double angle_increment;
+    double min_range;
+    double max_range;
+    double min_angle;
+    double max_angle;
+    // position and direction of the scanner in base_frame, changed
+    // with set_geometry()
+    tf2::Vector3 origin;
+    tf2::Vector3 normal;
+    ScanRoi roi;
+
+    LidarSensor();
+    LidarSensor(int id, std::string frame_id,
+                const tf2::Vector3& origin,
+                const tf2::Vector3& normal,
+                const ScanRoi& roi = ScanRoi(),
+                size_t scan_buffers = DEFAULT_SCAN_BUFFERS);
+    void reset(const std::string & _frame,
+               const double & _increment,
+               const double & _min_range,
+               const double & _max_range,
+               const double & _min_angle,
+               const double & _max_angle);
+
+    void set_geometry(const tf2::Vector3& origin, const tf2::Vector3& normal);
+
+    // Size the buffers for scans of up to beams beams.  Safe to call
+    // while another thread updates the lidar, the buffers are sized by
+    // the next update().
+    void reserve(size_t beams);
+
+    // The number of scans that can be held at once
+    size_t scan_buffers() const;
+
+    // Converts a scan into a free buffer and publishes it, without
+    // allocating once the buffers have grown to size.  The ranges
+    // are read in place from the message, nothing is kept from it.
+    // Only one thread may update a lidar, but any number can read it
+    // meanwhile.
+    void update(const sensor_msgs::LaserScan& msg);
+    // The points from the last scan in base_frame, indexed by radius,
+    // or null before the first scan.  The scan never changes.
+    std::shared_ptr<const ScanPoints> points() const;
+};
+
+/*
+ * The obstacles seen at one instant, in base_frame.  The buffers are
+ * owned by the caller and reused, so refreshing a snapshot every
+ * control cycle does not allocate once they have grown to size.
+ * Several collision queries in the same cycle can share one snapshot.
+ */
+class ObstacleSnapshot
+{
+public:
+  // A point in base_frame, packed into two floats like the rest of the
+  // snapshot.  It converts from a tf2::Vector3, dropping z.
+  struct Vertex
   {
-  public:
-     float radius;
-     float theta;
+    float px, py;
 
-     PolarLine(float radius, float theta);
+    Vertex() : px(0), py(0) {}
+    Vertex(float x, float y) : px(x), py(y) {}
+    Vertex(const tf2::Vector3& p) : px(p.x()), py(p.y()) {}
+    float x() const { return px; }
+    float y() const { return py; }
   };
+  typedef std::pair<Vertex, Vertex> Line;
+
+  // latest scan from each lidar indexed by radius, or null if it is
+  // too old.  The scans are shared with ObstaclePoints, not copied.
+  std::vector<std::shared_ptr<const PlanarPoints>> lidars;
+  // sonar cone vertices and test points
+  PlanarPoints points;
+  std::vector<Line> lines;
+  ros::Time stamp;
+
+  // Where the obstacles came from, so that the collision checks can
+  // reuse their results for the sensors that haven't published or
+  // moved since.  lidar_stamps and lidar_geometry hold the stamp of
+  // each scan in lidars and the geometry of its lidar.  lines[i] came
+  // from the sonar line_sources[i] and has its ends at points 2i and
+  // 2i+1, the points after the sonars' are test points.  Lines that
+  // were remembered rather than just seen have a source id of -1, and
+  // the stamp of when they were first seen.  They are already where the
+  // robot is now, so the collision checks count them as seen at stamp.
+  // Snapshots filled by hand can leave these empty, and are then
+  // checked in full.
+  struct Source
+  {
+    int id;
+    ros::Time stamp;
+    // changes whenever the sensor's transform to base_frame does
+    uint32_t geometry;
 
+    Source(int id, const ros::Time& stamp, uint32_t geometry = 0) :
+      id(id), stamp(stamp), geometry(geometry) {}
+  };
+  std::vector<ros::Time> lidar_stamps;
+  std::vector<uint32_t> lidar_geometry;
+  std::vector<Source> line_sources;
+
+  // All of the above rasterized, if ObstaclePoints is set to use the
+  // grid backend.  The collision checks use the grid when it is enabled.
+  ObstacleGrid grid;
+
+  void clear();
+  // Size the buffers for this many lidars and lines, see
+  // ObstaclePoints::reserve_snapshot()
+  void reserve(size_t lidars, size_t lines);
+};
+
+class ObstaclePoints
+{
+private:
   std::mutex points_mutex;
 
   std::string baseFrame;
 
-  LidarSensor lidar;
-  std::map<std::string, RangeSensor> sensors;
+  // Only used by the scan callbacks, readers go through lidar_table
+  std::mutex lidars_mutex;
+  std::map<std::string, LidarSensor> lidars;
+  std::set<std::string> stale_lidars;
+  // The lidars by id, replaced when one is added.  Only accessed with
+  // atomic_load/store, so readers never wait for a scan callback.
+  std::shared_ptr<const std::vector<const LidarSensor*>> lidar_table;
+
+  // The sonars by id.  Frames are interned to the id of their sonar
+  // when first seen, so each reading is a hash lookup and an index.
+  std::vector<RangeSensor> sonars;
+  std::unordered_map<std::string, int> sonar_ids;
   ros::Subscriber sonar_sub;
-  ros::Subscriber scan_sub;
+  std::vector<ros::Subscriber> sonar_array_subs;
+  std::vector<ros::Subscriber> scan_subs;
+  ros::Subscriber tf_static_sub;
   tf2_ros::Buffer& tf_buffer;
 
-  bool have_lidar;
-  tf2::Vector3 lidar_origin;
-  tf2::Vector3 lidar_normal;
-  std::vector<PolarLine> lidar_points;
-  ros::Time lidar_stamp;
+  // Sensor to base transforms are static, so they are resolved when a
+  // sensor is first seen and again after /tf_static changes
+  // stale_sonars is indexed by sonar id
+  std::vector<bool> stale_sonars;
+  // Whether frame, or a frame between it and base_frame, is in changed
+  bool moved_by(const std::string& frame, const std::set<std::string>& changed) const;
+  // The latest /tf_static transform of each child frame.  The listener
+  // may not have put it in tf_buffer yet when tf_static_callback runs,
+  // so a stale sensor is only resolved again once it has.
+  std::mutex static_mutex;
+  std::map<std::string, geometry_msgs::TransformStamped> static_transforms;
+  // Whether tf_buffer has the /tf_static transforms between frame and
+  // base_frame
+  bool static_tf_arrived(const std::string& frame);
+  bool lookup_sensor_tf(const std::string& frame,
+                        geometry_msgs::TransformStamped& tf);
+
+  // Update the sonar of a reading, with points_mutex held.  Returns
+  // the sonar, or null if it isn't known yet.
+  RangeSensor* update_sonar(const sensor_msgs::Range& msg);
+
+  // Recent sonar echoes in odom_frame, see obstacle_memory.  Guarded
+  // by points_mutex.
+  ObstacleMemory memory;
+  std::string odom_frame;
+  void remember(const RangeSensor& sensor, const sensor_msgs::Range& msg,
+                const tf2::Transform& base_to_odom);
+  // Where the robot was in odom_frame when a reading was taken, or
+  // the latest pose if tf has nothing for its stamp
+  bool lookup_base_to_odom(const ros::Time& stamp, tf2::Transform& base_to_odom);
+
+  // Regions of interest of the lidars, by frame, and for the rest
+  ScanRoi default_roi;
+  std::map<std::string, ScanRoi> lidar_rois;
+
+  // Rasterize each snapshot into its grid, see collision_backend
+  bool use_grid;
+  float grid_resolution;
+  int grid_cells;
+  void rasterize(ObstacleSnapshot& snapshot) const;
 
-  // Sine / Cosine LookUp Tables
-  std::vector<float> sinLUT, cosLUT;
+  void init(ros::NodeHandle* nh);
 
   // Manually added points, used for unit testing things that
   // use ObstaclePoints without having to go through ROS messages
   std::vector<tf2::Vector3> test_points;
 
+  // The most sensors and beams that the buffers are sized for, 0 if
+  // they grow to fit.  max_scan_beams is guarded by lidars_mutex.
+  size_t max_lidars;
+  size_t max_scan_beams;
+  size_t max_sonars;
+  // Scans each lidar can have held at once, from scan_buffers
+  size_t scan_buffers;
+
+  // Sensor messages taken in so far
+  std::atomic<uint64_t> updates;
+
+  // Where the callbacks record when each message arrived, or null
+  LatencyTrace* trace;
+  void trace_callback(const ros::Time& stamp) const;
+
 public:
   ObstaclePoints(ros::NodeHandle& nh, tf2_ros::Buffer& tf_buffer);
 
+  // Use the default parameters and subscribe to nothing, the callbacks
+  // are called directly.  For tools that run without a ROS master.
+  ObstaclePoints(tf2_ros::Buffer& tf_buffer);
+
   void range_callback(const sensor_msgs::Range::ConstPtr &msg);
+  void range_array_callback(const move_basic::RangeArray::ConstPtr &msg);
   void scan_callback(const sensor_msgs::LaserScan::ConstPtr &msg);
+  void tf_static_callback(const tf2_msgs::TFMessage::ConstPtr &msg);
 
   /*
    * Returns a vector of all the points that were detected, filtered
@@ -144,11 +423,47 @@ public:
   typedef std::pair<tf2::Vector3, tf2::Vector3> Line;
   std::vector<Line> get_lines(ros::Duration max_age);
 
+  /*
+   * Fills the snapshot with all the points and lines that were detected,
+   * filtered by the maximum age.  The snapshot's buffers are reused.
+   * The pose in odom_frame comes from tf_cache if one is given, so a
+   * control tick looks it up once.
+   *
+   */
+  void get_snapshot(ros::Duration max_age, ObstacleSnapshot& snapshot,
+                    TransformCache* tf_cache = NULL);
+
+  /*
+   * Size the buffers for up to lidars lidars of beams beams each, and
+   * sonars sonars, so that taking in their readings doesn't allocate
+   * once each has been seen.  Zeros leave the buffers to grow as the
+   * sensors come in.  Set from max_lidars, max_scan_beams and
+   * max_sonars at startup.
+   *
+   */
+  void reserve(size_t lidars, size_t beams, size_t sonars);
+
+  /*
+   * Size a snapshot's buffers for everything that get_snapshot() can
+   * put in it with the sizes given to reserve(), so that refreshing it
+   * never allocates.
+   *
+   */
+  void reserve_snapshot(ObstacleSnapshot& snapshot);
+
   // Used for unit testing things that use ObstaclePoints
   // without having to go through ROS messages
   void add_test_point(tf2::Vector3 p);
   void clear_test_points();
 
+  // The number of sensor readings taken in so far, including test
+  // points, so that a caller can tell if there is anything new
+  uint64_t update_count() const { return updates.load(std::memory_order_relaxed); }
+
+  // Record the arrival of each sensor message in trace while it is
+  // enabled.  trace has to outlive the callbacks.
+  void set_trace(LatencyTrace* trace);
+
 };
 
 #endif
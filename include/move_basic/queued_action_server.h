@@ -40,7 +40,9 @@
 #include <actionlib/server/action_server.h>
 #include <ros/ros.h>
 
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <string>
 #include <thread>
 #include <atomic>
@@ -71,24 +73,52 @@ public:
     void start();
     void shutdown();
 
+    // Time between the last goal arriving and it being accepted for execution
+    ros::Duration lastAcceptLatency();
+
+    // Number of goals that may wait behind the current one. With the default
+    // depth of 1 a new goal bumps the waiting one out, with a larger depth
+    // goals are executed in the order they arrive and rejected when the
+    // queue is full.
+    void setQueueDepth(size_t depth);
+    size_t pendingGoals();
+
 private:
     void goalCallback(GoalHandle preempt);
     void preemptCallback(GoalHandle preempt);
 
+    // Must be called with lock held
+    GoalConstPtr acceptNextGoal();
+
     void executeLoop();
 
     ros::NodeHandle n_;
 
     std::shared_ptr<ActionServer<ActionSpec>> as;
 
-    GoalHandle current_goal, next_goal;
+    GoalHandle current_goal;
 
+    // Goals waiting to be executed, oldest first, with the wall clock
+    // time that they arrived
+    struct PendingGoal {
+        GoalHandle goal;
+        std::chrono::steady_clock::time_point received;
+    };
+    std::deque<PendingGoal> pending_goals;
+    size_t queue_depth;
+
+    // new_goal_preempt_request_ applies to the front of pending_goals and
+    // is only used with a queue depth of 1
     bool new_goal_, preempt_request_, new_goal_preempt_request_;
 
-    std::recursive_mutex lock;
+    // How long the last goal waited to be accepted
+    std::chrono::steady_clock::duration accept_latency;
+
+    std::mutex lock;
 
     ExecuteCallback execute_callback;
-    std::condition_variable_any execute_condition;
+    // Signalled when a new goal arrives or the server is shut down
+    std::condition_variable execute_condition;
     std::thread *execute_thread;
 
     std::atomic<bool> need_to_terminate;
@@ -46,9 +46,11 @@ namespace actionlib {
 template <class ActionSpec>
 QueuedActionServer<ActionSpec>::QueuedActionServer(std::string name,
                                                    ExecuteCallback execute_callback)
-    : new_goal_(false),
+    : queue_depth(1),
+      new_goal_(false),
       preempt_request_(false),
       new_goal_preempt_request_(false),
+      accept_latency(std::chrono::steady_clock::duration::zero()),
       execute_callback(execute_callback),
       execute_thread(NULL),
       need_to_terminate(false) {
@@ -66,9 +68,11 @@ template <class ActionSpec>
 QueuedActionServer<ActionSpec>::QueuedActionServer(ros::NodeHandle n, std::string name,
                                                    ExecuteCallback execute_callback)
     : n_(n),
+      queue_depth(1),
       new_goal_(false),
       preempt_request_(false),
       new_goal_preempt_request_(false),
+      accept_latency(std::chrono::steady_clock::duration::zero()),
       execute_callback(execute_callback),
       execute_thread(NULL),
       need_to_terminate(false) {
@@ -92,7 +96,12 @@ QueuedActionServer<ActionSpec>::~QueuedActionServer() {
 template <class ActionSpec>
 void QueuedActionServer<ActionSpec>::shutdown() {
     if (execute_callback) {
-        need_to_terminate = true;
+        {
+            // Set under the lock so that executeLoop can't miss the wakeup
+            std::lock_guard<std::mutex> lk(lock);
+            need_to_terminate = true;
+        }
+        execute_condition.notify_all();
 
         assert(execute_thread);
         if (execute_thread) {
@@ -106,9 +115,14 @@ void QueuedActionServer<ActionSpec>::shutdown() {
 template <class ActionSpec>
 boost::shared_ptr<const typename QueuedActionServer<ActionSpec>::Goal>
 QueuedActionServer<ActionSpec>::acceptNewGoal() {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<std::mutex> lk(lock);
+    return acceptNextGoal();
+}
 
-    if (!new_goal_ || !next_goal.getGoal()) {
+template <class ActionSpec>
+boost::shared_ptr<const typename QueuedActionServer<ActionSpec>::Goal>
+QueuedActionServer<ActionSpec>::acceptNextGoal() {
+    if (!new_goal_ || pending_goals.empty() || !pending_goals.front().goal.getGoal()) {
         ROS_ERROR_NAMED("actionlib",
                         "Attempting to accept the next goal when a new goal is not available");
         return boost::shared_ptr<const Goal>();
@@ -117,8 +131,10 @@ QueuedActionServer<ActionSpec>::acceptNewGoal() {
     ROS_DEBUG_NAMED("actionlib", "Accepting a new goal");
 
     // accept the next goal
-    current_goal = next_goal;
-    new_goal_ = false;
+    current_goal = pending_goals.front().goal;
+    accept_latency = std::chrono::steady_clock::now() - pending_goals.front().received;
+    pending_goals.pop_front();
+    new_goal_ = !pending_goals.empty();
 
     // set preempt to request to equal the preempt state of the new goal
     preempt_request_ = new_goal_preempt_request_;
@@ -152,45 +168,53 @@ bool QueuedActionServer<ActionSpec>::isActive() {
 
 template <class ActionSpec>
 void QueuedActionServer<ActionSpec>::setSucceeded(const Result& result, const std::string& text) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<std::mutex> lk(lock);
     ROS_DEBUG_NAMED("actionlib", "Setting the current goal as succeeded");
     current_goal.setSucceeded(result, text);
 }
 
 template <class ActionSpec>
 void QueuedActionServer<ActionSpec>::setAborted(const Result& result, const std::string& text) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<std::mutex> lk(lock);
     ROS_DEBUG_NAMED("actionlib", "Setting the current goal as aborted");
     current_goal.setAborted(result, text);
 }
 
 template <class ActionSpec>
 void QueuedActionServer<ActionSpec>::setPreempted(const Result& result, const std::string& text) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<std::mutex> lk(lock);
     ROS_DEBUG_NAMED("actionlib", "Setting the current goal as canceled");
     current_goal.setCanceled(result, text);
 }
 
 template <class ActionSpec>
 void QueuedActionServer<ActionSpec>::goalCallback(GoalHandle goal) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<std::mutex> lk(lock);
     ROS_DEBUG_NAMED("actionlib", "A new goal has been recieved by the single goal action server");
 
-    // check that the timestamp is past or equal to that of the current goal and the next goal
+    // check that the timestamp is past or equal to that of the current goal and the last
+    // queued goal
     if ((!current_goal.getGoal() || goal.getGoalID().stamp >= current_goal.getGoalID().stamp) &&
-        (!next_goal.getGoal() || goal.getGoalID().stamp >= next_goal.getGoalID().stamp)) {
-	
-        // if next_goal has not been accepted already... its going to get bumped, but we need to let
-        // the client know we're preempting
-        if (next_goal.getGoal() && (!current_goal.getGoal() || next_goal != current_goal)) {
-            next_goal.setCanceled(Result(),
-                                  "This goal was canceled because another goal was received"
-                                  "bumping this one out of the queue");
+        (pending_goals.empty() ||
+         goal.getGoalID().stamp >= pending_goals.back().goal.getGoalID().stamp)) {
+
+        if (queue_depth <= 1) {
+            // if a queued goal has not been accepted already... its going to get bumped, but
+            // we need to let the client know we're preempting
+            for (auto& pending : pending_goals) {
+                pending.goal.setCanceled(Result(),
+                                         "This goal was canceled because another goal was received"
+                                         "bumping this one out of the queue");
+            }
+            pending_goals.clear();
+            new_goal_preempt_request_ = false;
+        } else if (pending_goals.size() >= queue_depth) {
+            goal.setRejected(Result(), "This goal was rejected because the goal queue is full");
+            return;
         }
 
-        next_goal = goal;
+        pending_goals.push_back({goal, std::chrono::steady_clock::now()});
         new_goal_ = true;
-        new_goal_preempt_request_ = false;
 
         // Trigger runLoop to call execute()
         execute_condition.notify_all();
@@ -204,7 +228,7 @@ void QueuedActionServer<ActionSpec>::goalCallback(GoalHandle goal) {
 
 template <class ActionSpec>
 void QueuedActionServer<ActionSpec>::preemptCallback(GoalHandle preempt) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<std::mutex> lk(lock);
     ROS_DEBUG_NAMED("actionlib", "A preempt has been received by the QueuedActionServer");
 
     // if the preempt is for the current goal, then we'll set the preemptRequest flag and call the
@@ -215,55 +239,80 @@ void QueuedActionServer<ActionSpec>::preemptCallback(GoalHandle preempt) {
             "Setting preempt_request bit for the current goal to TRUE");
         preempt_request_ = true;
 
-    } else if (preempt == next_goal) {
-        // if the preempt applies to the next goal, we'll set the preempt bit for that
-        ROS_DEBUG_NAMED("actionlib", "Setting preempt request bit for the next goal to TRUE");
-        new_goal_preempt_request_ = true;
+    } else if (queue_depth <= 1) {
+        if (!pending_goals.empty() && preempt == pending_goals.front().goal) {
+            // if the preempt applies to the next goal, we'll set the preempt bit for that
+            ROS_DEBUG_NAMED("actionlib", "Setting preempt request bit for the next goal to TRUE");
+            new_goal_preempt_request_ = true;
+        }
+    } else {
+        // a queued goal is cancelled straight away, the goals behind it move up
+        for (auto it = pending_goals.begin(); it != pending_goals.end(); ++it) {
+            if (preempt == it->goal) {
+                ROS_DEBUG_NAMED("actionlib", "Canceling a queued goal");
+                it->goal.setCanceled(Result(), "This goal was canceled while it was queued");
+                pending_goals.erase(it);
+                new_goal_ = !pending_goals.empty();
+                break;
+            }
+        }
     }
 }
 
 template <class ActionSpec>
 void QueuedActionServer<ActionSpec>::executeLoop() {
-    ros::Duration loop_duration = ros::Duration().fromSec(.1);
+    std::unique_lock<std::mutex> lk(lock);
 
     while (n_.ok()) {
+        // goalCallback and shutdown wake us straight away.  The timeout is
+        // only there to notice a ROS shutdown, which doesn't notify.
+        execute_condition.wait_for(lk, std::chrono::milliseconds(100),
+            [this] { return this->new_goal_ || this->need_to_terminate; });
+
         if (need_to_terminate) {
             break;
         }
-
-        std::unique_lock<std::recursive_mutex> lk(lock);
-        execute_condition.wait_for(lk, std::chrono::duration<double>(loop_duration.toSec()),
-                                   [this] { return this->new_goal_; });
+        if (!new_goal_) {
+            continue;
+        }
 
         if (isActive()) {
             ROS_ERROR_NAMED("actionlib", "Should never reach this code with an active goal");
-        } else if (isNewGoalAvailable()) {
-            GoalConstPtr goal = acceptNewGoal();
-
-            ROS_FATAL_COND(!execute_callback,
-                           "execute_callback must exist. This is a bug in QueuedActionServer");
-
-            {
-                // Make sure we're not locked when we call execute, relock in exception safe way
-                lk.unlock();
-                try {
-                    execute_callback(goal);
-                } catch (...) {
-                    lk.lock();
-                    throw;
-                }
+            continue;
+        }
+
+        GoalConstPtr goal = acceptNextGoal();
+        if (!goal) {
+            pending_goals.clear();
+            new_goal_ = false;
+            continue;
+        }
+
+        ROS_FATAL_COND(!execute_callback,
+                       "execute_callback must exist. This is a bug in QueuedActionServer");
+        ROS_DEBUG_NAMED("actionlib", "Goal accepted after %f s",
+                        std::chrono::duration<double>(accept_latency).count());
+
+        {
+            // Make sure we're not locked when we call execute, relock in exception safe way
+            lk.unlock();
+            try {
+                execute_callback(goal);
+            } catch (...) {
                 lk.lock();
+                throw;
             }
+            lk.lock();
+        }
 
-            if (isActive()) {
-                ROS_WARN_NAMED("actionlib",
-                               "Your executeCallback did not set the goal to a terminal status.\n"
-                               "This is a bug in your ActionServer implementation. Fix your code!\n"
-                               "For now, the ActionServer will set this goal to aborted");
-                setAborted(Result(),
-                           "This goal was aborted by the simple action server. The user should "
-                           "have set a terminal status on this goal and did not");
-            }
+        if (isActive()) {
+            ROS_WARN_NAMED("actionlib",
+                           "Your executeCallback did not set the goal to a terminal status.\n"
+                           "This is a bug in your ActionServer implementation. Fix your code!\n"
+                           "For now, the ActionServer will set this goal to aborted");
+            current_goal.setAborted(Result(),
+                                    "This goal was aborted by the simple action server. The user should "
+                                    "have set a terminal status on this goal and did not");
         }
     }
 }
@@ -273,6 +322,24 @@ void QueuedActionServer<ActionSpec>::start() {
     as->start();
 }
 
+template <class ActionSpec>
+ros::Duration QueuedActionServer<ActionSpec>::lastAcceptLatency() {
+    std::lock_guard<std::mutex> lk(lock);
+    return ros::Duration(std::chrono::duration<double>(accept_latency).count());
+}
+
+template <class ActionSpec>
+void QueuedActionServer<ActionSpec>::setQueueDepth(size_t depth) {
+    std::lock_guard<std::mutex> lk(lock);
+    queue_depth = depth;
+}
+
+template <class ActionSpec>
+size_t QueuedActionServer<ActionSpec>::pendingGoals() {
+    std::lock_guard<std::mutex> lk(lock);
+    return pending_goals.size();
+}
+
 }  // namespace actionlib
 
 #endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#ifndef TRANSFORM_CACHE_H
+#define TRANSFORM_CACHE_H
+
+#include <map>
+#include <string>
+#include <utility>
+#include <cstdint>
+
+#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <tf2_ros/buffer.h>
+
+// Latest transforms between pairs of frames, looked up at most once per
+// control tick.  Failed lookups are remembered for the tick as well, and
+// a cached pair also answers the lookup in the opposite direction.
+// Not thread safe, each thread should have its own cache.
+class TransformCache
+{
+    struct Entry {
+        uint64_t tick;
+        bool valid;
+        tf2::Transform tf;
+
+        Entry() : tick(0), valid(false) {}
+    };
+    typedef std::pair<std::string, std::string> Key;
+
+    tf2_ros::Buffer& tf_buffer;
+    std::map<Key, Entry> entries;
+    uint64_t tick;
+
+public:
+    TransformCache(tf2_ros::Buffer& tf_buffer);
+
+    // Start a new control tick, so transforms are looked up again
+    void new_tick();
+
+    // Transform from frame from to frame to, returns true on success
+    bool lookup(const std::string& from, const std::string& to,
+                tf2::Transform& tf);
+};
+
+#endif
@@ -46,10 +46,15 @@
  of the end points of the sensors' cones.  For this purpose, the robot
  footprint is paramatized as having width `robot_width` either side of
  base_link, and length `robot_front_length` forward of base_link and length
- `robot_back_length` behind it.  This could be extended to be an abitrary
- polygon.  When the robot is travelling forward or backwards, the distance
- to the closest point that has an `x` value between `-robot_width` and
- `robot_width` is used as the obstacle distance.
+ `robot_back_length` behind it.  When the robot is travelling forward or
+ backwards, the distance to the closest point that has an `x` value
+ between `-robot_width` and `robot_width` is used as the obstacle
+ distance.
+
+ The `footprint` parameter can instead give a convex polygon.  The
+ queries are templated on the footprint, see footprint.h, so the
+ rectangle keeps its closed form checks and the polygon is checked
+ against the edges bounding it on each side, worked out once at startup.
 
  In the case of rotation in place, the angle that the robot will rotate
  before hitting an obstacle is determined. This is done by converting
@@ -57,6 +62,15 @@
  `theta` would change by for the point to intersect with one of the four
  line segments representing the robot footprint.
 
+ ObstaclePoints can instead rasterize the obstacles into an occupancy
+ grid, set by `collision_backend`.  The distances and angle are then
+ found by scanning the rows of the grid, accurate to a cell.
+
+ The distances and angles are worked out separately for each sensor and
+ then combined.  A sensor's results are kept until it publishes again,
+ so a control cycle only checks the obstacles that are new since the
+ last one.
+
  Coordinate systems are as specified in http://www.ros.org/reps/rep-0103.html
  x forward, y left
 
@@ -69,52 +83,111 @@
 #include <tf2_ros/transform_listener.h>
 #include <sensor_msgs/Range.h>
 #include <visualization_msgs/Marker.h>
+#include <std_msgs/ColorRGBA.h>
 #include "move_basic/collision_checker.h"
-
+#include "move_basic/params.h"
 
 CollisionChecker::CollisionChecker(ros::NodeHandle& nh, tf2_ros::Buffer &tf_buffer,
 		                   ObstaclePoints& op) : tf_buffer(tf_buffer),
 	                                                 ob_points(op)
 {
-    nh.param<std::string>("base_frame", baseFrame, "base_link");
+    init(&nh);
+}
+
+CollisionChecker::CollisionChecker(tf2_ros::Buffer &tf_buffer,
+		                   ObstaclePoints& op) : tf_buffer(tf_buffer),
+	                                                 ob_points(op)
+{
+    init(NULL);
+}
 
-    line_pub = ros::Publisher(
-                 nh.advertise<visualization_msgs::Marker>("/obstacle_viz", 10));
+void CollisionChecker::init(ros::NodeHandle* nh)
+{
+    baseFrame = param_or_default<std::string>(nh, "base_frame", "base_link");
+
+    // Without a node handle nothing is advertised and there is no viz.
+    // Embedded builds leave it out too, as the markers are only for
+    // debugging and are built on the heap.
+#ifndef MOVE_BASIC_EMBEDDED
+    if (nh) {
+        line_pub = ros::Publisher(
+                 nh->advertise<visualization_msgs::Marker>("/obstacle_viz", 10));
+    }
+#endif
 
-    max_age = nh.param<float>("max_age", 1.0);
-    no_obstacle_dist = nh.param<float>("no_obstacle_dist", 10.0);
+    max_age = param_or_default<float>(nh, "max_age", 1.0);
+    viz_rate = param_or_default<float>(nh, "viz_rate", 10.0);
+    no_obstacle_dist = param_or_default<float>(nh, "no_obstacle_dist", 10.0);
+    min_side_dist = param_or_default<double>(nh, "min_side_dist", 0.3);
 
     // Footprint
-    robot_width = nh.param<float>("robot_width", 0.08);
-    robot_front_length = nh.param<float>("robot_front_length", 0.09);
-    robot_back_length = nh.param<float>("robot_back_length", 0.19);
+    FootprintBand band;
+    band.width = param_or_default<float>(nh, "robot_width", 0.08);
+    band.front_length = param_or_default<float>(nh, "robot_front_length", 0.09);
+    band.back_length = param_or_default<float>(nh, "robot_back_length", 0.19);
+    rectangle = RectangleFootprint(band);
+
+    use_polygon = false;
+    std::string footprint = param_or_default<std::string>(nh, "footprint", "");
+    if (!footprint.empty()) {
+        std::vector<float> x, y;
+        if (parse_footprint(footprint, x, y) && polygon.set(x, y)) {
+            use_polygon = true;
+            band = polygon.bounds();
+        }
+        else {
+            ROS_ERROR("Footprint %s is not a convex polygon of at most %d points, "
+                      "using the rectangle", footprint.c_str(),
+                      (int)FootprintEdges::MAX_CORNERS);
+        }
+    }
+    robot_width = band.width;
+    robot_front_length = band.front_length;
+    robot_back_length = band.back_length;
 
-    robot_width_sq = robot_width * robot_width;
-    robot_front_length_sq = robot_front_length * robot_front_length;
-    robot_back_length_sq = robot_back_length * robot_back_length;
+    ob_points.reserve_snapshot(snapshot);
+}
+
+/*
+ Prepare a LINE_LIST marker to draw the debug geometry of one query.
+ All the lines of a query are published as one message, and only if
+ someone is subscribed and viz_rate allows it.  Returns false if
+ nothing should be drawn.
+*/
+bool CollisionChecker::start_lines(visualization_msgs::Marker& lines, int id)
+{
+    if (viz_rate <= 0 || line_pub.getNumSubscribers() == 0) {
+        return false;
+    }
 
-    // To test if obstacles will intersect when rotating
-    front_diag = robot_width*robot_width + robot_front_length*robot_front_length;
-    back_diag = robot_width*robot_width + robot_back_length*robot_back_length;
+    ros::Time now = ros::Time::now();
+    {
+        const std::lock_guard<std::mutex> lock(viz_mutex);
+        if (now - last_viz[id] < ros::Duration(1.0 / viz_rate)) {
+            return false;
+        }
+        last_viz[id] = now;
+    }
 
+    lines.type = visualization_msgs::Marker::LINE_LIST;
+    lines.action = visualization_msgs::Marker::MODIFY;
+    lines.header.frame_id = baseFrame;
+    lines.header.stamp = now;
+    lines.color.a = 1.0f;
+    lines.id = id;
+    lines.scale.x = lines.scale.y = lines.scale.z = 0.01;
+    lines.pose.position.x = 0;
+    lines.pose.position.y = 0;
+    lines.pose.orientation.w = 1;
+    lines.points.reserve(32);
+    lines.colors.reserve(32);
+    return true;
 }
 
-void CollisionChecker::draw_line(const tf2::Vector3 &p1, const tf2::Vector3 &p2,
-                            float r, float g, float b, int id)
+void CollisionChecker::add_line(visualization_msgs::Marker& lines,
+                                const tf2::Vector3 &p1, const tf2::Vector3 &p2,
+                                float r, float g, float b) const
 {
-    visualization_msgs::Marker line;
-    line.type = visualization_msgs::Marker::LINE_LIST;
-    line.action = visualization_msgs::Marker::MODIFY;
-    line.header.frame_id = baseFrame;
-    line.color.r = r;
-    line.color.g = g;
-    line.color.b = b;
-    line.color.a = 1.0f;
-    line.id = id;
-    line.scale.x = line.scale.y = line.scale.z = 0.01;
-    line.pose.position.x = 0;
-    line.pose.position.y = 0;
-    line.pose.orientation.w = 1;
     geometry_msgs::Point gp1, gp2;
     gp1.x = p1.x();
     gp1.y = p1.y();
@@ -122,32 +195,135 @@ void CollisionChecker::draw_line(const tf2::Vector3 &p1, const tf2::Vector3 &p2,
     gp2.x = p2.x();
     gp2.y = p2.y();
     gp2.z = p2.z();
-    line.points.push_back(gp1);
-    line.points.push_back(gp2);
-    line_pub.publish(line);
+    lines.points.push_back(gp1);
+    lines.points.push_back(gp2);
+
+    std_msgs::ColorRGBA color;
+    color.r = r;
+    color.g = g;
+    color.b = b;
+    color.a = 1.0f;
+    lines.colors.push_back(color);
+    lines.colors.push_back(color);
+}
+
+// Draw the footprint turned by rotation
+void CollisionChecker::add_footprint(visualization_msgs::Marker& lines,
+                                     const FootprintEdges& edges, float rotation,
+                                     float r, float g, float b) const
+{
+    const float sin_theta = std::sin(rotation);
+    const float cos_theta = std::cos(rotation);
+    for (int k = 0; k < edges.n; k++) {
+        const int next = (k + 1) % edges.n;
+        add_line(lines,
+                 tf2::Vector3(edges.x[k] * cos_theta - edges.y[k] * sin_theta,
+                              edges.x[k] * sin_theta + edges.y[k] * cos_theta, 0),
+                 tf2::Vector3(edges.x[next] * cos_theta - edges.y[next] * sin_theta,
+                              edges.x[next] * sin_theta + edges.y[next] * cos_theta, 0),
+                 r, g, b);
+    }
+}
+
+CollisionChecker::SourceMinima::SourceMinima() : geometry(0), has_dist(false)
+{
+    has_angle[0] = has_angle[1] = false;
 }
 
-void CollisionChecker::clear_line(int id)
+/*
+ The cached minima of a sensor's obstacles, cleared if the sensor has
+ published or moved since they were worked out.  Sources that can't be
+ told apart, with a negative id or no stamp, get the empty scratch entry.
+ Must be called with minima_mutex held.
+*/
+CollisionChecker::SourceMinima& CollisionChecker::source_minima(
+    std::vector<SourceMinima>& table, const ObstacleSnapshot::Source& source,
+    SourceMinima& scratch)
+{
+    if (source.id < 0 || source.stamp.isZero()) {
+        scratch = SourceMinima();
+        return scratch;
+    }
+    if (table.size() <= static_cast<size_t>(source.id)) {
+        table.resize(source.id + 1);
+    }
+    SourceMinima& minima = table[source.id];
+    if (minima.stamp != source.stamp || minima.geometry != source.geometry) {
+        minima = SourceMinima();
+        minima.stamp = source.stamp;
+        minima.geometry = source.geometry;
+    }
+    return minima;
+}
+
+// The source of lidar i, or one that can't be told apart from the
+// others if the snapshot doesn't say when its scans were taken
+static ObstacleSnapshot::Source lidar_source(const ObstacleSnapshot& obstacles, size_t i)
 {
-    visualization_msgs::Marker line;
-    line.type = visualization_msgs::Marker::LINE_LIST;
-    line.action = visualization_msgs::Marker::DELETE;
-    line.id = id;
-    line_pub.publish(line);
+    if (obstacles.lidar_stamps.size() != obstacles.lidars.size()) {
+        return ObstacleSnapshot::Source(-1, ros::Time());
+    }
+    uint32_t geometry = obstacles.lidar_geometry.size() == obstacles.lidars.size() ?
+                        obstacles.lidar_geometry[i] : 0;
+    return ObstacleSnapshot::Source(i, obstacles.lidar_stamps[i], geometry);
 }
 
-inline void CollisionChecker::check_dist(float x, bool forward, float& min_dist) const
+static void lower_dist(FootprintDistances& dist, const FootprintDistances& other)
 {
-    if (forward && x > robot_front_length) {
-        if (x < min_dist) {
-            min_dist = x;
+    dist.forward = std::min(dist.forward, other.forward);
+    dist.back = std::min(dist.back, other.back);
+    dist.left = std::min(dist.left, other.left);
+    dist.right = std::min(dist.right, other.right);
+}
+
+/*
+ The number of points at the start of the snapshot that are the ends of
+ the sonar lines, two per line.  Zero if the snapshot doesn't say which
+ sonar each line came from, then the points are all checked every time.
+*/
+size_t CollisionChecker::sonar_point_count(const ObstacleSnapshot& obstacles) const
+{
+    if (obstacles.line_sources.size() != obstacles.lines.size() ||
+        obstacles.points.size() < 2 * obstacles.lines.size()) {
+        return 0;
+    }
+    return 2 * obstacles.lines.size();
+}
+
+/*
+ Lower dist by other as above, and if that brings the obstacle in the
+ direction of travel closer, note that it was seen at `seen`
+*/
+static void lower_dist(FootprintDistances& dist, const FootprintDistances& other,
+                       bool forward, const ros::Time& seen, ros::Time& nearest)
+{
+    if (forward ? other.forward < dist.forward : other.back < dist.back) {
+        nearest = seen;
+    }
+    lower_dist(dist, other);
+}
+
+// When the oldest of the obstacles in the snapshot was seen
+static ros::Time oldest_stamp(const ObstacleSnapshot& obstacles)
+{
+    ros::Time oldest = obstacles.stamp;
+    for (size_t i = 0; i < obstacles.lidar_stamps.size(); i++) {
+        if (obstacles.lidars[i] && !obstacles.lidar_stamps[i].isZero()) {
+            oldest = std::min(oldest, obstacles.lidar_stamps[i]);
         }
     }
-    if (!forward && -x > robot_back_length ) {
-        if (-x < min_dist) {
-            min_dist = -x;
+    // Remembered lines have been moved to where the robot is now
+    for (const auto& source : obstacles.line_sources) {
+        if (source.id >= 0 && !source.stamp.isZero()) {
+            oldest = std::min(oldest, source.stamp);
         }
     }
+    return oldest;
+}
+
+void CollisionChecker::get_snapshot(ObstacleSnapshot& obstacles, TransformCache* tf_cache)
+{
+    ob_points.get_snapshot(ros::Duration(max_age), obstacles, tf_cache);
 }
 
 float CollisionChecker::obstacle_dist(bool forward,
@@ -156,168 +332,179 @@ float CollisionChecker::obstacle_dist(bool forward,
                                       tf2::Vector3 &fl,
                                       tf2::Vector3 &fr)
 {
-    float min_dist = no_obstacle_dist;
-    min_dist_left = no_obstacle_dist;
-    min_dist_right = no_obstacle_dist;
-
-    auto lines = ob_points.get_lines(ros::Duration(max_age));
-    for (const auto& points : lines) {
-	float x0 = points.first.x();
-	float y0 = points.first.y();
-	float x1 = points.second.x();
-	float y1 = points.second.y();
-	// Forward and rear limits
-	if (y0 < -robot_width && robot_width < y1) {
-	    // linear interpolate to get closest point inside width
-	    float ylen = y1 - y0;
-	    float a0 = (y0 - robot_width) / ylen;
-	    float a1 = (y1 - robot_width - y0) / ylen;
-	    check_dist(a0 * x0 + (1.0 - a0) * x1, forward, min_dist);
-	    check_dist(a1 * x1 + (1.0 - a1) * x0, forward, min_dist);
-	}
-	else if (y1 < -robot_width && robot_width < y0) {
-	    // linear interpolate to get closest point inside width
-	    float ylen = y0 - y1;
-	    float a0 = (y0 - robot_width - y1) / ylen;
-	    float a1 = (y1 - robot_width) / ylen;
-	    check_dist(a0 * x0 + (1.0 - a0) * x1, forward, min_dist);
-	    check_dist(a1 * x1 + (1.0 - a1) * x0, forward, min_dist);
-	}
-	else {
-	    if (-robot_width < y0 && y0 < robot_width) {
-		check_dist(x0, forward, min_dist);
-	    }
-	    if (-robot_width < y1 && y1 < robot_width) {
-		check_dist(x1, forward, min_dist);
-	    }
-	}
-	// Sides
-	if (x0 < -robot_back_length && x1 > robot_front_length) {
-	    // linear interpolate to get closest point in side
-	    float xlen = x1 - x0;
-	    float ab = (-x0 - robot_back_length) / xlen;
-	    float af = (x1 - robot_front_length - x0) / xlen;
-	    float yb = ab * y0 + (1.0 - ab) * y1;
-	    float yf = af * y1 + (1.0 - af) * y0;
-	    if (yb > 0 && yb < min_dist_left) {
-		min_dist_left = yb;
-	    }
-	    if (yb < 0 && -yb < min_dist_right) {
-		min_dist_right = -yb;
-	    }
-	    if (yf> 0 && yf < min_dist_left) {
-		min_dist_left = yf;
-	    }
-	    if (yf < 0 && -yf < min_dist_right) {
-		min_dist_right = -yf;
-	    }
-	}
-	else if (x1 < -robot_back_length && x0 > robot_front_length) {
-	    // linear interpolate to get closest point in side
-	    float xlen = x0 - x1;
-	    float ab = (-x1 - robot_back_length) / xlen;
-	    float af = (x0 - robot_front_length - x1) / xlen;
-	    float yb = ab * y1 + (1.0 - ab) * y0;
-	    float yf = af * y0 + (1.0 - af) * y1;
-	    if (yb > 0 && yb < min_dist_left) {
-		min_dist_left = yb;
-	    }
-	    if (yb < 0 && -yb < min_dist_right) {
-		min_dist_right = -yb;
-	    }
-	    if (yf> 0 && yf < min_dist_left) {
-		min_dist_left = yf;
-	    }
-	    if (yf < 0 && -yf < min_dist_right) {
-		min_dist_right = -yf;
-	    }
-	}
-	else {
-	    if (x0 > -robot_back_length && x0 < robot_front_length) {
-		if (y0 > 0 && y0 < min_dist_left) {
-		    min_dist_left = y0;
-		}
-		if (y0 < 0 && -y0 < min_dist_right) {
-		    min_dist_right = -y0;
-		}
-	    }
-	    if (x1 > -robot_back_length && x1 < robot_front_length) {
-		if (y1> 0 && y1 < min_dist_left) {
-		    min_dist_left = y1;
-		}
-		if (y1 < 0 && -y1 < min_dist_right) {
-		    min_dist_right = -y1;
-		}
-	    }
-	}
+    const std::lock_guard<std::mutex> lock(obstacle_mutex);
+    get_snapshot(snapshot);
+    return obstacle_dist(snapshot, forward, min_dist_left, min_dist_right, fl, fr);
+}
+
+float CollisionChecker::obstacle_dist(const ObstacleSnapshot& obstacles,
+                                      bool forward,
+                                      float &min_dist_left,
+                                      float &min_dist_right,
+                                      tf2::Vector3 &fl,
+                                      tf2::Vector3 &fr,
+                                      ros::Time* stamp)
+{
+    if (use_polygon) {
+        return obstacle_dist_for(polygon, obstacles, forward,
+                                 min_dist_left, min_dist_right, fl, fr, stamp);
+    }
+    return obstacle_dist_for(rectangle, obstacles, forward,
+                             min_dist_left, min_dist_right, fl, fr, stamp);
+}
+
+template <class Footprint>
+float CollisionChecker::obstacle_dist_for(const Footprint& footprint,
+                                          const ObstacleSnapshot& obstacles,
+                                          bool forward,
+                                          float &min_dist_left,
+                                          float &min_dist_right,
+                                          tf2::Vector3 &fl,
+                                          tf2::Vector3 &fr,
+                                          ros::Time* stamp)
+{
+    const FootprintDistances none = {no_obstacle_dist, no_obstacle_dist,
+                                     no_obstacle_dist, no_obstacle_dist};
+    // The sonar lines and all the points are kept apart, as the forward
+    // side points only account for the lines
+    FootprintDistances line_dist = none;
+    FootprintDistances dist = none;
+    // when the closest obstacle in the direction of travel was seen
+    ros::Time nearest, line_nearest;
+    if (obstacles.grid.enabled()) {
+        // The grid holds the lines as cells, like everything else.  It
+        // doesn't know which sensor saw what, so assume the oldest.
+        FootprintDistances cells = none;
+        footprint.grid_dist(obstacles.grid, cells);
+        lower_dist(dist, cells, forward, oldest_stamp(obstacles), nearest);
+        line_dist.left = dist.left;
+        line_dist.right = dist.right;
+    }
+    else {
+        // Each sensor's minima are only worked out again once it has
+        // published, most control cycles only see one or two new readings
+        const std::lock_guard<std::mutex> lock(minima_mutex);
+        SourceMinima scratch;
+
+        const bool tracked_lidars = obstacles.lidar_stamps.size() == obstacles.lidars.size();
+        for (size_t i = 0; i < obstacles.lidars.size(); i++) {
+            const auto& lidar = obstacles.lidars[i];
+            if (!lidar) {
+                continue;
+            }
+            SourceMinima& minima =
+                source_minima(lidar_minima, lidar_source(obstacles, i), scratch);
+            if (!minima.has_dist) {
+                minima.points_dist = none;
+                footprint.points_dist(lidar->x.data(), lidar->y.data(), lidar->size(),
+                                      minima.points_dist);
+                minima.has_dist = true;
+            }
+            lower_dist(dist, minima.points_dist, forward,
+                       tracked_lidars ? obstacles.lidar_stamps[i] : obstacles.stamp, nearest);
+        }
+
+        // Sonar i gave lines[i] and points 2i and 2i+1
+        const size_t sonar_points = sonar_point_count(obstacles);
+        for (size_t i = 0; i < obstacles.lines.size(); i++) {
+            SourceMinima& minima = (sonar_points > 0) ?
+                source_minima(sonar_minima, obstacles.line_sources[i], scratch) :
+                source_minima(sonar_minima, ObstacleSnapshot::Source(-1, ros::Time()),
+                              scratch);
+            if (!minima.has_dist) {
+                minima.lines_dist = none;
+                const ObstacleSnapshot::Line& line = obstacles.lines[i];
+                footprint.line_dist(line.first.x(), line.first.y(),
+                                    line.second.x(), line.second.y(), minima.lines_dist);
+                minima.points_dist = none;
+                if (sonar_points > 0) {
+                    footprint.points_dist(&obstacles.points.x[2 * i], &obstacles.points.y[2 * i], 2,
+                                          minima.points_dist);
+                }
+                minima.has_dist = true;
+            }
+            // Remembered lines have been moved to where the robot is
+            // now, so they are as current as the snapshot
+            const ros::Time& seen = (sonar_points > 0 && obstacles.line_sources[i].id >= 0) ?
+                obstacles.line_sources[i].stamp : obstacles.stamp;
+            lower_dist(line_dist, minima.lines_dist, forward, seen, line_nearest);
+            lower_dist(dist, minima.points_dist, forward, seen, nearest);
+        }
+
+        // Test points, and all the points if the sonars aren't known
+        const PlanarPoints& pts = obstacles.points;
+        if (sonar_points < pts.size()) {
+            FootprintDistances points_dist = none;
+            footprint.points_dist(&pts.x[sonar_points], &pts.y[sonar_points],
+                                  pts.size() - sonar_points, points_dist);
+            lower_dist(dist, points_dist, forward, obstacles.stamp, nearest);
+        }
+    }
+    lower_dist(dist, line_dist, forward, line_nearest, nearest);
+    if (stamp) {
+        *stamp = nearest;
     }
 
     // Forward side points
     fl.setX(robot_front_length);
-    fl.setY(min_dist_left);
+    fl.setY(line_dist.left);
     fr.setX(robot_front_length);
-    fr.setY(min_dist_right);
-
-    auto pts = ob_points.get_points(ros::Duration(max_age));
-    for (const auto& p : pts) {
-       float y = p.y();
-       float x = p.x();
-       // Forward and rear
-       if (-robot_width < y && y < robot_width) {
-          check_dist(x, forward, min_dist);
-       }
-       // Sides
-       if (x > -robot_back_length && x < robot_front_length) {
-          if (y > 0 && y < min_dist_left) {
-	     min_dist_left = y;
-	  }
-	  else if (y < 0 && -y < min_dist_right) {
-             min_dist_right = -y;
-	  }
-       }
-    }
+    fr.setY(line_dist.right);
 
-    // Green lines at sides
-    draw_line(tf2::Vector3(robot_front_length, min_dist_left, 0),
-              tf2::Vector3(-robot_back_length, min_dist_left, 0), 0, 1, 0, 20000);
-    draw_line(tf2::Vector3(robot_front_length, min_dist_left, 0),
-              tf2::Vector3(robot_front_length + 2, min_dist_left, 0), 0, 0.5, 0, 20001);
+    float min_dist = forward ? dist.forward : dist.back;
+    min_dist_left = dist.left;
+    min_dist_right = dist.right;
 
-    draw_line(tf2::Vector3(robot_front_length, -min_dist_right, 0),
-              tf2::Vector3(-robot_back_length, -min_dist_right, 0), 0, 1, 0, 20002);
+    visualization_msgs::Marker lines;
+    if (start_lines(lines, DIST_MARKER)) {
+        // Green lines at sides
+        add_line(lines, tf2::Vector3(robot_front_length, min_dist_left, 0),
+                 tf2::Vector3(-robot_back_length, min_dist_left, 0), 0, 1, 0);
+        add_line(lines, tf2::Vector3(robot_front_length, min_dist_left, 0),
+                 tf2::Vector3(robot_front_length + 2, min_dist_left, 0), 0, 0.5, 0);
 
-    draw_line(tf2::Vector3(robot_front_length, -min_dist_right, 0),
-              tf2::Vector3(robot_front_length + 2, -min_dist_right, 0), 0, 0.5, 0, 20003);
+        add_line(lines, tf2::Vector3(robot_front_length, -min_dist_right, 0),
+                 tf2::Vector3(-robot_back_length, -min_dist_right, 0), 0, 1, 0);
 
-    // Blue
-    draw_line(tf2::Vector3(robot_front_length, min_dist_left, 0),
-              tf2::Vector3(fl.x(), fl.y(), 0), 0, 0, 1, 30000);
+        add_line(lines, tf2::Vector3(robot_front_length, -min_dist_right, 0),
+                 tf2::Vector3(robot_front_length + 2, -min_dist_right, 0), 0, 0.5, 0);
 
-    draw_line(tf2::Vector3(robot_front_length, -min_dist_right, 0),
-              tf2::Vector3(fr.x(), -fr.y(), 0), 0, 0, 1, 30001);
+        // Blue
+        add_line(lines, tf2::Vector3(robot_front_length, min_dist_left, 0),
+                 tf2::Vector3(fl.x(), fl.y(), 0), 0, 0, 1);
 
-    // Min side dist
-    draw_line(tf2::Vector3(robot_front_length, -robot_width -min_side_dist, 0),
-              tf2::Vector3(robot_front_length + 2, -robot_width -min_side_dist, 0), 0.5, 0.5, 0, 40001);
+        add_line(lines, tf2::Vector3(robot_front_length, -min_dist_right, 0),
+                 tf2::Vector3(fr.x(), -fr.y(), 0), 0, 0, 1);
 
-    draw_line(tf2::Vector3(robot_front_length, robot_width+min_side_dist, 0),
-              tf2::Vector3(robot_front_length + 2, robot_width+min_side_dist, 0), 0.5, 0.5, 0, 40002);
+        // Min side dist
+        add_line(lines, tf2::Vector3(robot_front_length, -robot_width -min_side_dist, 0),
+                 tf2::Vector3(robot_front_length + 2, -robot_width -min_side_dist, 0), 0.5, 0.5, 0);
 
-    // Red line at front or back
-    if (forward) {
-        draw_line(tf2::Vector3(min_dist, -robot_width, 0),
-                  tf2::Vector3(min_dist, robot_width, 0), 1, 0, 0, 10000);
+        add_line(lines, tf2::Vector3(robot_front_length, robot_width+min_side_dist, 0),
+                 tf2::Vector3(robot_front_length + 2, robot_width+min_side_dist, 0), 0.5, 0.5, 0);
+
+        // Red line at front or back
+        if (forward) {
+            add_line(lines, tf2::Vector3(min_dist, -robot_width, 0),
+                     tf2::Vector3(min_dist, robot_width, 0), 1, 0, 0);
 
-        draw_line(tf2::Vector3(min_dist, -robot_width - 2, 0),
-                  tf2::Vector3(min_dist, -robot_width, 0), 0.5, 0, 0, 10020);
+            add_line(lines, tf2::Vector3(min_dist, -robot_width - 2, 0),
+                     tf2::Vector3(min_dist, -robot_width, 0), 0.5, 0, 0);
+
+            add_line(lines, tf2::Vector3(min_dist, robot_width + 2, 0),
+                     tf2::Vector3(min_dist, robot_width, 0), 0.5, 0, 0);
+        }
+        else {
+            add_line(lines, tf2::Vector3(-min_dist, -robot_width, 0),
+                     tf2::Vector3(-min_dist, robot_width, 0), 1, 0, 0);
+        }
+        line_pub.publish(lines);
+    }
 
-        draw_line(tf2::Vector3(min_dist, robot_width + 2, 0),
-                  tf2::Vector3(min_dist, robot_width, 0), 0.5, 0, 0, 10030);
+    if (forward) {
         min_dist -= robot_front_length;
     }
     else {
-        draw_line(tf2::Vector3(-min_dist, -robot_width, 0),
-                  tf2::Vector3(-min_dist, robot_width, 0), 1, 0, 0, 10000);
         min_dist -= robot_back_length;
     }
 
@@ -331,132 +518,98 @@ float CollisionChecker::degrees(float radians) const
     return radians * 180.0 / M_PI;
 }
 
-/*
- Determine the rotation required to for to move point from its
- initial rotation of theta to (x, y), and store the smallest
- value
-*/
-inline void CollisionChecker::check_angle(float theta, float x, float y,
-                                          bool left, float& min_dist) const
+float CollisionChecker::obstacle_angle(bool left)
 {
-    float theta_int = theta - std::atan2(y, x);
-    if (theta_int < -M_PI) {
-        theta_int += 2.0 * M_PI;
-    }
-    if (theta_int > M_PI) {
-        theta_int -= 2.0 * M_PI;
-    }
-    if (left && theta_int > 0 && theta_int < min_dist) {
-        min_dist = theta_int;
-    }
-    if (!left && theta_int < 0 && -theta_int < min_dist) {
-        min_dist = -theta_int;
+    const std::lock_guard<std::mutex> lock(obstacle_mutex);
+    get_snapshot(snapshot);
+    return obstacle_angle(snapshot, left);
+}
+
+float CollisionChecker::obstacle_angle(const ObstacleSnapshot& obstacles, bool left)
+{
+    if (use_polygon) {
+        return obstacle_angle_for(polygon, obstacles, left);
     }
+    return obstacle_angle_for(rectangle, obstacles, left);
 }
 
-float CollisionChecker::obstacle_angle(bool left)
+template <class Footprint>
+float CollisionChecker::obstacle_angle_for(const Footprint& footprint,
+                                           const ObstacleSnapshot& obstacles, bool left)
 {
     float min_angle = M_PI;
+    if (obstacles.grid.enabled()) {
+        // The centres of the occupied cells stand in for the points
+        float r = std::sqrt(footprint.rotation_r_sq_max());
+        obstacles.grid.for_each_cell(-r, r, -r, r, [&](float x, float y) {
+            footprint.rotation(x, y, x*x + y*y, left, min_angle);
+        });
+    }
+    else {
+        // As for obstacle_dist, only the sensors that have published
+        // since the last query are checked again
+        const std::lock_guard<std::mutex> lock(minima_mutex);
+        SourceMinima scratch;
+
+        // Only the lidar points in the annulus that the footprint sweeps
+        // through can limit the rotation, the radius index finds them
+        for (size_t j = 0; j < obstacles.lidars.size(); j++) {
+            const auto& lidar = obstacles.lidars[j];
+            if (!lidar) {
+                continue;
+            }
+            SourceMinima& minima =
+                source_minima(lidar_minima, lidar_source(obstacles, j), scratch);
+            if (!minima.has_angle[left]) {
+                float& angle = minima.angle[left];
+                angle = M_PI;
+                size_t begin, end;
+                lidar->radius_range(footprint.rotation_r_sq_min(),
+                                    footprint.rotation_r_sq_max(), begin, end);
+                for (size_t i = begin; i < end; i++) {
+                    footprint.rotation(lidar->x[i], lidar->y[i], lidar->r_sq[i], left, angle);
+                }
+                minima.has_angle[left] = true;
+            }
+            min_angle = std::min(min_angle, minima.angle[left]);
+        }
 
-    auto points = ob_points.get_points(ros::Duration(max_age));
-    // draw footprint
-    draw_line(tf2::Vector3(robot_front_length, robot_width, 0),
-              tf2::Vector3(-robot_back_length, robot_width, 0),
-              0.28, 0.5, 1, 10003);
-    draw_line(tf2::Vector3(robot_front_length, -robot_width, 0),
-              tf2::Vector3(-robot_back_length, -robot_width, 0),
-              0.28, 0.5, 1, 10004);
-    draw_line(tf2::Vector3(robot_front_length, robot_width, 0),
-              tf2::Vector3(robot_front_length, -robot_width, 0),
-              0.28, 0.5, 1, 10005);
-    draw_line(tf2::Vector3(-robot_back_length, robot_width, 0),
-              tf2::Vector3(-robot_back_length, -robot_width, 0),
-              0.28, 0.5, 1, 10006);
-
-    for (const auto& p : points) {
-        float x = p.x();
-        float y = p.y();
-        // initial orientation wrt base_link
-        float theta = std::atan2(y, x);
-        float r_squared = x*x + y*y;
-        if (r_squared <= back_diag) {
-           // left line segment:
-           //   y = robot_width, -robot_back_length <= x <= robot_front_length
-           // right line segment:
-           //   y = -robot_width, -robot_back_length <= x <= robot_front_length
-           if (robot_width_sq <= r_squared) {
-               float xi = std::sqrt(r_squared - robot_width_sq);
-               if (-robot_back_length <= xi && xi <= robot_front_length) {
-                   check_angle(theta, xi, robot_width, left, min_angle);
-                   check_angle(theta, xi, -robot_width, left, min_angle);
-               }
-               if (-robot_back_length <= -xi && -xi <= robot_front_length) {
-                   check_angle(theta, -xi, robot_width, left, min_angle);
-                   check_angle(theta, -xi, -robot_width, left, min_angle);
-               }
-           }
-
-           // back line segment:
-           //   x = -robot_back_length, -robot_width <= y <= robot_width
-           if (x < 0 && robot_back_length_sq <= r_squared) {
-               float yi = std::sqrt(r_squared - robot_back_length_sq);
-               if (-robot_width <= yi && yi <= robot_width) {
-                   check_angle(theta, -robot_back_length, yi, left, min_angle);
-               }
-               if (-robot_width <= -yi && -yi <= robot_width) {
-                   check_angle(theta, -robot_back_length, -yi, left, min_angle);
-               }
-           }
-
-           // front line segment:
-           //   x = robot_front_length, -robot_width <= y <= robot_width
-           if (x > 0 && r_squared <= front_diag && robot_front_length_sq <= r_squared) {
-               float yi = std::sqrt(r_squared - robot_front_length_sq);
-               if (-robot_width <= yi && yi <= robot_width) {
-                   check_angle(theta, robot_front_length, yi, left, min_angle);
-               }
-               if (-robot_width <= -yi && -yi <= robot_width) {
-                   check_angle(theta, robot_front_length, -yi, left, min_angle);
-               }
-           }
+        const PlanarPoints& points = obstacles.points;
+        const size_t sonar_points = sonar_point_count(obstacles);
+        for (size_t j = 0; j < sonar_points / 2; j++) {
+            SourceMinima& minima = source_minima(sonar_minima, obstacles.line_sources[j],
+                                                 scratch);
+            if (!minima.has_angle[left]) {
+                float& angle = minima.angle[left];
+                angle = M_PI;
+                for (size_t i = 2 * j; i < 2 * j + 2; i++) {
+                    float x = points.x[i];
+                    float y = points.y[i];
+                    footprint.rotation(x, y, x*x + y*y, left, angle);
+                }
+                minima.has_angle[left] = true;
+            }
+            min_angle = std::min(min_angle, minima.angle[left]);
         }
-    }
 
-    // Draw rotated footprint to show limit of rotation
-    float rotation;
-    if (left) {
-        rotation = min_angle;
-    }
-    else {
-        rotation = -min_angle;
-    }
-    float sin_theta = std::sin(rotation);
-    float cos_theta = std::cos(rotation);
-
-
-    if (std::abs(min_angle) < M_PI) {
-        float x_fl = robot_front_length * cos_theta - robot_width * sin_theta;
-        float y_fl = robot_front_length * sin_theta + robot_width * cos_theta;
-        float x_fr = robot_front_length * cos_theta + robot_width * sin_theta;
-        float y_fr = robot_front_length * sin_theta - robot_width * cos_theta;
-        float x_bl = -robot_back_length * cos_theta - robot_width * sin_theta;
-        float y_bl = -robot_back_length * sin_theta + robot_width * cos_theta;
-        float x_br = -robot_back_length * cos_theta + robot_width * sin_theta;
-        float y_br = -robot_back_length * sin_theta - robot_width * cos_theta;
-        draw_line(tf2::Vector3(x_fl, y_fl, 0), tf2::Vector3(x_bl, y_bl, 0),
-                  1, 0, 0, 10010);
-        draw_line(tf2::Vector3(x_bl, y_bl, 0), tf2::Vector3(x_br, y_br, 0),
-                  1, 0, 0, 10011);
-        draw_line(tf2::Vector3(x_br, y_br, 0), tf2::Vector3(x_fr, y_fr, 0),
-                  1, 0, 0, 10012);
-        draw_line(tf2::Vector3(x_fr, y_fr, 0), tf2::Vector3(x_fl, y_fl, 0),
-                  1, 0, 0, 10013);
+        for (size_t i = sonar_points; i < points.size(); i++) {
+            float x = points.x[i];
+            float y = points.y[i];
+            footprint.rotation(x, y, x*x + y*y, left, min_angle);
+        }
     }
-    else {
-        clear_line(10010);
-        clear_line(10011);
-        clear_line(10012);
-        clear_line(10013);
+
+    visualization_msgs::Marker lines;
+    if (start_lines(lines, ANGLE_MARKER)) {
+        // draw footprint
+        add_footprint(lines, footprint.edges(), 0, 0.28, 0.5, 1);
+
+        // Draw rotated footprint to show limit of rotation
+        if (std::abs(min_angle) < M_PI) {
+            add_footprint(lines, footprint.edges(), left ? min_angle : -min_angle,
+                          1, 0, 0);
+        }
+        line_pub.publish(lines);
     }
 
     ROS_DEBUG("min angle %f\n", degrees(min_angle));
@@ -465,70 +618,201 @@ float CollisionChecker::obstacle_angle(bool left)
 
 
 float CollisionChecker::obstacle_arc_angle(double linear, double angular) {
-    const float radius = (float) std::abs(linear/angular);
-    const bool forward = linear >= 0;
-    const bool left = angular >= 0;
-
-    // Point of rotation relative to base_link
-    const auto point_of_rotation = tf2::Vector3(0, (left) ? radius : -radius, 0);
-
-    // Critical robot corners relative to point of rotation
-    const auto outer_point = tf2::Vector3(-robot_back_length,
-            (left) ? -robot_width: robot_width, 0) - point_of_rotation;
-    const auto inner_point = tf2::Vector3(robot_front_length,
-            (left) ? robot_width: -robot_width, 0) - point_of_rotation;
-
-    // Critical robot points in polar (r^2, theta) form relative to center
-    // of rotation
-    const float outer_radius_sq = outer_point.length2();
-    const float outer_theta = std::atan2(outer_point.y(), outer_point.x());
-    const float inner_radius_sq = inner_point.length2();
-    //Not used const float inner_theta = std::atan2(inner_point.x(), -inner_point.y());
-
-    // Utility function to make sure that the angle relevant and not behind the robot
-    const auto angle_relevant = [&outer_theta, &left, &forward](float angle) -> bool {
-        if (forward) {
-            if (left) {
-                return angle > outer_theta;
-            } else {
-                return angle < outer_theta;
-            }
-        } else {
-            if (angle < 0) {
-                angle += 2.0 * M_PI;
-            }
+    const std::lock_guard<std::mutex> lock(obstacle_mutex);
+    get_snapshot(snapshot);
+    return obstacle_arc_angle(snapshot, linear, angular);
+}
+
+// Angle turned in direction dir (+1 counterclockwise, -1 clockwise) to
+// get from angle from to angle to, in the range [0, 2*PI)
 
-            if (left) {
-                return angle < outer_theta;
-            } else {
-                return angle > outer_theta;
+static float turn_angle(float from, float to, float dir)
+{
+    float angle = std::fmod(dir * (to - from), (float)(2 * M_PI));
+    return (angle < 0) ? angle + 2 * M_PI : angle;
+}
+
+float CollisionChecker::obstacle_arc_angle(const ObstacleSnapshot& obstacles,
+                                           double linear, double angular) {
+    if (use_polygon) {
+        return obstacle_arc_angle_for(polygon, obstacles, linear, angular);
+    }
+    return obstacle_arc_angle_for(rectangle, obstacles, linear, angular);
+}
+
+template <class Footprint>
+float CollisionChecker::obstacle_arc_angle_for(const Footprint& footprint,
+                                               const ObstacleSnapshot& obstacles,
+                                               double linear, double angular) {
+    // Going straight there is no arc to limit
+    if (angular == 0.0) {
+        return M_PI;
+    }
+
+    // The robot turns about the instantaneous center of rotation, on
+    // base_link's y axis.  Relative to the robot, the obstacles turn the
+    // other way about the same center.
+    const float cy = linear / angular;
+    const float dir = (angular > 0) ? 1.0 : -1.0;
+
+    const FootprintEdges& edges = footprint.edges();
+
+    // The footprint only sweeps through the annulus between its closest
+    // point to the center and its furthest corner
+    float r_sq_max = 0;
+    for (int k = 0; k < edges.n; k++) {
+        float dy = edges.y[k] - cy;
+        r_sq_max = std::max(r_sq_max, edges.x[k] * edges.x[k] + dy * dy);
+    }
+    const float r_sq_min = footprint.dist_sq(0, cy);
+
+    // Seen from a center outside it, the footprint spans less than half
+    // a turn, from phi0 + phi_lo to phi0 + phi_hi.  A point has to turn
+    // at least to the nearer end of that to touch it.
+    const bool bounded = r_sq_min > 0;
+    const float phi0 = std::atan2(edges.y[0] - cy, edges.x[0]);
+    float phi_lo = 0, phi_hi = 0;
+    for (int k = 1; bounded && k < edges.n; k++) {
+        float d = std::remainder(std::atan2(edges.y[k] - cy, edges.x[k]) - phi0,
+                                 (float)(2 * M_PI));
+        phi_lo = std::min(phi_lo, d);
+        phi_hi = std::max(phi_hi, d);
+    }
+    // rounding mustn't skip a point that touches at the very end
+    phi_lo -= 1e-4;
+    phi_hi += 1e-4;
+
+    float closest_angle = M_PI;
+
+    // A point follows a circle about the center, it first touches the
+    // footprint where that circle crosses one of the footprint's edges
+    const auto check_point = [&](float px, float py) {
+        const float dy = py - cy;
+        const float r_sq = px * px + dy * dy;
+        if (r_sq < r_sq_min || r_sq > r_sq_max) {
+            return;
+        }
+
+        // Skip the edges unless the point could come closer than the
+        // closest so far
+        const float theta = std::atan2(dy, px);
+        if (bounded) {
+            float d = std::remainder(theta - phi0, (float)(2 * M_PI));
+            if (d < phi_lo || d > phi_hi) {
+                float earliest = std::min(turn_angle(phi0 + phi_lo, theta, dir),
+                                          turn_angle(phi0 + phi_hi, theta, dir));
+                if (earliest >= closest_angle) {
+                    return;
+                }
             }
         }
+
+        if (footprint.inside(px, py)) {
+            closest_angle = 0;
+            return;
+        }
+        footprint.circle_crossings(cy, r_sq, [&](float x, float y) {
+            float angle = turn_angle(std::atan2(y - cy, x), theta, dir);
+            closest_angle = std::min(closest_angle, angle);
+        });
     };
 
-    float closest_angle = M_PI;
-    const auto points = ob_points.get_points(ros::Duration(max_age));
-    for (const auto& p : points) {
-        // Trasform the obstacle point into the coordiate system with the
-        // point of rotation at the origin, with the same orientation as base_link
-        const tf2::Vector3 p_in_rot = p - point_of_rotation;
-        // Radius for polar coordinates around center of rotation
-        const float p_radius_sq = p_in_rot.length2();
-
-        if(p_radius_sq < outer_radius_sq && p_radius_sq > inner_radius_sq) {
-            // Angle for polar coordinates around center of rotation
-            const float p_theta = std::atan2(p_in_rot.y(), p_in_rot.x());
-            if (angle_relevant(p_theta) && p_theta < M_PI) {
-                // TODO: This assumes that any collision with the point will be
-                // on the leading part of the robot, when in reality we can turn more
-                // than this amount if the point only causes a collision with the rear
-                // part of the robot as it swings around for a turn
-                closest_angle = std::min(closest_angle, p_theta);
-            }
+    // Points further than this from base_link are outside the annulus,
+    // so the radius index can skip them
+    const float base_r_min = std::max(0.0f, std::sqrt(r_sq_min) - std::abs(cy));
+    const float base_r_max = std::sqrt(r_sq_max) + std::abs(cy);
+
+    for (const auto& lidar : obstacles.lidars) {
+        if (!lidar) {
+            continue;
         }
+        size_t begin, end;
+        lidar->radius_range(base_r_min * base_r_min, base_r_max * base_r_max,
+                            begin, end);
+        for (size_t i = begin; i < end && closest_angle > 0; i++) {
+            check_point(lidar->x[i], lidar->y[i]);
+        }
+    }
+    const PlanarPoints& points = obstacles.points;
+    for (size_t i = 0; i < points.size() && closest_angle > 0; i++) {
+        check_point(points.x[i], points.y[i]);
     }
 
-    // TODO: Check obstacle lines for intersection with robot arc
+    // The end points of the sonar lines are in obstacles.points, so only
+    // the footprint corners hitting the middle of a line are left
+    for (const auto& line : obstacles.lines) {
+        if (closest_angle <= 0) {
+            break;
+        }
+        const float ax = line.first.x();
+        const float ay = line.first.y() - cy;
+        const float ux = line.second.x() - line.first.x();
+        const float uy = line.second.y() - line.first.y();
+        const float len_sq = ux * ux + uy * uy;
+        if (len_sq == 0) {
+            continue;
+        }
+
+        // Range of distances of the line from the center
+        float t = std::max(0.0f, std::min(1.0f, -(ax * ux + ay * uy) / len_sq));
+        float nx = ax + t * ux;
+        float ny = ay + t * uy;
+        const float d_sq_min = nx * nx + ny * ny;
+        const float d_sq_max = std::max(ax * ax + ay * ay,
+            (ax + ux) * (ax + ux) + (ay + uy) * (ay + uy));
+        if (d_sq_max < r_sq_min || d_sq_min > r_sq_max) {
+            continue;
+        }
+
+        // A line through the footprint collides already
+        float t0 = 0, t1 = 1;
+        bool crosses = true;
+        for (int k = 0; k < edges.n && crosses; k++) {
+            const float p = edges.nx[k] * ux + edges.ny[k] * uy;
+            const float q = edges.c[k] - edges.nx[k] * ax - edges.ny[k] * (ay + cy);
+            if (p == 0) {
+                crosses = q >= 0;
+            }
+            else if (p < 0) {
+                t0 = std::max(t0, q / p);
+            }
+            else {
+                t1 = std::min(t1, q / p);
+            }
+        }
+        if (crosses && t0 <= t1) {
+            closest_angle = 0;
+            break;
+        }
+
+        // Each corner follows a circle about the center, in the opposite
+        // direction to the obstacles
+        for (int k = 0; k < edges.n; k++) {
+            const float kx = edges.x[k];
+            const float ky = edges.y[k] - cy;
+            const float rk_sq = kx * kx + ky * ky;
+            if (rk_sq < d_sq_min || rk_sq > d_sq_max) {
+                continue;
+            }
+
+            // |a + t u|^2 = rk^2
+            const float b = ax * ux + ay * uy;
+            const float c = ax * ax + ay * ay - rk_sq;
+            const float disc = b * b - len_sq * c;
+            if (disc < 0) {
+                continue;
+            }
+            const float root = std::sqrt(disc);
+            const float theta = std::atan2(ky, kx);
+            for (float tk : {(-b - root) / len_sq, (-b + root) / len_sq}) {
+                if (0 <= tk && tk <= 1) {
+                    float angle = turn_angle(theta,
+                        std::atan2(ay + tk * uy, ax + tk * ux), dir);
+                    closest_angle = std::min(closest_angle, angle);
+                }
+            }
+        }
+    }
 
     return closest_angle;
 }
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <cstdlib>
+#include <cctype>
+#include <limits>
+
+#include "move_basic/footprint.h"
+
+// Normals closer than this to an axis don't bound the footprint along it
+static const float EDGE_EPS = 1e-3;
+
+// Squared distance from (px, py) to edge k
+static float edge_dist_sq(const FootprintEdges& edges, int k, float px, float py)
+{
+    float t = ((px - edges.x[k]) * edges.dx[k] + (py - edges.y[k]) * edges.dy[k]) /
+              edges.len_sq[k];
+    t = std::max(0.0f, std::min(1.0f, t));
+    const float x = edges.x[k] + t * edges.dx[k] - px;
+    const float y = edges.y[k] + t * edges.dy[k] - py;
+    return x * x + y * y;
+}
+
+bool FootprintEdges::set(const std::vector<float>& px, const std::vector<float>& py)
+{
+    const int count = px.size();
+    if (count < 3 || count > MAX_CORNERS || py.size() != px.size()) {
+        return false;
+    }
+
+    // Twice the signed area, negative if the corners are clockwise
+    double area = 0;
+    for (int k = 0; k < count; k++) {
+        int next = (k + 1) % count;
+        area += px[k] * py[next] - px[next] * py[k];
+    }
+    if (!(area > 0 || area < 0)) {
+        return false;
+    }
+
+    FootprintEdges edges;
+    edges.n = count;
+    for (int k = 0; k < count; k++) {
+        int i = (area > 0) ? k : count - 1 - k;
+        edges.x[k] = px[i];
+        edges.y[k] = py[i];
+    }
+    for (int k = 0; k < count; k++) {
+        int next = (k + 1) % count;
+        edges.dx[k] = edges.x[next] - edges.x[k];
+        edges.dy[k] = edges.y[next] - edges.y[k];
+        edges.len_sq[k] = edges.dx[k] * edges.dx[k] + edges.dy[k] * edges.dy[k];
+        if (!(edges.len_sq[k] > 0)) {
+            return false;
+        }
+        const float len = std::sqrt(edges.len_sq[k]);
+        edges.nx[k] = edges.dy[k] / len;
+        edges.ny[k] = -edges.dx[k] / len;
+        edges.c[k] = edges.nx[k] * edges.x[k] + edges.ny[k] * edges.y[k];
+    }
+
+    // Convex if every corner is inside every edge
+    for (int k = 0; k < count; k++) {
+        for (int j = 0; j < count; j++) {
+            if (edges.nx[k] * edges.x[j] + edges.ny[k] * edges.y[j] > edges.c[k] + 1e-6f) {
+                return false;
+            }
+        }
+    }
+
+    *this = edges;
+    return true;
+}
+
+bool FootprintEdges::inside(float px, float py) const
+{
+    for (int k = 0; k < n; k++) {
+        if (nx[k] * px + ny[k] * py > c[k]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+float FootprintEdges::dist_sq(float px, float py) const
+{
+    if (inside(px, py)) {
+        return 0;
+    }
+    float d_sq = std::numeric_limits<float>::infinity();
+    for (int k = 0; k < n; k++) {
+        d_sq = std::min(d_sq, edge_dist_sq(*this, k, px, py));
+    }
+    return d_sq;
+}
+
+static bool skip_to(const char*& p, char c)
+{
+    while (std::isspace(*p)) {
+        p++;
+    }
+    if (*p != c) {
+        return false;
+    }
+    p++;
+    return true;
+}
+
+static bool read_float(const char*& p, float& v)
+{
+    char* end;
+    v = std::strtof(p, &end);
+    if (end == p) {
+        return false;
+    }
+    p = end;
+    return true;
+}
+
+bool parse_footprint(const std::string& text, std::vector<float>& x,
+                     std::vector<float>& y)
+{
+    x.clear();
+    y.clear();
+    const char* p = text.c_str();
+    if (!skip_to(p, '[')) {
+        return false;
+    }
+    do {
+        float px, py;
+        if (!skip_to(p, '[') || !read_float(p, px) || !skip_to(p, ',') ||
+            !read_float(p, py) || !skip_to(p, ']')) {
+            return false;
+        }
+        x.push_back(px);
+        y.push_back(py);
+    } while (skip_to(p, ','));
+    if (!skip_to(p, ']')) {
+        return false;
+    }
+    while (std::isspace(*p)) {
+        p++;
+    }
+    return *p == '\0' && x.size() >= 3;
+}
+
+RectangleFootprint::RectangleFootprint()
+{
+    FootprintBand none = {0, 0, 0};
+    *this = RectangleFootprint(none);
+}
+
+RectangleFootprint::RectangleFootprint(const FootprintBand& band) : band(band)
+{
+    width_sq = band.width * band.width;
+    front_length_sq = band.front_length * band.front_length;
+    back_length_sq = band.back_length * band.back_length;
+
+    // To test if obstacles will intersect when rotating
+    front_diag = width_sq + front_length_sq;
+    back_diag = width_sq + back_length_sq;
+
+    // Points closer than this are inside the footprint at every angle
+    r_sq_min = std::min(width_sq, std::min(front_length_sq, back_length_sq));
+
+    corners.set({band.front_length, -band.back_length, -band.back_length, band.front_length},
+                {band.width, band.width, -band.width, -band.width});
+}
+
+inline void RectangleFootprint::check_dist(float x, FootprintDistances& dist) const
+{
+    if (x > band.front_length && x < dist.forward) {
+        dist.forward = x;
+    }
+    if (-x > band.back_length && -x < dist.back) {
+        dist.back = -x;
+    }
+}
+
+/*
+ Lower the distances to account for a line segment, sonar cone ends,
+ in front, behind and either side of the footprint
+*/
+void RectangleFootprint::line_dist(float x0, float y0, float x1, float y1,
+                                   FootprintDistances& dist) const
+{
+    const float robot_width = band.width;
+    const float robot_front_length = band.front_length;
+    const float robot_back_length = band.back_length;
+
+    // Forward and rear limits
+    if (y0 < -robot_width && robot_width < y1) {
+        // linear interpolate to get closest point inside width
+        float ylen = y1 - y0;
+        float a0 = (y0 - robot_width) / ylen;
+        float a1 = (y1 - robot_width - y0) / ylen;
+        check_dist(a0 * x0 + (1.0 - a0) * x1, dist);
+        check_dist(a1 * x1 + (1.0 - a1) * x0, dist);
+    }
+    else if (y1 < -robot_width && robot_width < y0) {
+        // linear interpolate to get closest point inside width
+        float ylen = y0 - y1;
+        float a0 = (y0 - robot_width - y1) / ylen;
+        float a1 = (y1 - robot_width) / ylen;
+        check_dist(a0 * x0 + (1.0 - a0) * x1, dist);
+        check_dist(a1 * x1 + (1.0 - a1) * x0, dist);
+    }
+    else {
+        if (-robot_width < y0 && y0 < robot_width) {
+            check_dist(x0, dist);
+        }
+        if (-robot_width < y1 && y1 < robot_width) {
+            check_dist(x1, dist);
+        }
+    }
+    // Sides
+    if (x0 < -robot_back_length && x1 > robot_front_length) {
+        // linear interpolate to get closest point in side
+        float xlen = x1 - x0;
+        float ab = (-x0 - robot_back_length) / xlen;
+        float af = (x1 - robot_front_length - x0) / xlen;
+        float yb = ab * y0 + (1.0 - ab) * y1;
+        float yf = af * y1 + (1.0 - af) * y0;
+        if (yb > 0 && yb < dist.left) {
+            dist.left = yb;
+        }
+        if (yb < 0 && -yb < dist.right) {
+            dist.right = -yb;
+        }
+        if (yf> 0 && yf < dist.left) {
+            dist.left = yf;
+        }
+        if (yf < 0 && -yf < dist.right) {
+            dist.right = -yf;
+        }
+    }
+    else if (x1 < -robot_back_length && x0 > robot_front_length) {
+        // linear interpolate to get closest point in side
+        float xlen = x0 - x1;
+        float ab = (-x1 - robot_back_length) / xlen;
+        float af = (x0 - robot_front_length - x1) / xlen;
+        float yb = ab * y1 + (1.0 - ab) * y0;
+        float yf = af * y0 + (1.0 - af) * y1;
+        if (yb > 0 && yb < dist.left) {
+            dist.left = yb;
+        }
+        if (yb < 0 && -yb < dist.right) {
+            dist.right = -yb;
+        }
+        if (yf> 0 && yf < dist.left) {
+            dist.left = yf;
+        }
+        if (yf < 0 && -yf < dist.right) {
+            dist.right = -yf;
+        }
+    }
+    else {
+        if (x0 > -robot_back_length && x0 < robot_front_length) {
+            if (y0 > 0 && y0 < dist.left) {
+                dist.left = y0;
+            }
+            if (y0 < 0 && -y0 < dist.right) {
+                dist.right = -y0;
+            }
+        }
+        if (x1 > -robot_back_length && x1 < robot_front_length) {
+            if (y1> 0 && y1 < dist.left) {
+                dist.left = y1;
+            }
+            if (y1 < 0 && -y1 < dist.right) {
+                dist.right = -y1;
+            }
+        }
+    }
+}
+
+bool PolygonFootprint::set(const std::vector<float>& x, const std::vector<float>& y)
+{
+    FootprintEdges edges;
+    if (!edges.set(x, y)) {
+        return false;
+    }
+
+    Bound front, back, left, right;
+    front.n = back.n = left.n = right.n = 0;
+    for (int k = 0; k < edges.n; k++) {
+        const float nx = edges.nx[k];
+        const float ny = edges.ny[k];
+        const float c = edges.c[k];
+        Bound* along = (nx > EDGE_EPS) ? &front : (nx < -EDGE_EPS) ? &back : NULL;
+        if (along) {
+            along->a[along->n] = c / nx;
+            along->b[along->n++] = -ny / nx;
+        }
+        Bound* across = (ny > EDGE_EPS) ? &left : (ny < -EDGE_EPS) ? &right : NULL;
+        if (across) {
+            across->a[across->n] = c / ny;
+            across->b[across->n++] = -nx / ny;
+        }
+    }
+    if (front.n == 0 || back.n == 0 || left.n == 0 || right.n == 0) {
+        return false;
+    }
+
+    corners = edges;
+    ahead = front;
+    behind = back;
+    left_side = left;
+    right_side = right;
+
+    x_min = *std::min_element(edges.x, edges.x + edges.n);
+    x_max = *std::max_element(edges.x, edges.x + edges.n);
+    y_min = *std::min_element(edges.y, edges.y + edges.n);
+    y_max = *std::max_element(edges.y, edges.y + edges.n);
+    band.front_length = x_max;
+    band.back_length = -x_min;
+    band.width = std::max(y_max, -y_min);
+
+    // Turning in place the footprint sweeps the annulus between its
+    // furthest corner and, if base_frame is inside it, its closest edge
+    r_sq_max = 0;
+    r_sq_min = edges.inside(0, 0) ? std::numeric_limits<float>::infinity() : 0;
+    for (int k = 0; k < edges.n; k++) {
+        r_sq_max = std::max(r_sq_max, edges.x[k] * edges.x[k] + edges.y[k] * edges.y[k]);
+        r_sq_min = std::min(r_sq_min, edge_dist_sq(edges, k, 0, 0));
+    }
+    return true;
+}
+
+/*
+ Lower the distances to account for a line segment.  Along the line the
+ distances are linear between the corners' x and y, so the closest points
+ are at those or at the ends.
+*/
+void PolygonFootprint::line_dist(float x0, float y0, float x1, float y1,
+                                 FootprintDistances& dist) const
+{
+    const float ux = x1 - x0;
+    const float uy = y1 - y0;
+    float xs[2 * FootprintEdges::MAX_CORNERS + 3];
+    float ys[2 * FootprintEdges::MAX_CORNERS + 3];
+    int n = 0;
+    xs[n] = x0;
+    ys[n++] = y0;
+    xs[n] = x1;
+    ys[n++] = y1;
+    // The crossings keep the exact coordinate, so that those at the
+    // extremes of the footprint aren't rounded off it
+    const auto cross_x = [&](float x) {
+        float t = (x - x0) / ux;
+        if (ux != 0 && 0 < t && t < 1) {
+            xs[n] = x;
+            ys[n++] = y0 + t * uy;
+        }
+    };
+    const auto cross_y = [&](float y) {
+        float t = (y - y0) / uy;
+        if (uy != 0 && 0 < t && t < 1) {
+            xs[n] = x0 + t * ux;
+            ys[n++] = y;
+        }
+    };
+    for (int k = 0; k < corners.n; k++) {
+        cross_x(corners.x[k]);
+        cross_y(corners.y[k]);
+    }
+
+    // The ends of the edges count here, where a line is stopped by a
+    // corner
+    for (int i = 0; i < n; i++) {
+        const float x = xs[i];
+        const float y = ys[i];
+        if (y_min <= y && y <= y_max) {
+            const float front = front_at(y);
+            const float back = back_at(y);
+            if (x > front) {
+                dist.forward = std::min(dist.forward, x - front + band.front_length);
+            }
+            if (x < back) {
+                dist.back = std::min(dist.back, back - x + band.back_length);
+            }
+        }
+        if (x_min <= x && x <= x_max) {
+            check_side(x, y, dist);
+        }
+    }
+}
+
+/*
+ The centres of the occupied cells stand in for the points, those in the
+ rows across the footprint and the columns along it
+*/
+void PolygonFootprint::grid_dist(const ObstacleGrid& grid, FootprintDistances& dist) const
+{
+    const float half = 0.5f * grid.size() * grid.cell_size();
+    const auto check = [&](float x, float y) {
+        check_point(x, y, dist);
+    };
+    grid.for_each_cell(-half, half, y_min, y_max, check);
+    grid.for_each_cell(x_min, x_max, -half, half, check);
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+/*
+ The footprint distance kernels find, over a set of obstacle points, the
+ closest point in front of and behind the footprint (within its width),
+ and the closest point either side of it (within its length).
+
+ The vector versions evaluate the same comparisons as the scalar version
+ on several points at once, replacing the branches with masks.  Points
+ that fail a test are given an infinite distance, and the minimum is
+ taken across lanes at the end.  As taking a minimum is exact and does
+ not depend on order, all versions give the same results.
+*/
+
+#include "move_basic/footprint_kernels.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX_DISPATCH
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+typedef void (*FootprintKernel)(const float*, const float*, size_t,
+                                const FootprintBand&, FootprintDistances&);
+
+// Check a single point, used by all versions for the left over points
+static inline void check_point(float x, float y, const FootprintBand& band,
+                               FootprintDistances& dist)
+{
+    // Forward and rear
+    if (-band.width < y && y < band.width) {
+        if (x > band.front_length && x < dist.forward) {
+            dist.forward = x;
+        }
+        if (-x > band.back_length && -x < dist.back) {
+            dist.back = -x;
+        }
+    }
+    // Sides
+    if (x > -band.back_length && x < band.front_length) {
+        if (y > 0 && y < dist.left) {
+            dist.left = y;
+        }
+        else if (y < 0 && -y < dist.right) {
+            dist.right = -y;
+        }
+    }
+}
+
+void footprint_dist_scalar(const float* x, const float* y, size_t n,
+                           const FootprintBand& band, FootprintDistances& dist)
+{
+    for (size_t i = 0; i < n; i++) {
+        check_point(x[i], y[i], band, dist);
+    }
+}
+
+#if defined(__SSE2__)
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline float hmin_ps(__m128 v)
+{
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(v);
+}
+
+static void footprint_dist_sse2(const float* x, const float* y, size_t n,
+                                const FootprintBand& band, FootprintDistances& dist)
+{
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 width = _mm_set1_ps(band.width);
+    const __m128 neg_width = _mm_set1_ps(-band.width);
+    const __m128 front = _mm_set1_ps(band.front_length);
+    const __m128 back = _mm_set1_ps(band.back_length);
+    const __m128 neg_back = _mm_set1_ps(-band.back_length);
+
+    __m128 min_forward = inf, min_back = inf, min_left = inf, min_right = inf;
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128 px = _mm_loadu_ps(x + i);
+        const __m128 py = _mm_loadu_ps(y + i);
+        const __m128 nx = _mm_xor_ps(px, sign);
+        const __m128 ny = _mm_xor_ps(py, sign);
+
+        const __m128 in_width = _mm_and_ps(_mm_cmplt_ps(neg_width, py),
+                                           _mm_cmplt_ps(py, width));
+        const __m128 ahead = _mm_and_ps(in_width, _mm_cmpgt_ps(px, front));
+        const __m128 behind = _mm_and_ps(in_width, _mm_cmpgt_ps(nx, back));
+        min_forward = _mm_min_ps(min_forward, select_ps(ahead, px, inf));
+        min_back = _mm_min_ps(min_back, select_ps(behind, nx, inf));
+
+        const __m128 in_length = _mm_and_ps(_mm_cmpgt_ps(px, neg_back),
+                                            _mm_cmplt_ps(px, front));
+        const __m128 left = _mm_and_ps(in_length, _mm_cmpgt_ps(py, zero));
+        const __m128 right = _mm_and_ps(in_length, _mm_cmplt_ps(py, zero));
+        min_left = _mm_min_ps(min_left, select_ps(left, py, inf));
+        min_right = _mm_min_ps(min_right, select_ps(right, ny, inf));
+    }
+
+    dist.forward = std::min(dist.forward, hmin_ps(min_forward));
+    dist.back = std::min(dist.back, hmin_ps(min_back));
+    dist.left = std::min(dist.left, hmin_ps(min_left));
+    dist.right = std::min(dist.right, hmin_ps(min_right));
+
+    for (; i < n; i++) {
+        check_point(x[i], y[i], band, dist);
+    }
+}
+#endif
+
+#if defined(HAVE_AVX_DISPATCH)
+__attribute__((target("avx")))
+static inline float hmin256_ps(__m256 v)
+{
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(m);
+}
+
+__attribute__((target("avx")))
+static void footprint_dist_avx(const float* x, const float* y, size_t n,
+                               const FootprintBand& band, FootprintDistances& dist)
+{
+    const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256 width = _mm256_set1_ps(band.width);
+    const __m256 neg_width = _mm256_set1_ps(-band.width);
+    const __m256 front = _mm256_set1_ps(band.front_length);
+    const __m256 back = _mm256_set1_ps(band.back_length);
+    const __m256 neg_back = _mm256_set1_ps(-band.back_length);
+
+    __m256 min_forward = inf, min_back = inf, min_left = inf, min_right = inf;
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 px = _mm256_loadu_ps(x + i);
+        const __m256 py = _mm256_loadu_ps(y + i);
+        const __m256 nx = _mm256_xor_ps(px, sign);
+        const __m256 ny = _mm256_xor_ps(py, sign);
+
+        const __m256 in_width = _mm256_and_ps(_mm256_cmp_ps(neg_width, py, _CMP_LT_OQ),
+                                              _mm256_cmp_ps(py, width, _CMP_LT_OQ));
+        const __m256 ahead = _mm256_and_ps(in_width, _mm256_cmp_ps(px, front, _CMP_GT_OQ));
+        const __m256 behind = _mm256_and_ps(in_width, _mm256_cmp_ps(nx, back, _CMP_GT_OQ));
+        min_forward = _mm256_min_ps(min_forward, _mm256_blendv_ps(inf, px, ahead));
+        min_back = _mm256_min_ps(min_back, _mm256_blendv_ps(inf, nx, behind));
+
+        const __m256 in_length = _mm256_and_ps(_mm256_cmp_ps(px, neg_back, _CMP_GT_OQ),
+                                               _mm256_cmp_ps(px, front, _CMP_LT_OQ));
+        const __m256 left = _mm256_and_ps(in_length, _mm256_cmp_ps(py, zero, _CMP_GT_OQ));
+        const __m256 right = _mm256_and_ps(in_length, _mm256_cmp_ps(py, zero, _CMP_LT_OQ));
+        min_left = _mm256_min_ps(min_left, _mm256_blendv_ps(inf, py, left));
+        min_right = _mm256_min_ps(min_right, _mm256_blendv_ps(inf, ny, right));
+    }
+
+    dist.forward = std::min(dist.forward, hmin256_ps(min_forward));
+    dist.back = std::min(dist.back, hmin256_ps(min_back));
+    dist.left = std::min(dist.left, hmin256_ps(min_left));
+    dist.right = std::min(dist.right, hmin256_ps(min_right));
+
+    for (; i < n; i++) {
+        check_point(x[i], y[i], band, dist);
+    }
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline float hmin_f32(float32x4_t v)
+{
+#if defined(__aarch64__)
+    return vminvq_f32(v);
+#else
+    float32x2_t m = vpmin_f32(vget_low_f32(v), vget_high_f32(v));
+    m = vpmin_f32(m, m);
+    return vget_lane_f32(m, 0);
+#endif
+}
+
+static void footprint_dist_neon(const float* x, const float* y, size_t n,
+                                const FootprintBand& band, FootprintDistances& dist)
+{
+    const float32x4_t inf = vdupq_n_f32(std::numeric_limits<float>::infinity());
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t width = vdupq_n_f32(band.width);
+    const float32x4_t neg_width = vdupq_n_f32(-band.width);
+    const float32x4_t front = vdupq_n_f32(band.front_length);
+    const float32x4_t back = vdupq_n_f32(band.back_length);
+    const float32x4_t neg_back = vdupq_n_f32(-band.back_length);
+
+    float32x4_t min_forward = inf, min_back = inf, min_left = inf, min_right = inf;
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t px = vld1q_f32(x + i);
+        const float32x4_t py = vld1q_f32(y + i);
+        const float32x4_t nx = vnegq_f32(px);
+        const float32x4_t ny = vnegq_f32(py);
+
+        const uint32x4_t in_width = vandq_u32(vcltq_f32(neg_width, py),
+                                              vcltq_f32(py, width));
+        const uint32x4_t ahead = vandq_u32(in_width, vcgtq_f32(px, front));
+        const uint32x4_t behind = vandq_u32(in_width, vcgtq_f32(nx, back));
+        min_forward = vminq_f32(min_forward, vbslq_f32(ahead, px, inf));
+        min_back = vminq_f32(min_back, vbslq_f32(behind, nx, inf));
+
+        const uint32x4_t in_length = vandq_u32(vcgtq_f32(px, neg_back),
+                                               vcltq_f32(px, front));
+        const uint32x4_t left = vandq_u32(in_length, vcgtq_f32(py, zero));
+        const uint32x4_t right = vandq_u32(in_length, vcltq_f32(py, zero));
+        min_left = vminq_f32(min_left, vbslq_f32(left, py, inf));
+        min_right = vminq_f32(min_right, vbslq_f32(right, ny, inf));
+    }
+
+    dist.forward = std::min(dist.forward, hmin_f32(min_forward));
+    dist.back = std::min(dist.back, hmin_f32(min_back));
+    dist.left = std::min(dist.left, hmin_f32(min_left));
+    dist.right = std::min(dist.right, hmin_f32(min_right));
+
+    for (; i < n; i++) {
+        check_point(x[i], y[i], band, dist);
+    }
+}
+#endif
+
+struct KernelChoice
+{
+    FootprintKernel kernel;
+    const char* name;
+};
+
+// Pick the widest implementation that this CPU supports
+static KernelChoice select_kernel()
+{
+#if defined(HAVE_AVX_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        return {footprint_dist_avx, "avx"};
+    }
+#endif
+#if defined(__SSE2__)
+    return {footprint_dist_sse2, "sse2"};
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return {footprint_dist_neon, "neon"};
+#else
+    return {footprint_dist_scalar, "scalar"};
+#endif
+}
+
+static const KernelChoice& kernel_choice()
+{
+    static const KernelChoice choice = select_kernel();
+    return choice;
+}
+
+void footprint_dist(const float* x, const float* y, size_t n,
+                    const FootprintBand& band, FootprintDistances& dist)
+{
+    kernel_choice().kernel(x, y, n, band, dist);
+}
+
+const char* footprint_kernel_name()
+{
+    return kernel_choice().name;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include "move_basic/latency_trace.h"
+
+#include <algorithm>
+#include <iomanip>
+
+const char* const LatencyTrace::STAGE_NAMES[NUM_STAGES] =
+    {"sensor", "snapshot", "query start", "query end", "command"};
+
+void LatencyTrace::Cycle::clear()
+{
+    std::fill(time, time + NUM_STAGES, 0.0);
+}
+
+LatencyTrace::LatencyTrace(size_t capacity) :
+    on_flag(false), capacity(std::max<size_t>(capacity, 1)),
+    next_callback(0), next_cycle(0)
+{
+    callbacks.reserve(this->capacity);
+    cycles.reserve(this->capacity);
+}
+
+void LatencyTrace::record_callback(double stamp, double entry)
+{
+    if (!enabled()) {
+        return;
+    }
+    const std::lock_guard<std::mutex> lock(mutex);
+    Callback callback = {stamp, entry};
+    if (callbacks.size() < capacity) {
+        callbacks.push_back(callback);
+    }
+    else {
+        callbacks[next_callback] = callback;
+    }
+    next_callback = (next_callback + 1) % capacity;
+}
+
+void LatencyTrace::record_cycle(const Cycle& cycle)
+{
+    if (!enabled()) {
+        return;
+    }
+    const std::lock_guard<std::mutex> lock(mutex);
+    if (cycles.size() < capacity) {
+        cycles.push_back(cycle);
+    }
+    else {
+        cycles[next_cycle] = cycle;
+    }
+    next_cycle = (next_cycle + 1) % capacity;
+}
+
+// Percentiles of the durations, which are reordered
+
+static LatencyTrace::Percentiles percentiles(std::vector<double>& durations)
+{
+    LatencyTrace::Percentiles p = {durations.size(), 0, 0, 0, 0};
+    if (durations.empty()) {
+        return p;
+    }
+    std::sort(durations.begin(), durations.end());
+    auto at = [&durations](double fraction) {
+        return durations[std::min(durations.size() - 1,
+                                  static_cast<size_t>(fraction * durations.size()))];
+    };
+    p.p50 = at(0.5);
+    p.p90 = at(0.9);
+    p.p99 = at(0.99);
+    p.max = durations.back();
+    return p;
+}
+
+LatencyTrace::Summary LatencyTrace::summarize() const
+{
+    Summary summary;
+    std::vector<double> durations;
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    durations.reserve(capacity);
+    for (const Callback& callback : callbacks) {
+        durations.push_back(callback.entry - callback.stamp);
+    }
+    summary.callback = percentiles(durations);
+
+    // Commands that didn't reach both stages don't count
+    auto between = [&](int from, int to) {
+        durations.clear();
+        for (const Cycle& cycle : cycles) {
+            if (cycle.time[from] > 0 && cycle.time[to] > 0) {
+                durations.push_back(cycle.time[to] - cycle.time[from]);
+            }
+        }
+        return percentiles(durations);
+    };
+    for (int k = 0; k < NUM_STAGES - 1; k++) {
+        summary.interval[k] = between(k, k + 1);
+    }
+    summary.end_to_end = between(SENSOR, COMMAND);
+    return summary;
+}
+
+// The callbacks are on one track and the commands on another, with an
+// event for each stage named after the stage it ends at
+
+void LatencyTrace::write_chrome_trace(std::ostream& out) const
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+    bool first = true;
+    auto event = [&](const char* name, int tid, double start, double end) {
+        out << (first ? "\n" : ",\n") << "{\"name\":\"" << name
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+            << ",\"ts\":" << start * 1e6 << ",\"dur\":" << (end - start) * 1e6 << "}";
+        first = false;
+    };
+
+    out << std::fixed << std::setprecision(1) << "{\"traceEvents\":[";
+    for (const Callback& callback : callbacks) {
+        event("callback", 1, callback.stamp, callback.entry);
+    }
+    for (const Cycle& cycle : cycles) {
+        for (int k = 0; k < NUM_STAGES - 1; k++) {
+            if (cycle.time[k] > 0 && cycle.time[k + 1] > 0) {
+                event(STAGE_NAMES[k + 1], 2, cycle.time[k], cycle.time[k + 1]);
+            }
+        }
+    }
+    out << "\n]}\n";
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include "move_basic/loop_stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+const double LoopStats::BUCKET_LIMITS[NUM_BUCKETS - 1] = {0.25, 0.5, 0.75, 1.0, 1.5};
+
+LoopStats::LoopStats() : running(false)
+{
+    current.period = 0;
+    current.total_overruns = 0;
+    clear();
+}
+
+void LoopStats::clear()
+{
+    current.iterations = 0;
+    current.overruns = 0;
+    current.mean_duration = 0;
+    current.max_duration = 0;
+    current.mean_jitter = 0;
+    current.max_jitter = 0;
+    std::fill(current.histogram, current.histogram + NUM_BUCKETS, 0);
+    total_duration = 0;
+    total_jitter = 0;
+    intervals = 0;
+}
+
+void LoopStats::start(double period)
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+    current.period = period;
+    running = false;
+}
+
+void LoopStats::record(double duration)
+{
+    Clock::time_point now = Clock::now();
+    const std::lock_guard<std::mutex> lock(mutex);
+
+    current.iterations++;
+    total_duration += duration;
+    current.max_duration = std::max(current.max_duration, duration);
+    if (duration > current.period) {
+        current.overruns++;
+        current.total_overruns++;
+    }
+
+    size_t bucket = 0;
+    while (bucket < NUM_BUCKETS - 1 &&
+           duration > BUCKET_LIMITS[bucket] * current.period) {
+        bucket++;
+    }
+    current.histogram[bucket]++;
+
+    if (running) {
+        double interval = std::chrono::duration<double>(now - last).count();
+        double jitter = std::abs(interval - current.period);
+        total_jitter += jitter;
+        intervals++;
+        current.max_jitter = std::max(current.max_jitter, jitter);
+    }
+    last = now;
+    running = true;
+}
+
+LoopStats::Summary LoopStats::take()
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+    Summary summary = current;
+    if (summary.iterations > 0) {
+        summary.mean_duration = total_duration / summary.iterations;
+    }
+    if (intervals > 0) {
+        summary.mean_jitter = total_jitter / intervals;
+    }
+    clear();
+    return summary;
+}
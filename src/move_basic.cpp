@@ -30,6 +30,7 @@
  */
 
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <tf/transform_datatypes.h>
 #include <tf2/LinearMath/Transform.h>
 #include <tf2_ros/buffer.h>
@@ -41,98 +42,17 @@
 #include <nav_msgs/Path.h>
 #include <std_msgs/Float32.h>
 #include <std_msgs/Bool.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 #include <move_base_msgs/MoveBaseAction.h>
 
 #include <actionlib/server/simple_action_server.h>
 #include <dynamic_reconfigure/server.h>
-#include "move_basic/collision_checker.h"
-#include "move_basic/queued_action_server.h"
-#include <move_basic/MovebasicConfig.h>
+#include "move_basic/move_basic.h"
 
+#include <cmath>
+#include <fstream>
 #include <string>
 
-typedef actionlib::QueuedActionServer<move_base_msgs::MoveBaseAction> MoveBaseActionServer;
-
-class MoveBasic {
-  private:
-    ros::Subscriber goalSub;
-    ros::Subscriber stopSub;
-
-    ros::Publisher goalPub;
-    ros::Publisher cmdPub;
-    ros::Publisher pathPub;
-    ros::Publisher obstacleDistPub;
-    ros::Publisher errorPub;
-
-    std::unique_ptr<MoveBaseActionServer> actionServer;
-    std::unique_ptr<CollisionChecker> collision_checker;
-    std::unique_ptr<ObstaclePoints> obstacle_points;
-
-    tf2_ros::Buffer tfBuffer;
-    tf2_ros::TransformListener listener;
-
-    double minTurningVelocity;
-    double maxTurningVelocity;
-    double turningAcceleration;
-    double angularTolerance;
-    double maxLateralVelocity;
-
-    double maxLinearVelocity;
-    double minLinearVelocity;
-    double linearAcceleration;
-    double linearTolerance;
-
-    double lateralKp;
-    double lateralKi;
-    double lateralKd;
-
-    double obstacleWaitThreshold;
-    double forwardObstacleThreshold;
-    double minSideDist;
-    double localizationLatency;
-    double runawayTimeoutSecs;
-    bool stop;
-
-    float forwardObstacleDist;
-    float leftObstacleDist;
-    float rightObstacleDist;
-    tf2::Vector3 forwardLeft;
-    tf2::Vector3 forwardRight;
-
-    std::string preferredPlanningFrame;
-    std::string alternatePlanningFrame;
-    std::string preferredDrivingFrame;
-    std::string alternateDrivingFrame;
-    std::string baseFrame;
-
-    dynamic_reconfigure::Server<move_basic::MovebasicConfig> dr_srv;
-
-    void dynamicReconfigCallback(move_basic::MovebasicConfig& config, uint32_t);
-    void stopCallback(const std_msgs::Bool::ConstPtr& msg);
-    void goalCallback(const geometry_msgs::PoseStamped::ConstPtr &msg);
-    void executeAction(const move_base_msgs::MoveBaseGoalConstPtr& goal);
-    void drawLine(double x0, double y0, double x1, double y1);
-    void sendCmd(double angular, double linear);
-    void abortGoal(const std::string msg);
-
-    bool getTransform(const std::string& from, const std::string& to,
-                      tf2::Transform& tf);
-    bool transformPose(const std::string& from, const std::string& to,
-                       const tf2::Transform& in, tf2::Transform& out);
-
-  public:
-    MoveBasic();
-
-    void run();
-
-    bool moveLinear(tf2::Transform& goalInDriving,
-                    const std::string& drivingFrame);
-    bool rotate(double requestedYaw,
-                const std::string& drivingFrame);
-
-    tf2::Transform goalInPlanning;
-};
-
 
 // Radians to degrees
 
@@ -176,104 +96,140 @@ static void getPose(const tf2::Transform& tf, double& x, double& y, double& yaw)
 
 // Constructor
 
-MoveBasic::MoveBasic(): tfBuffer(ros::Duration(3.0)),
-                        listener(tfBuffer)
+MoveBasic::MoveBasic(ros::NodeHandle& nh, ros::NodeHandle& privateNh):
+                        tfBuffer(ros::Duration(3.0)),
+                        listener(tfBuffer),
+                        tfCache(tfBuffer),
+                        runTfCache(tfBuffer),
+                        dr_srv(privateNh)
 {
-    ros::NodeHandle nh("~");
 
     // Velocity parameters
-    nh.param<double>("min_turning_velocity", minTurningVelocity, 0.18);
-    nh.param<double>("max_turning_velocity", maxTurningVelocity, 1.0);
-    nh.param<double>("max_lateral_velocity", maxLateralVelocity, 0.5);
-    nh.param<double>("max_linear_velocity", maxLinearVelocity, 0.5);
-    nh.param<double>("min_linear_velocity", minLinearVelocity, 0.1);
-    nh.param<double>("linear_acceleration", linearAcceleration, 0.1);
-    nh.param<double>("turning_acceleration", turningAcceleration, 0.2);
+    privateNh.param<double>("min_turning_velocity", minTurningVelocity, 0.18);
+    privateNh.param<double>("max_turning_velocity", maxTurningVelocity, 1.0);
+    privateNh.param<double>("max_lateral_velocity", maxLateralVelocity, 0.5);
+    privateNh.param<double>("max_linear_velocity", maxLinearVelocity, 0.5);
+    privateNh.param<double>("min_linear_velocity", minLinearVelocity, 0.1);
+    privateNh.param<double>("linear_acceleration", linearAcceleration, 0.1);
+    privateNh.param<double>("turning_acceleration", turningAcceleration, 0.2);
 
     // Within tolerance, goal is successfully reached
-    nh.param<double>("angular_tolerance", angularTolerance, 0.05);
-    nh.param<double>("linear_tolerance", linearTolerance, 0.05);
+    privateNh.param<double>("angular_tolerance", angularTolerance, 0.05);
+    privateNh.param<double>("linear_tolerance", linearTolerance, 0.05);
 
     // PID parameters for lateral control
-    nh.param<double>("lateral_kp", lateralKp, 0.0);
-    nh.param<double>("lateral_ki", lateralKi, 0.0);
-    nh.param<double>("lateral_kd", lateralKd, 3.0);
+    privateNh.param<double>("lateral_kp", lateralKp, 0.0);
+    privateNh.param<double>("lateral_ki", lateralKi, 0.0);
+    privateNh.param<double>("lateral_kd", lateralKd, 3.0);
 
     // how long to wait after moving to be sure localization is accurate
-    nh.param<double>("localization_latency", localizationLatency, 0.5);
+    privateNh.param<double>("localization_latency", localizationLatency, 0.5);
+
+    // Rates of the obstacle loop in run() and of the motion control loops
+    privateNh.param<double>("obstacle_rate", obstacleRate, 20.0);
+    privateNh.param<double>("idle_obstacle_rate", idleObstacleRate, 2.0);
+    privateNh.param<double>("control_rate", controlRate, 50.0);
+
+    // Trace the latency from the sensors to each velocity command, and
+    // write the trace to a file on shutdown if one is given
+    bool latencyTraceOn;
+    privateNh.param<bool>("latency_trace", latencyTraceOn, false);
+    privateNh.param<std::string>("latency_trace_file", latencyTraceFile, "");
+    latencyTrace.enable(latencyTraceOn);
 
     // how long robot can be driving away from the goal
-    nh.param<double>("runaway_timeout", runawayTimeoutSecs, 1.0);
+    privateNh.param<double>("runaway_timeout", runawayTimeoutSecs, 1.0);
 
     // how long to wait for an obstacle to disappear
-    nh.param<double>("obstacle_wait_threshold", obstacleWaitThreshold, 60.0);
+    privateNh.param<double>("obstacle_wait_threshold", obstacleWaitThreshold, 60.0);
 
     // Minimum distance to maintain in front
-    nh.param<double>("forward_obstacle_threshold", forwardObstacleThreshold, 0.5);
+    privateNh.param<double>("forward_obstacle_threshold", forwardObstacleThreshold, 0.5);
 
     // Minimum distance to maintain at each side
-    nh.param<double>("min_side_dist", minSideDist, 0.3);
+    privateNh.param<double>("min_side_dist", minSideDist, 0.3);
+
+    // Heading error at which to start driving while still turning
+    privateNh.param<double>("blend_heading_cone", blendHeadingCone, 0.0);
 
-    nh.param<std::string>("preferred_planning_frame",
+    // Allow for how far the robot moved since the obstacles were seen
+    privateNh.param<bool>("compensate_sensor_age", compensateSensorAge, true);
+
+    privateNh.param<std::string>("preferred_planning_frame",
                           preferredPlanningFrame, "");
-    nh.param<std::string>("alternate_planning_frame",
+    privateNh.param<std::string>("alternate_planning_frame",
                           alternatePlanningFrame, "odom");
-    nh.param<std::string>("preferred_driving_frame",
+    privateNh.param<std::string>("preferred_driving_frame",
                           preferredDrivingFrame, "map");
-    nh.param<std::string>("alternate_driving_frame",
+    privateNh.param<std::string>("alternate_driving_frame",
                           alternateDrivingFrame, "odom");
-    nh.param<std::string>("base_frame", baseFrame, "base_footprint");
+    privateNh.param<std::string>("base_frame", baseFrame, "base_footprint");
 
     stop = false;
+    running = true;
+    goalActive = false;
 
     dynamic_reconfigure::Server<move_basic::MovebasicConfig>::CallbackType f;
     f = boost::bind(&MoveBasic::dynamicReconfigCallback, this, _1, _2);
     dr_srv.setCallback(f);
 
-    cmdPub = ros::Publisher(nh.advertise<geometry_msgs::Twist>("/cmd_vel", 1));
-    pathPub = ros::Publisher(nh.advertise<nav_msgs::Path>("/plan", 1));
+    cmdPub = ros::Publisher(privateNh.advertise<geometry_msgs::Twist>("/cmd_vel", 1));
+    pathPub = ros::Publisher(privateNh.advertise<nav_msgs::Path>("/plan", 1));
 
     obstacleDistPub =
-        ros::Publisher(nh.advertise<geometry_msgs::Vector3>("/obstacle_distance", 1));
+        ros::Publisher(privateNh.advertise<geometry_msgs::Vector3>("/obstacle_distance", 1));
     errorPub =
-        ros::Publisher(nh.advertise<geometry_msgs::Vector3>("/lateral_error", 1));
-
-    goalSub = nh.subscribe("/move_base_simple/goal", 1,
+        ros::Publisher(privateNh.advertise<geometry_msgs::Vector3>("/lateral_error", 1));
+    localizationWaitPub =
+        ros::Publisher(privateNh.advertise<geometry_msgs::Vector3>("/localization_wait", 1));
+    diagnosticsPub =
+        ros::Publisher(privateNh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1));
+    localizationTimeWaited = 0.0;
+
+    goalSub = privateNh.subscribe("/move_base_simple/goal", 1,
                             &MoveBasic::goalCallback, this);
 
-    stopSub = nh.subscribe("/move_base/stop", 1,
+    stopSub = privateNh.subscribe("/move_base/stop", 1,
                             &MoveBasic::stopCallback, this);
 
-    ros::NodeHandle actionNh("");
-
-    actionServer.reset(new MoveBaseActionServer(actionNh, "move_base",
+    actionServer.reset(new MoveBaseActionServer(nh, "move_base",
 	boost::bind(&MoveBasic::executeAction, this, _1)));
 
+    // Goals beyond the current one are queued and executed in order,
+    // rather than replacing each other
+    int goalQueueDepth;
+    privateNh.param<int>("goal_queue_depth", goalQueueDepth, 1);
+    actionServer->setQueueDepth(std::max(goalQueueDepth, 1));
+
     actionServer->start();
-    goalPub = actionNh.advertise<move_base_msgs::MoveBaseActionGoal>(
+    goalPub = nh.advertise<move_base_msgs::MoveBaseActionGoal>(
       "/move_base/goal", 1);
 
-    obstacle_points.reset(new ObstaclePoints(nh, tfBuffer));
-    collision_checker.reset(new CollisionChecker(nh, tfBuffer, *obstacle_points));
+    int sensorThreads;
+    privateNh.param<int>("sensor_threads", sensorThreads, 1);
+
+    ros::NodeHandle sensorNh(privateNh);
+    sensorNh.setCallbackQueue(&sensorQueue);
+    obstacle_points.reset(new ObstaclePoints(sensorNh, tfBuffer));
+    obstacle_points->set_trace(&latencyTrace);
+    collision_checker.reset(new CollisionChecker(privateNh, tfBuffer, *obstacle_points));
+    obstacle_points->reserve_snapshot(runObstacles);
+    obstacle_points->reserve_snapshot(driveObstacles);
+
+    sensorSpinner.reset(new ros::AsyncSpinner(std::max(sensorThreads, 1), &sensorQueue));
+    sensorSpinner->start();
 
     ROS_INFO("Move Basic ready");
 }
 
 
-// Lookup the specified transform, returns true on success
+// Lookup the specified transform, returns true on success.
+// Repeated lookups within one control tick come from the cache.
 
 bool MoveBasic::getTransform(const std::string& from, const std::string& to,
                              tf2::Transform& tf)
 {
-    try {
-        geometry_msgs::TransformStamped tfs =
-            tfBuffer.lookupTransform(to, from, ros::Time(0));
-        tf2::fromMsg(tfs.transform, tf);
-        return true;
-    }
-    catch (tf2::TransformException &ex) {
-         return false;
-    }
+    return tfCache.lookup(from, to, tf);
 }
 
 // Transform a pose from one frame to another
@@ -289,6 +245,72 @@ bool MoveBasic::transformPose(const std::string& from, const std::string& to,
     return true;
 }
 
+// Wait, for localizationLatency at most, for the planning frame pose to catch up
+
+void MoveBasic::waitForLocalization(const std::string& planningFrame)
+{
+    ros::Time motionEnd = ros::Time::now();
+    ros::Time deadline = motionEnd + ros::Duration(localizationLatency);
+    ros::Time lastStamp;
+    tf2::Transform lastPose;
+    bool havePose = false;
+    ros::Rate r(controlRate);
+
+    while (ros::ok() && running && ros::Time::now() < deadline) {
+        // Bypass tfCache, the stamp of the transform is needed
+        geometry_msgs::TransformStamped tfs;
+        bool found = false;
+        if (tfBuffer.canTransform(planningFrame, baseFrame, ros::Time(0))) {
+            try {
+                tfs = tfBuffer.lookupTransform(planningFrame, baseFrame, ros::Time(0));
+                found = true;
+            }
+            catch (tf2::TransformException &ex) {
+            }
+        }
+
+        if (found) {
+            if (tfs.header.stamp >= motionEnd) {
+                break;
+            }
+            // A new estimate that hardly moved the robot means that
+            // localization has settled
+            if (tfs.header.stamp != lastStamp) {
+                tf2::Transform pose;
+                tf2::fromMsg(tfs.transform, pose);
+                if (havePose) {
+                    tf2::Transform change = lastPose.inverseTimes(pose);
+                    double x, y, yaw;
+                    getPose(change, x, y, yaw);
+                    if (std::hypot(x, y) < linearTolerance / 10 &&
+                        std::abs(yaw) < angularTolerance / 10) {
+                        break;
+                    }
+                }
+                lastPose = pose;
+                lastStamp = tfs.header.stamp;
+                havePose = true;
+            }
+        }
+        r.sleep();
+    }
+
+    ros::Time now = ros::Time::now();
+    double waited = (now - motionEnd).toSec();
+    bool timedOut = (now >= deadline);
+    localizationTimeWaited += waited;
+
+    // x: time waited [s], y: 1 if the wait ran to localizationLatency,
+    // z: total time waited since startup [s]
+    geometry_msgs::Vector3 msg;
+    msg.x = waited;
+    msg.y = timedOut ? 1.0 : 0.0;
+    msg.z = localizationTimeWaited;
+    localizationWaitPub.publish(msg);
+    ROS_DEBUG("MoveBasic: Waited %f s for localization%s", waited,
+              timedOut ? ", timed out" : "");
+}
+
 // Dynamic reconfigure
 
 void MoveBasic::dynamicReconfigCallback(move_basic::MovebasicConfig& config, uint32_t){
@@ -309,6 +331,11 @@ void MoveBasic::dynamicReconfigCallback(move_basic::MovebasicConfig& config, uin
 
     localizationLatency = config.localization_latency;
     runawayTimeoutSecs = config.runaway_timeout;
+    blendHeadingCone = config.blend_heading_cone;
+    obstacleRate = config.obstacle_rate;
+    idleObstacleRate = config.idle_obstacle_rate;
+    controlRate = config.control_rate;
+    latencyTrace.enable(config.latency_trace);
 
     minSideDist = config.min_side_dist;
     obstacleWaitThreshold = config.obstacle_wait_threshold;
@@ -360,10 +387,19 @@ void MoveBasic::executeAction(const move_base_msgs::MoveBaseGoalConstPtr& msg)
       It is assumed that we are dealing with imperfect localization data:
       map->base_link is accurate but may be delayed and is at a slow rate
       odom->base_link is frequent, but drifts, particularly after rotating
-      To counter these issues, we plan in the map frame, and wait localizationLatency
-      after each step, and execute in the odom frame.
+      To counter these issues, we plan in the map frame, and wait up to
+      localizationLatency after each step, and execute in the odom frame.
     */
 
+    // run() checks for obstacles at the full rate until this returns
+    struct ActiveGoal {
+        std::atomic<bool>& active;
+        ~ActiveGoal() { active = false; }
+    } activeGoal = {goalActive};
+    goalActive = true;
+
+    tfCache.new_tick();
+
     tf2::Transform goal;
     tf2::fromMsg(msg->target_pose.pose, goal);
     std::string frameId = msg->target_pose.header.frame_id;
@@ -478,31 +514,51 @@ void MoveBasic::executeAction(const move_base_msgs::MoveBaseGoalConstPtr& msg)
 
     if (dist > linearTolerance) {
 
+        // When blending, driving starts as soon as the heading is within
+        // the cone and moveLinear steers out the rest, so the robot
+        // doesn't stop, or wait for localization, between the phases
+        bool blend = (blendHeadingCone > angularTolerance);
+
         // Initial rotation to face the goal
         double requestedYaw = atan2(linear.y(), linear.x());
         if (std::abs(requestedYaw) > angularTolerance) {
-            if (!rotate(requestedYaw, drivingFrame)) {
+            if (!rotate(requestedYaw, drivingFrame,
+                        blend ? blendHeadingCone : angularTolerance)) {
                 return;
             }
         }
-        sleep(localizationLatency);
+        if (!blend) {
+            waitForLocalization(planningFrame);
+        }
 
         // Do linear portion of the goal
         if (!moveLinear(goalInDriving, drivingFrame)) {
             return;
         }
-        sleep(localizationLatency);
+        if (!blend || !do_final_rotation) {
+            waitForLocalization(planningFrame);
+        }
 
         // Final rotation as specified in goal
         if (do_final_rotation) {
             double finalYaw = goalYaw - (yaw + requestedYaw);
+            if (blend) {
+                // The heading at the end of the leg isn't requestedYaw, so
+                // turn to the goal orientation from the current pose
+                tf2::Transform poseDriving;
+                if (!getTransform(drivingFrame, baseFrame, poseDriving)) {
+                    abortGoal("MoveBasic: Cannot determine robot pose for rotation");
+                    return;
+                }
+                getPose(poseDriving * goalInDriving, x, y, finalYaw);
+            }
             if (std::abs(finalYaw) > angularTolerance) {
-                if (!rotate(finalYaw, drivingFrame)) {
+                if (!rotate(finalYaw, drivingFrame, angularTolerance)) {
                     return;
                 }
             }
 
-            sleep(localizationLatency);
+            waitForLocalization(planningFrame);
         }
     }
 
@@ -523,37 +579,226 @@ void MoveBasic::sendCmd(double angular, double linear)
     msg.linear.x = linear;
 
     cmdPub.publish(msg);
+
+    // The command completes the cycle traced since its snapshot
+    if (traceCycle.time[LatencyTrace::SNAPSHOT] > 0) {
+        traceStage(LatencyTrace::COMMAND);
+        latencyTrace.record_cycle(traceCycle);
+        traceCycle.clear();
+    }
+}
+
+// Note the time of a stage of the command being worked out, if tracing
+
+void MoveBasic::traceStage(LatencyTrace::Stage stage)
+{
+    if (latencyTrace.enabled()) {
+        traceCycle.time[stage] = ros::Time::now().toSec();
+    }
+}
+
+// The stamp of the newest sensor reading in obstacles, zero if there is none
+
+static ros::Time newestStamp(const ObstacleSnapshot& obstacles)
+{
+    ros::Time newest;
+    for (size_t i = 0; i < obstacles.lidar_stamps.size(); i++) {
+        if (obstacles.lidars[i] && obstacles.lidar_stamps[i] > newest) {
+            newest = obstacles.lidar_stamps[i];
+        }
+    }
+    // Remembered lines aren't new readings
+    for (const auto& source : obstacles.line_sources) {
+        if (source.id >= 0 && source.stamp > newest) {
+            newest = source.stamp;
+        }
+    }
+    return newest;
 }
 
 
-// Main loop
+MoveBasic::~MoveBasic()
+{
+    // Stop executing goals before the things they use are destroyed
+    requestShutdown();
+    actionServer->shutdown();
+
+    if (!latencyTraceFile.empty()) {
+        std::ofstream out(latencyTraceFile.c_str());
+        latencyTrace.write_chrome_trace(out);
+        if (!out) {
+            ROS_WARN("MoveBasic: Could not write the latency trace to %s",
+                     latencyTraceFile.c_str());
+        }
+    }
+}
+
+void MoveBasic::requestShutdown()
+{
+    running = false;
+}
+
+
+// Obstacle loop, runs on its own thread at a fixed rate while the
+// callbacks are handled elsewhere
+
+// Add the timing of a loop to a diagnostics message
+
+static void addLoopStatus(diagnostic_msgs::DiagnosticArray& msg,
+                          const std::string& name, const LoopStats::Summary& stats)
+{
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = name;
+    if (stats.overruns > 0) {
+        status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+        status.message = std::to_string(stats.overruns) + " overruns";
+    }
+    else {
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.message = "OK";
+    }
+
+    auto add = [&status](const std::string& key, const std::string& value) {
+        diagnostic_msgs::KeyValue kv;
+        kv.key = key;
+        kv.value = value;
+        status.values.push_back(kv);
+    };
+    add("rate [Hz]", std::to_string(1.0 / stats.period));
+    add("iterations", std::to_string(stats.iterations));
+    add("overruns", std::to_string(stats.overruns));
+    add("total overruns", std::to_string(stats.total_overruns));
+    add("mean duration [ms]", std::to_string(stats.mean_duration * 1000));
+    add("max duration [ms]", std::to_string(stats.max_duration * 1000));
+    add("mean jitter [ms]", std::to_string(stats.mean_jitter * 1000));
+    add("max jitter [ms]", std::to_string(stats.max_jitter * 1000));
+    for (size_t k = 0; k < LoopStats::NUM_BUCKETS; k++) {
+        std::string key;
+        if (k + 1 < LoopStats::NUM_BUCKETS) {
+            key = "duration <= " + std::to_string(std::lround(100 * LoopStats::BUCKET_LIMITS[k]));
+        }
+        else {
+            key = "duration > " + std::to_string(std::lround(100 * LoopStats::BUCKET_LIMITS[k - 1]));
+        }
+        add(key + "% of period", std::to_string(stats.histogram[k]));
+    }
+    msg.status.push_back(status);
+}
+
+// Add the latency percentiles of the traced commands to a diagnostics message
+
+static void addLatencyStatus(diagnostic_msgs::DiagnosticArray& msg,
+                             const LatencyTrace::Summary& summary)
+{
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = "move_basic: latency";
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.message = std::to_string(summary.end_to_end.count) + " commands";
+
+    auto add = [&status](const std::string& name, const LatencyTrace::Percentiles& p) {
+        const std::pair<const char*, double> values[] = {
+            {"p50", p.p50}, {"p90", p.p90}, {"p99", p.p99}, {"max", p.max}};
+        for (const auto& value : values) {
+            diagnostic_msgs::KeyValue kv;
+            kv.key = name + " " + value.first + " [ms]";
+            kv.value = std::to_string(value.second * 1000);
+            status.values.push_back(kv);
+        }
+    };
+    add("sensor to callback", summary.callback);
+    for (int k = 0; k < LatencyTrace::NUM_STAGES - 1; k++) {
+        add(std::string(LatencyTrace::STAGE_NAMES[k]) + " to " +
+            LatencyTrace::STAGE_NAMES[k + 1], summary.interval[k]);
+    }
+    add("sensor to command", summary.end_to_end);
+    msg.status.push_back(status);
+}
+
+// Publish the timing of the loops since the last call on /diagnostics
+
+void MoveBasic::publishLoopStats()
+{
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    addLoopStatus(msg, "move_basic: obstacle loop", obstacleLoopStats.take());
+    addLoopStatus(msg, "move_basic: control loop", controlLoopStats.take());
+    if (latencyTrace.enabled()) {
+        addLatencyStatus(msg, latencyTrace.summarize());
+    }
+    diagnosticsPub.publish(msg);
+}
+
+// The obstacles are only checked on demand: at obstacleRate while a goal
+// is active, and otherwise at idleObstacleRate if anyone is listening.
+// At the full rate a cycle without new sensor data is skipped, unless
+// the last check is an idle period old, so obstacles still age out.
 
 void MoveBasic::run()
 {
-    ros::Rate r(20);
-
-    while (ros::ok()) {
-        ros::spinOnce();
-        collision_checker->min_side_dist = minSideDist;
-        forwardObstacleDist = collision_checker->obstacle_dist(true,
-                                                               leftObstacleDist,
-                                                               rightObstacleDist,
-                                                               forwardLeft,
-                                                               forwardRight);
-        geometry_msgs::Vector3 msg;
-        msg.x = forwardObstacleDist;
-        msg.y = leftObstacleDist;
-        msg.z = rightObstacleDist;
-        obstacleDistPub.publish(msg);
+    double rate = obstacleRate;
+    ros::Rate r(rate);
+    obstacleLoopStats.start(1.0 / rate);
+    ros::Time lastDiagnostics = ros::Time::now();
+    ros::Time lastCheck;
+    uint64_t lastUpdates = 0;
+
+    while (ros::ok() && running) {
+        bool active = goalActive;
+        bool wanted = active || obstacleDistPub.getNumSubscribers() > 0 ||
+                      collision_checker->viz_subscribed();
+        uint64_t updates = obstacle_points->update_count();
+        ros::Time now = ros::Time::now();
+        bool due = updates != lastUpdates || !active ||
+                   now - lastCheck >= ros::Duration(1.0 / idleObstacleRate);
+
+        if (wanted && due) {
+            collision_checker->min_side_dist = minSideDist;
+            runTfCache.new_tick();
+            collision_checker->get_snapshot(runObstacles, &runTfCache);
+            ObstacleDistances dist;
+            dist.forward = collision_checker->obstacle_dist(runObstacles, true,
+                                                            dist.left, dist.right,
+                                                            dist.forwardLeft,
+                                                            dist.forwardRight);
+            {
+                const std::lock_guard<std::mutex> lock(obstacleDistMutex);
+                obstacleDistances = dist;
+            }
+            geometry_msgs::Vector3 msg;
+            msg.x = dist.forward;
+            msg.y = dist.left;
+            msg.z = dist.right;
+            obstacleDistPub.publish(msg);
+            lastCheck = now;
+            lastUpdates = updates;
+        }
+
+        if (now - lastDiagnostics >= ros::Duration(1.0)) {
+            publishLoopStats();
+            lastDiagnostics = now;
+        }
+
+        // Pick up a new rate from dynamic reconfigure, or a goal
+        // starting or ending
+        double wantedRate = active ? obstacleRate : idleObstacleRate;
+        if (wantedRate != rate) {
+            rate = wantedRate;
+            r = ros::Rate(rate);
+            obstacleLoopStats.start(1.0 / rate);
+        }
+
         r.sleep();
+        obstacleLoopStats.record(r.cycleTime().toSec());
     }
 }
 
 
 // Rotate relative to current orientation
 
-bool MoveBasic::rotate(double yaw, const std::string& drivingFrame)
+bool MoveBasic::rotate(double yaw, const std::string& drivingFrame,
+                       double tolerance)
 {
+    tfCache.new_tick();
     tf2::Transform poseDriving;
     if (!getTransform(baseFrame, drivingFrame, poseDriving)) {
          abortGoal("MoveBasic: Cannot determine robot pose for rotation");
@@ -570,11 +815,13 @@ bool MoveBasic::rotate(double yaw, const std::string& drivingFrame)
     double prevAngleRemaining = 0;
 
     bool done = false;
-    ros::Rate r(50);
+    ros::Rate r(controlRate);
+    controlLoopStats.start(1.0 / controlRate);
 
-    while (!done && ros::ok()) {
-        ros::spinOnce();
+    while (!done && ros::ok() && running) {
         r.sleep();
+        controlLoopStats.record(r.cycleTime().toSec());
+        tfCache.new_tick();
 
         double x, y, currentYaw;
         tf2::Transform poseDriving;
@@ -587,7 +834,16 @@ bool MoveBasic::rotate(double yaw, const std::string& drivingFrame)
         double angleRemaining = requestedYaw - currentYaw;
         normalizeAngle(angleRemaining);
 
-        double obstacle = collision_checker->obstacle_angle(angleRemaining > 0);
+        traceCycle.clear();
+        traceStage(LatencyTrace::SNAPSHOT);
+        collision_checker->get_snapshot(driveObstacles, &tfCache);
+        if (latencyTrace.enabled()) {
+            traceCycle.time[LatencyTrace::SENSOR] = newestStamp(driveObstacles).toSec();
+        }
+        traceStage(LatencyTrace::QUERY_START);
+        double obstacle = collision_checker->obstacle_angle(driveObstacles,
+                                                            angleRemaining > 0);
+        traceStage(LatencyTrace::QUERY_END);
         double remaining = std::min(std::abs(angleRemaining), std::abs(obstacle));
         double velocity = std::max(minTurningVelocity,
             std::min(remaining, std::min(maxTurningVelocity,
@@ -605,10 +861,15 @@ bool MoveBasic::rotate(double yaw, const std::string& drivingFrame)
             return false;
         }
 
-        if (std::abs(angleRemaining) < angularTolerance || oscillations > 2) {
+        if (std::abs(angleRemaining) < tolerance || oscillations > 2) {
             ROS_INFO("MoveBasic: Done rotation, error %f degrees", rad2deg(angleRemaining));
-            velocity = 0;
             done = true;
+            if (tolerance > angularTolerance && oscillations <= 2) {
+                // Blending into moveLinear, which takes over the turn
+                // without stopping
+                return true;
+            }
+            velocity = 0;
         }
 
         bool counterwise = (angleRemaining < 0.0);
@@ -619,6 +880,12 @@ bool MoveBasic::rotate(double yaw, const std::string& drivingFrame)
         sendCmd(velocity, 0);
         ROS_DEBUG("Angle remaining: %f, Angular velocity: %f", rad2deg(angleRemaining), velocity);
     }
+
+    if (!done) {
+        // Shutting down, don't leave the robot turning or the goal active
+        sendCmd(0, 0);
+        abortGoal("MoveBasic: Stopping rotation due to shutdown");
+    }
     return done;
 }
 
@@ -627,6 +894,7 @@ bool MoveBasic::rotate(double yaw, const std::string& drivingFrame)
 bool MoveBasic::moveLinear(tf2::Transform& goalInDriving,
                            const std::string& drivingFrame)
 {
+    tfCache.new_tick();
     tf2::Transform poseDriving;
     if (!getTransform(drivingFrame, baseFrame, poseDriving)) {
          abortGoal("MoveBasic: Cannot determine robot pose for linear");
@@ -649,12 +917,18 @@ bool MoveBasic::moveLinear(tf2::Transform& goalInDriving,
     double prevLateralError = 0.0;
     double lateralDiff = 0.0;
 
+    // The velocity last sent, for latency compensation
+    double lastVelocity = 0.0;
+
     bool done = false;
-    ros::Rate r(50);
+    const double controlPeriod = 1.0 / controlRate;
+    ros::Rate r(1.0 / controlPeriod);
+    controlLoopStats.start(controlPeriod);
 
-    while (!done && ros::ok()) {
-        ros::spinOnce();
+    while (!done && ros::ok() && running) {
         r.sleep();
+        controlLoopStats.record(r.cycleTime().toSec());
+        tfCache.new_tick();
 
         if (!getTransform(drivingFrame, baseFrame, poseDriving)) {
              ROS_WARN("MoveBasic: Cannot determine robot pose for linear");
@@ -675,8 +949,23 @@ bool MoveBasic::moveLinear(tf2::Transform& goalInDriving,
         // Clamp rotation
         rotation = std::max(-maxLateralVelocity, std::min(maxLateralVelocity,
                                                           rotation));
+
+        // Turn out the heading error left by a blended rotation
+        double headingError = std::atan2(remaining.y(), remaining.x());
+        if (blendHeadingCone > angularTolerance && distRemaining > linearTolerance &&
+            std::abs(headingError) > angularTolerance) {
+            double turn = std::min(maxTurningVelocity,
+                                   std::sqrt(2.0 * turningAcceleration * std::abs(headingError)));
+            rotation = std::max(-maxTurningVelocity, std::min(maxTurningVelocity,
+                                                              rotation + sign(headingError) * turn));
+        }
+        ObstacleDistances runDist;
+        {
+            const std::lock_guard<std::mutex> lock(obstacleDistMutex);
+            runDist = obstacleDistances;
+        }
         ROS_DEBUG("MoveBasic: %f L %f, R %f %f %f %f %f \n",
-                  forwardObstacleDist, leftObstacleDist, rightObstacleDist,
+                  runDist.forward, runDist.left, runDist.right,
                   remaining.x(), remaining.y(), lateralError,
                   rotation);
 
@@ -687,15 +976,41 @@ bool MoveBasic::moveLinear(tf2::Transform& goalInDriving,
         pid_debug.z = rotation;
         errorPub.publish(pid_debug);
 
-        // Collision Avoidance
-        double obstacleDist = forwardObstacleDist;
-	if (requestedDistance < 0.0) {
-		obstacleDist = collision_checker->obstacle_dist(false,
-                                                        	leftObstacleDist,
-                                                        	rightObstacleDist,
-                                                        	forwardLeft,
-                                                        	forwardRight);
-	}
+        // Collision Avoidance, from a fresh snapshot rather than the
+        // distance run() found up to one of its cycles ago
+        float driveLeft, driveRight;
+        tf2::Vector3 driveFl, driveFr;
+        ros::Time obstacleStamp;
+        traceCycle.clear();
+        traceStage(LatencyTrace::SNAPSHOT);
+        collision_checker->get_snapshot(driveObstacles, &tfCache);
+        if (latencyTrace.enabled()) {
+            traceCycle.time[LatencyTrace::SENSOR] = newestStamp(driveObstacles).toSec();
+        }
+        traceStage(LatencyTrace::QUERY_START);
+        double obstacleDist = collision_checker->obstacle_dist(driveObstacles,
+                                                               requestedDistance >= 0.0,
+                                                               driveLeft, driveRight,
+                                                               driveFl, driveFr,
+                                                               &obstacleStamp);
+        if (compensateSensorAge && !obstacleStamp.isZero()) {
+            // The robot has kept moving since the obstacle was seen, and
+            // will until the next command, so brake for where it will be
+            double age = (ros::Time::now() - obstacleStamp).toSec() + controlPeriod;
+            obstacleDist -= std::abs(lastVelocity) * std::max(age, 0.0);
+        }
+
+        // While turning, the footprint sweeps an arc rather than the
+        // band ahead, so also limit to how far it can go along the arc
+        if (blendHeadingCone > angularTolerance && std::abs(rotation) > 1e-3) {
+            double speed = std::max(std::abs(lastVelocity), minLinearVelocity);
+            double arcAngle = collision_checker->obstacle_arc_angle(driveObstacles,
+                                                                    speed, rotation);
+            if (arcAngle < M_PI) {
+                obstacleDist = std::min(obstacleDist, arcAngle * speed / std::abs(rotation));
+            }
+        }
+        traceStage(LatencyTrace::QUERY_END);
 
         double velocity = std::max(minLinearVelocity,
 		std::min(std::min(std::abs(obstacleDist), std::abs(distRemaining)),
@@ -757,17 +1072,14 @@ bool MoveBasic::moveLinear(tf2::Transform& goalInDriving,
         }
 
         sendCmd(rotation, velocity);
+        lastVelocity = velocity;
         ROS_DEBUG("Distance remaining: %f, Linear velocity: %f", distRemaining, velocity);
     }
 
+    if (!done) {
+        // Shutting down, don't leave the robot driving or the goal active
+        sendCmd(0, 0);
+        abortGoal("MoveBasic: Stopping move due to shutdown");
+    }
     return done;
 }
-
-
-int main(int argc, char ** argv) {
-    ros::init(argc, argv, "move_basic");
-    MoveBasic mb_node;
-    mb_node.run();
-
-    return 0;
-}
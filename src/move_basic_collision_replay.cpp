@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+/*
+ * Replays the velocity commands of a recorded bag through the obstacle
+ * and collision checking, for offline regression runs of the checks and
+ * their performance.  The MoveBasic control loop isn't run, the
+ * commands are the recorded ones and the goals are only logged, so
+ * this can't show changes to how the robot drives.
+ *
+ * The scans, sonars and transforms in the bag are fed straight into
+ * ObstaclePoints and the tf buffer in the order they were recorded, with
+ * ros::Time following the bag time.  Each recorded velocity command is
+ * then checked the way the drive loop does it: a snapshot of the
+ * obstacles, the distance in the direction of travel, and the angles
+ * that the robot can turn in place and along its arc.  Nothing waits
+ * for the clock, so a run takes as long as the checks themselves.
+ *
+ * The commands and the results of their checks are written as CSV, with
+ * the goals as comment lines, for diffing between runs.  The time taken
+ * by each stage and the heap allocations it made are printed at the end.
+ *
+ * Without a ROS master the default parameters are used.  With one they
+ * are read from the namespace given by --ns, by default the node's own.
+ */
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include <move_basic/collision_checker.h>
+#include <move_basic/obstacle_points.h>
+#include <move_basic/RangeArray.h>
+#include <geometry_msgs/Twist.h>
+#include <move_base_msgs/MoveBaseActionGoal.h>
+#include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/Range.h>
+#include <tf2/utils.h>
+#include <tf2_msgs/TFMessage.h>
+#include <tf2_ros/buffer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// Count every heap allocation, so that each stage can report how many
+// it made
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+// Wall clock durations and allocations of one stage
+class Stage
+{
+public:
+    explicit Stage(const char* name) : name(name), allocs(0) {}
+
+    // Time f() as one call of the stage
+    template <typename F>
+    void run(F f)
+    {
+        size_t allocs_before = allocations.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        durations.push_back(std::chrono::duration<double>(end - start).count());
+        allocs += allocations.load(std::memory_order_relaxed) - allocs_before;
+    }
+
+    void print(FILE* out)
+    {
+        if (durations.empty()) {
+            return;
+        }
+        std::sort(durations.begin(), durations.end());
+        const auto percentile = [&](double p) {
+            return 1e6 * durations[std::min(durations.size() - 1,
+                                            size_t(p * durations.size()))];
+        };
+        fprintf(out, "%-20s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+                durations.size(), percentile(0.5), percentile(0.9),
+                percentile(0.99), 1e6 * durations.back(),
+                double(allocs) / durations.size());
+    }
+
+private:
+    const char* name;
+    std::vector<double> durations;
+    size_t allocs;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: move_basic_collision_replay BAG [--out=FILE] [--cmd_topic=TOPIC] [--ns=NAMESPACE]\n"
+            "\n"
+            "Writes each velocity command on TOPIC (default /cmd_vel) in the bag, with\n"
+            "the obstacle checks for it, to FILE (default stdout) as CSV.\n");
+}
+
+int main(int argc, char** argv)
+{
+    ros::init(argc, argv, "move_basic_collision_replay",
+              ros::init_options::AnonymousName | ros::init_options::NoSigintHandler);
+
+    std::string bag_path, out_path, cmd_topic = "/cmd_vel", ns = "~";
+    for (int i = 1; i < argc; i++) {
+        if (std::strncmp(argv[i], "--out=", 6) == 0) {
+            out_path = argv[i] + 6;
+        }
+        else if (std::strncmp(argv[i], "--cmd_topic=", 12) == 0) {
+            cmd_topic = argv[i] + 12;
+        }
+        else if (std::strncmp(argv[i], "--ns=", 5) == 0) {
+            ns = argv[i] + 5;
+        }
+        else if (argv[i][0] != '-' && bag_path.empty()) {
+            bag_path = argv[i];
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (bag_path.empty()) {
+        usage();
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (!out_path.empty()) {
+        out = fopen(out_path.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "Could not write %s\n", out_path.c_str());
+            return 1;
+        }
+    }
+
+    rosbag::Bag bag;
+    try {
+        bag.open(bag_path, rosbag::bagmode::Read);
+    }
+    catch (const rosbag::BagException& e) {
+        fprintf(stderr, "Could not read %s: %s\n", bag_path.c_str(), e.what());
+        return 1;
+    }
+
+    // The subscriptions made with a node handle are never called back,
+    // everything comes from the bag
+    std::unique_ptr<ros::NodeHandle> nh;
+    ros::CallbackQueue unused;
+    if (ros::master::check()) {
+        nh.reset(new ros::NodeHandle(ns));
+        nh->setCallbackQueue(&unused);
+    }
+    else {
+        ros::Time::init();
+    }
+
+    tf2_ros::Buffer tf_buffer(ros::Duration(3600));
+    std::unique_ptr<ObstaclePoints> obstacle_points(nh ?
+        new ObstaclePoints(*nh, tf_buffer) : new ObstaclePoints(tf_buffer));
+    std::unique_ptr<CollisionChecker> collision_checker(nh ?
+        new CollisionChecker(*nh, tf_buffer, *obstacle_points) :
+        new CollisionChecker(tf_buffer, *obstacle_points));
+
+    Stage scans("scan_callback"), sonars("range_callback"), arrays("range_array_callback");
+    Stage snapshots("get_snapshot"), dists("obstacle_dist"), angles("obstacle_angle"),
+          arcs("obstacle_arc_angle");
+    ObstacleSnapshot snapshot;
+
+    fprintf(out, "time,linear,angular,forward_dist,left_dist,right_dist,"
+                 "turn_angle,arc_angle\n");
+
+    rosbag::View view(bag);
+    ros::Time first, last;
+    size_t messages = 0;
+    auto wall_start = std::chrono::steady_clock::now();
+    for (const rosbag::MessageInstance& m : view) {
+        const ros::Time now = m.getTime();
+        if (first.isZero()) {
+            first = now;
+        }
+        last = now;
+        ros::Time::setNow(now);
+        messages++;
+
+        if (auto tf = m.instantiate<tf2_msgs::TFMessage>()) {
+            const bool is_static = m.getTopic() == "/tf_static";
+            for (const auto& transform : tf->transforms) {
+                tf_buffer.setTransform(transform, "replay", is_static);
+            }
+            // As the live node does, so the sensors below a moved frame
+            // are looked up again
+            if (is_static) {
+                obstacle_points->tf_static_callback(tf);
+            }
+        }
+        else if (auto scan = m.instantiate<sensor_msgs::LaserScan>()) {
+            scans.run([&] { obstacle_points->scan_callback(scan); });
+        }
+        else if (auto range = m.instantiate<sensor_msgs::Range>()) {
+            sonars.run([&] { obstacle_points->range_callback(range); });
+        }
+        else if (auto ranges = m.instantiate<move_basic::RangeArray>()) {
+            arrays.run([&] { obstacle_points->range_array_callback(ranges); });
+        }
+        else if (auto action_goal = m.instantiate<move_base_msgs::MoveBaseActionGoal>()) {
+            // Including those from /move_base_simple/goal, which are
+            // republished as actions
+            const auto& pose = action_goal->goal.target_pose;
+            fprintf(out, "# goal %.4f %s %.4f %.4f %.4f\n", now.toSec(),
+                    pose.header.frame_id.c_str(), pose.pose.position.x,
+                    pose.pose.position.y, tf2::getYaw(pose.pose.orientation));
+        }
+        else if (m.getTopic() == cmd_topic) {
+            auto cmd = m.instantiate<geometry_msgs::Twist>();
+            if (!cmd) {
+                continue;
+            }
+            // The checks of a drive loop cycle commanding this velocity
+            const double linear = cmd->linear.x;
+            const double angular = cmd->angular.z;
+            float dist, left, right, angle, arc;
+            tf2::Vector3 fl, fr;
+            snapshots.run([&] { collision_checker->get_snapshot(snapshot); });
+            dists.run([&] {
+                dist = collision_checker->obstacle_dist(snapshot, linear >= 0,
+                                                        left, right, fl, fr);
+            });
+            angles.run([&] {
+                angle = collision_checker->obstacle_angle(snapshot, angular >= 0);
+            });
+            arcs.run([&] {
+                arc = collision_checker->obstacle_arc_angle(snapshot, linear, angular);
+            });
+            fprintf(out, "%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n", now.toSec(),
+                    linear, angular, dist, left, right, angle, arc);
+        }
+    }
+    double wall = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - wall_start).count();
+    bag.close();
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    double recorded = (last - first).toSec();
+    fprintf(stderr, "%zu messages, %.1f s recorded, replayed in %.3f s (%.0fx)\n\n",
+            messages, recorded, wall, wall > 0 ? recorded / wall : 0.0);
+    fprintf(stderr, "%-20s %8s %10s %10s %10s %10s %10s\n", "stage", "calls",
+            "p50 [us]", "p90 [us]", "p99 [us]", "max [us]", "allocs");
+    for (Stage* stage : {&scans, &sonars, &arrays, &snapshots, &dists, &angles, &arcs}) {
+        stage->print(stderr);
+    }
+    return 0;
+}
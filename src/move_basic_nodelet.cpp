@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include "move_basic/move_basic.h"
+
+#include <memory>
+#include <thread>
+
+namespace move_basic {
+
+// Runs MoveBasic inside a nodelet manager, so that scans from driver and
+// filter nodelets in the same manager are passed as shared pointers
+// rather than serialized
+class MoveBasicNodelet : public nodelet::Nodelet
+{
+    std::unique_ptr<MoveBasic> move_basic;
+    std::thread run_thread;
+
+public:
+    ~MoveBasicNodelet()
+    {
+        if (move_basic) {
+            move_basic->requestShutdown();
+            run_thread.join();
+        }
+    }
+
+    virtual void onInit()
+    {
+        // The manager's threads handle our callbacks, except for the
+        // sensors which have their own
+        move_basic.reset(new MoveBasic(getNodeHandle(), getPrivateNodeHandle()));
+        run_thread = std::thread(&MoveBasic::run, move_basic.get());
+    }
+};
+
+}  // namespace move_basic
+
+PLUGINLIB_EXPORT_CLASS(move_basic::MoveBasicNodelet, nodelet::Nodelet)
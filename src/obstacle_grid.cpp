@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include "move_basic/obstacle_grid.h"
+
+#include <algorithm>
+#include <cmath>
+
+// std::min takes it by reference, so it needs a definition
+const int ObstacleGrid::MAX_CELLS;
+
+void ObstacleGrid::reset(float resolution, int cells)
+{
+    cells = std::min(std::max(cells, 64), MAX_CELLS);
+    this->resolution = resolution;
+    this->words_per_row = (cells + 63) / 64;
+    this->cells = words_per_row * 64;
+    // assign() keeps the buffer, so a snapshot reset every control
+    // cycle does not allocate
+    bits.assign(this->cells * words_per_row, 0);
+}
+
+void ObstacleGrid::clear()
+{
+    std::fill(bits.begin(), bits.end(), 0);
+}
+
+int ObstacleGrid::index_of(float v) const
+{
+    // Clamped while still a float, converting NaN, inf or anything out
+    // of the range of int is undefined
+    float i = std::floor(v / resolution) + cells / 2;
+    if (!(i >= 0)) {
+        return -1;
+    }
+    if (i >= cells) {
+        return cells;
+    }
+    return static_cast<int>(i);
+}
+
+void ObstacleGrid::row_range(float lo, float hi, int& first, int& last) const
+{
+    first = std::max(index_of(lo), 0);
+    last = std::min(index_of(hi), cells - 1);
+}
+
+void ObstacleGrid::mark(float x, float y)
+{
+    int col = index_of(x);
+    int row = index_of(y);
+    if (col < 0 || col >= cells || row < 0 || row >= cells) {
+        return;
+    }
+    bits[row * words_per_row + col / 64] |= uint64_t(1) << (col % 64);
+}
+
+void ObstacleGrid::mark_line(float x0, float y0, float x1, float y1)
+{
+    // Sample at half a cell, which is enough to not step over a cell
+    // the segment crosses by more than a corner.  The samples are
+    // capped so that a bogus reading can't stall the snapshot.
+    float len = std::hypot(x1 - x0, y1 - y0);
+    if (!std::isfinite(len)) {
+        return;
+    }
+    float steps = std::ceil(2 * len / resolution);
+    int n = (steps < 4 * cells) ? static_cast<int>(steps) : 4 * cells;
+    if (n == 0) {
+        mark(x0, y0);
+        return;
+    }
+    for (int i = 0; i <= n; i++) {
+        float a = static_cast<float>(i) / n;
+        mark(x0 + a * (x1 - x0), y0 + a * (y1 - y0));
+    }
+}
+
+bool ObstacleGrid::occupied(int col, int row) const
+{
+    if (col < 0 || col >= cells || row < 0 || row >= cells) {
+        return false;
+    }
+    return bits[row * words_per_row + col / 64] & (uint64_t(1) << (col % 64));
+}
+
+// Bits first to last of a row, inclusive
+static void range_mask(int first, int last, uint64_t* mask, int words)
+{
+    for (int w = 0; w < words; w++) {
+        int lo = std::max(first - w * 64, 0);
+        int hi = std::min(last - w * 64, 63);
+        if (lo > hi) {
+            mask[w] = 0;
+        }
+        else {
+            uint64_t upper = (hi == 63) ? ~uint64_t(0) : (uint64_t(1) << (hi + 1)) - 1;
+            mask[w] = upper & ~((uint64_t(1) << lo) - 1);
+        }
+    }
+}
+
+void ObstacleGrid::footprint_dist(const FootprintBand& band,
+                                  FootprintDistances& dist) const
+{
+    if (!enabled()) {
+        return;
+    }
+    uint64_t row_bits[MAX_CELLS / 64];
+    uint64_t mask[MAX_CELLS / 64];
+    int first, last;
+
+    // Forward and back: the rows in the width, ORed into one
+    row_range(-band.width, band.width, first, last);
+    std::fill(row_bits, row_bits + words_per_row, 0);
+    for (int row = first; row <= last; row++) {
+        const uint64_t* words = &bits[row * words_per_row];
+        for (int w = 0; w < words_per_row; w++) {
+            row_bits[w] |= words[w];
+        }
+    }
+
+    // First occupied cell reaching past the front
+    int col = std::max(index_of(band.front_length), 0);
+    range_mask(col, cells - 1, mask, words_per_row);
+    for (int w = 0; w < words_per_row; w++) {
+        uint64_t word = row_bits[w] & mask[w];
+        if (word) {
+            float x = std::max(cell_min(w * 64 + __builtin_ctzll(word)), band.front_length);
+            dist.forward = std::min(dist.forward, x);
+            break;
+        }
+    }
+
+    // Last occupied cell reaching past the back
+    col = std::min(index_of(-band.back_length), cells - 1);
+    if (col >= 0 && cell_min(col) >= -band.back_length) {
+        col--;
+    }
+    range_mask(0, col, mask, words_per_row);
+    for (int w = words_per_row - 1; w >= 0; w--) {
+        uint64_t word = row_bits[w] & mask[w];
+        if (word) {
+            int c = w * 64 + 63 - __builtin_clzll(word);
+            float x = std::max(-(cell_min(c) + resolution), band.back_length);
+            dist.back = std::min(dist.back, x);
+            break;
+        }
+    }
+
+    // Sides: the first row out from base_frame with a cell in the length
+    row_range(-band.back_length, band.front_length, first, last);
+    range_mask(first, last, mask, words_per_row);
+    auto row_hit = [&](int row) {
+        const uint64_t* words = &bits[row * words_per_row];
+        for (int w = 0; w < words_per_row; w++) {
+            if (words[w] & mask[w]) {
+                return true;
+            }
+        }
+        return false;
+    };
+    // Rows are aligned on y = 0, so cells/2 is the first one to the left
+    for (int row = cells / 2; row < cells && cell_min(row) < dist.left; row++) {
+        if (row_hit(row)) {
+            dist.left = cell_min(row);
+            break;
+        }
+    }
+    for (int row = cells / 2 - 1; row >= 0 && -(cell_min(row) + resolution) < dist.right; row--) {
+        if (row_hit(row)) {
+            dist.right = -(cell_min(row) + resolution);
+            break;
+        }
+    }
+}
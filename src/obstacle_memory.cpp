@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include "move_basic/obstacle_memory.h"
+
+#include <algorithm>
+#include <cmath>
+
+ObstacleMemory::ObstacleMemory()
+{
+    reset(0.0, 0);
+}
+
+void ObstacleMemory::reset(double duration, size_t capacity)
+{
+    this->duration = std::max(duration, 0.0);
+    bucket_duration = this->duration / NUM_BUCKETS;
+    bucket_capacity = enabled() ? capacity / NUM_BUCKETS : 0;
+    segments.assign(NUM_BUCKETS * bucket_capacity, Segment());
+    std::fill(counts, counts + NUM_BUCKETS, 0);
+    head = 0;
+    head_index = 0;
+    started = false;
+    dropped_count = 0;
+}
+
+// The buckets are aligned to whole periods, so that the ages don't
+// drift however long it runs
+
+int64_t ObstacleMemory::index_of(double stamp) const
+{
+    return static_cast<int64_t>(std::floor(stamp / bucket_duration));
+}
+
+void ObstacleMemory::expire(double now)
+{
+    if (!enabled()) {
+        return;
+    }
+    int64_t index = index_of(now);
+    if (!started) {
+        head_index = index;
+        started = true;
+        return;
+    }
+    if (index <= head_index) {
+        return;
+    }
+
+    // Each bucket that has ended makes way for a new one, the oldest
+    int64_t clear = std::min<int64_t>(index - head_index, NUM_BUCKETS);
+    for (int64_t k = 0; k < clear; k++) {
+        head = (head + 1) % NUM_BUCKETS;
+        counts[head] = 0;
+    }
+    head_index = index;
+}
+
+bool ObstacleMemory::add(const Segment& segment, double stamp)
+{
+    if (!enabled()) {
+        return false;
+    }
+    expire(stamp);
+
+    // A segment that arrived late goes in the bucket for its age
+    int64_t back = head_index - index_of(stamp);
+    if (back >= static_cast<int64_t>(NUM_BUCKETS)) {
+        dropped_count++;
+        return false;
+    }
+    size_t bucket = (head + NUM_BUCKETS - std::max<int64_t>(back, 0)) % NUM_BUCKETS;
+
+    if (counts[bucket] >= bucket_capacity) {
+        dropped_count++;
+        return false;
+    }
+    segments[bucket * bucket_capacity + counts[bucket]++] = segment;
+    return true;
+}
+
+size_t ObstacleMemory::size() const
+{
+    size_t n = 0;
+    for (size_t k = 0; k < NUM_BUCKETS; k++) {
+        n += counts[k];
+    }
+    return n;
+}
@@ -30,215 +30,776 @@
  */
 
 #include "move_basic/obstacle_points.h"
+#include "move_basic/params.h"
 #include <sensor_msgs/Range.h>
 
-ObstaclePoints::ObstaclePoints(ros::NodeHandle& nh, tf2_ros::Buffer& tf_buffer) : tf_buffer(tf_buffer) {
-    sonar_sub = nh.subscribe("/sonars", 1,
-        &ObstaclePoints::range_callback, this);
-    scan_sub = nh.subscribe("/scan", 1,
-        &ObstaclePoints::scan_callback, this);
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+// Embedded builds size the buffers for a typical robot at startup, so
+// that nothing is allocated once it is running
+#ifdef MOVE_BASIC_EMBEDDED
+static const int DEFAULT_MAX_LIDARS = 2;
+static const int DEFAULT_MAX_SCAN_BEAMS = 2048;
+static const int DEFAULT_MAX_SONARS = 16;
+#else
+static const int DEFAULT_MAX_LIDARS = 0;
+static const int DEFAULT_MAX_SCAN_BEAMS = 0;
+static const int DEFAULT_MAX_SONARS = 0;
+#endif
 
-    nh.param<std::string>("base_frame", baseFrame, "base_link");
+static tf2::Transform to_transform(const geometry_msgs::TransformStamped& msg)
+{
+    tf2::Transform tf;
+    tf2::fromMsg(msg.transform, tf);
+    return tf;
 }
 
-void ObstaclePoints::range_callback(const sensor_msgs::Range::ConstPtr &msg) {
-    std::string frame = msg->header.frame_id;
-    ROS_DEBUG("Callback %s %f", frame.c_str(), msg->range);
+ObstaclePoints::ObstaclePoints(ros::NodeHandle& nh, tf2_ros::Buffer& tf_buffer) :
+    lidar_table(new std::vector<const LidarSensor*>()), tf_buffer(tf_buffer) {
+    init(&nh);
+}
 
-    const std::lock_guard<std::mutex> lock(points_mutex);
+ObstaclePoints::ObstaclePoints(tf2_ros::Buffer& tf_buffer) :
+    lidar_table(new std::vector<const LidarSensor*>()), tf_buffer(tf_buffer) {
+    init(NULL);
+}
+
+void ObstaclePoints::init(ros::NodeHandle* nh) {
+    trace = NULL;
+    updates = 0;
+    max_lidars = max_scan_beams = max_sonars = 0;
+    baseFrame = param_or_default<std::string>(nh, "base_frame", "base_link");
+
+    // The collision checks can work from the points themselves or from
+    // an occupancy grid of them
+    std::string backend =
+        param_or_default<std::string>(nh, "collision_backend", "points");
+    use_grid = (backend == "grid");
+    if (!use_grid && backend != "points") {
+        ROS_WARN("Unknown collision_backend %s, using points", backend.c_str());
+    }
+    grid_resolution = param_or_default<float>(nh, "grid_resolution", 0.05);
+    grid_cells = param_or_default<int>(nh, "grid_cells", 128);
+
+    // Recent sonar echoes are remembered where they were seen, so that
+    // an obstacle a sonar misses on one ping is still there
+    memory.reset(param_or_default<double>(nh, "obstacle_memory", 0.0),
+                 param_or_default<int>(nh, "obstacle_memory_size", 1024));
+    odom_frame = param_or_default<std::string>(nh, "odom_frame", "odom");
+
+    // Each lidar has a fixed number of scan buffers, enough for every
+    // snapshot that may hold one of its scans
+    int buffers = param_or_default<int>(nh, "scan_buffers",
+                                        LidarSensor::DEFAULT_SCAN_BUFFERS);
+    scan_buffers = std::max<size_t>(std::max(buffers, 0), LidarSensor::MIN_SCAN_BUFFERS);
+    if (scan_buffers != static_cast<size_t>(buffers)) {
+        ROS_WARN("scan_buffers must be at least %zu, using %zu",
+                 LidarSensor::MIN_SCAN_BUFFERS, scan_buffers);
+    }
+
+    // The buffers can be sized for the sensors up front, rather than
+    // growing as they are seen
+    reserve(std::max(param_or_default<int>(nh, "max_lidars", DEFAULT_MAX_LIDARS), 0),
+            std::max(param_or_default<int>(nh, "max_scan_beams", DEFAULT_MAX_SCAN_BEAMS), 0),
+            std::max(param_or_default<int>(nh, "max_sonars", DEFAULT_MAX_SONARS), 0));
+
+    // Beams that can't matter are dropped as the scans come in.  The
+    // angular windows are set per lidar frame.
+    default_roi.max_range = param_or_default<float>(nh, "scan_max_range", 0.0);
+    default_roi.decimation_range =
+        param_or_default<float>(nh, "scan_decimation_range", 0.0);
+    typedef std::map<std::string, double> FrameAngles;
+    FrameAngles min_angles = param_or_default<FrameAngles>(nh, "scan_min_angles", FrameAngles());
+    FrameAngles max_angles = param_or_default<FrameAngles>(nh, "scan_max_angles", FrameAngles());
+    for (const auto& kv : min_angles) {
+        lidar_rois.insert(std::make_pair(kv.first, default_roi)).first->second.min_angle = kv.second;
+    }
+    for (const auto& kv : max_angles) {
+        lidar_rois.insert(std::make_pair(kv.first, default_roi)).first->second.max_angle = kv.second;
+    }
+
+    // Without a node handle the callbacks are called directly
+    if (!nh) {
+        return;
+    }
+
+    // Each lidar is identified by the frame of its scans, so they can
+    // share a topic or have one each
+    std::vector<std::string> scan_topics;
+    nh->param<std::vector<std::string>>("scan_topics", scan_topics,
+                                        std::vector<std::string>{"/scan"});
+
+    // Boards that read a whole ring of sonars at once can publish the
+    // readings together, which are then handled as one batch
+    std::vector<std::string> sonar_array_topics;
+    nh->param<std::vector<std::string>>("sonar_array_topics", sonar_array_topics,
+                                        std::vector<std::string>{"/sonar_array"});
+
+    // All the sonars share a topic, and lidars may, so the queues hold
+    // more than one message to avoid dropping one sensor for another
+    sonar_sub = nh->subscribe("/sonars", 10,
+        &ObstaclePoints::range_callback, this);
+    for (const auto& topic : sonar_array_topics) {
+        sonar_array_subs.push_back(nh->subscribe(topic, 10,
+            &ObstaclePoints::range_array_callback, this));
+    }
+    for (const auto& topic : scan_topics) {
+        scan_subs.push_back(nh->subscribe(topic, 2,
+            &ObstaclePoints::scan_callback, this));
+    }
+    tf_static_sub = nh->subscribe("/tf_static", 10,
+        &ObstaclePoints::tf_static_callback, this);
+}
 
-    // create sensor object if this is a new sensor
-    std::map<std::string,RangeSensor>::iterator it = sensors.find(frame);
-    if (it == sensors.end()) {
+bool ObstaclePoints::lookup_sensor_tf(const std::string& frame,
+                                      geometry_msgs::TransformStamped& tf)
+{
+    // Checking first avoids the cost of an exception while the sensor
+    // frame is not yet known
+    std::string error;
+    if (!tf_buffer.canTransform(baseFrame, frame, ros::Time(0), &error)) {
+        ROS_WARN_THROTTLE(1.0, "%s", error.c_str());
+        return false;
+    }
+    try {
+        tf = tf_buffer.lookupTransform(baseFrame, frame, ros::Time(0));
+        return true;
+    }
+    catch (tf2::TransformException &ex) {
+        ROS_WARN("%s", ex.what());
+        return false;
+    }
+}
+
+bool ObstaclePoints::lookup_base_to_odom(const ros::Time& stamp,
+                                         tf2::Transform& base_to_odom)
+{
+    // The robot may have moved since the reading was taken, so it goes
+    // in where the robot was then
+    geometry_msgs::TransformStamped odom_to_base;
+    bool found = false;
+    if (tf_buffer.canTransform(baseFrame, odom_frame, stamp)) {
         try {
-	    ROS_INFO("lookup %s %s", baseFrame.c_str(), frame.c_str());
-            geometry_msgs::TransformStamped sensor_to_base_tf =
-                tf_buffer.lookupTransform(baseFrame, frame, ros::Time(0));
-
-            tf2::Transform tf;
-            tf2::Vector3 origin, left_vector, right_vector;
-
-            // sensor origin
-            geometry_msgs::PointStamped sensor_origin;
-            sensor_origin.point.x = 0;
-            sensor_origin.point.y = 0;
-            sensor_origin.point.z = 0;
-            geometry_msgs::PointStamped base_origin;
-            tf2::doTransform(sensor_origin, base_origin, sensor_to_base_tf);
-            fromMsg(base_origin.point, origin);
-            ROS_INFO("Obstacle: origin %f %f %f", origin.x(), origin.y(), origin.z());
-
-            // vectors at the edges of cone when cone height is 1m
-            double theta = msg->field_of_view / 2.0;
-            float x = std::cos(theta);
-            float y = std::sin(theta);
-
-            geometry_msgs::Vector3Stamped sensor_left;
-            sensor_left.vector.x = x;
-            sensor_left.vector.y = -y;
-            sensor_left.vector.z = 0.0;
-            geometry_msgs::Vector3Stamped base_left;
-            tf2::doTransform(sensor_left, base_left, sensor_to_base_tf);
-            fromMsg(base_left.vector, left_vector);
-
-            geometry_msgs::Vector3Stamped sensor_right;
-            sensor_right.vector.x = x;
-            sensor_right.vector.y = y;
-            sensor_right.vector.z = 0.0;
-            geometry_msgs::Vector3Stamped base_right;
-            tf2::doTransform(sensor_right, base_right, sensor_to_base_tf);
-            fromMsg(base_right.vector, right_vector);
-
-            RangeSensor sensor(sensors.size(), frame, origin,
-                               left_vector, right_vector);
-            sensor.update(msg->range, msg->header.stamp);
-            sensors[frame] = sensor;
+            odom_to_base = tf_buffer.lookupTransform(baseFrame, odom_frame, stamp);
+            found = true;
         }
         catch (tf2::TransformException &ex) {
-            ROS_WARN("%s", ex.what());
         }
     }
-    else {
-        RangeSensor& sensor = it->second;
-        sensor.update(msg->range, msg->header.stamp);
+    if (!found && !lookup_sensor_tf(odom_frame, odom_to_base)) {
+        return false;
     }
+    base_to_odom = to_transform(odom_to_base).inverse();
+    return true;
 }
 
-void ObstaclePoints::scan_callback(const sensor_msgs::LaserScan::ConstPtr &msg)
+bool ObstaclePoints::moved_by(const std::string& frame,
+                              const std::set<std::string>& changed) const
+{
+    std::string child = frame;
+    // the depth is bounded in case the tree has a loop in it
+    for (int depth = 0; depth < 32 && child != baseFrame; depth++) {
+        if (changed.count(child)) {
+            return true;
+        }
+        std::string parent;
+        if (!tf_buffer._getParent(child, ros::Time(0), parent)) {
+            break;
+        }
+        child = parent;
+    }
+    return false;
+}
+
+static bool same_transform(const geometry_msgs::Transform& a,
+                           const geometry_msgs::Transform& b)
 {
-    float theta = msg->angle_min;
-    float increment = msg->angle_increment;
-    size_t array_size = (msg->ranges).size();
+    const double eps = 1e-9;
+    return std::abs(a.translation.x - b.translation.x) < eps &&
+           std::abs(a.translation.y - b.translation.y) < eps &&
+           std::abs(a.translation.z - b.translation.z) < eps &&
+           std::abs(a.rotation.x - b.rotation.x) < eps &&
+           std::abs(a.rotation.y - b.rotation.y) < eps &&
+           std::abs(a.rotation.z - b.rotation.z) < eps &&
+           std::abs(a.rotation.w - b.rotation.w) < eps;
+}
 
+bool ObstaclePoints::static_tf_arrived(const std::string& frame)
+{
+    const std::lock_guard<std::mutex> lock(static_mutex);
+    std::string child = frame;
+    for (int depth = 0; depth < 32 && child != baseFrame; depth++) {
+        std::map<std::string, geometry_msgs::TransformStamped>::const_iterator it =
+            static_transforms.find(child);
+        if (it != static_transforms.end()) {
+            // The buffer has it once it returns a transform at least as
+            // new, or with the same value
+            const geometry_msgs::TransformStamped& expected = it->second;
+            const std::string& parent = expected.header.frame_id;
+            if (!tf_buffer.canTransform(parent, child, ros::Time(0))) {
+                return false;
+            }
+            try {
+                geometry_msgs::TransformStamped tf =
+                    tf_buffer.lookupTransform(parent, child, ros::Time(0));
+                bool newer = !expected.header.stamp.isZero() &&
+                             tf.header.stamp >= expected.header.stamp;
+                if (!newer && !same_transform(tf.transform, expected.transform)) {
+                    return false;
+                }
+            }
+            catch (tf2::TransformException &ex) {
+                return false;
+            }
+        }
+        std::string parent;
+        if (!tf_buffer._getParent(child, ros::Time(0), parent)) {
+            break;
+        }
+        child = parent;
+    }
+    return true;
+}
+
+void ObstaclePoints::tf_static_callback(const tf2_msgs::TFMessage::ConstPtr& msg)
+{
+    // Only the sensors at or below the frames in the message can have
+    // moved, latched publishers of other frames leave them alone
+    std::set<std::string> changed;
+    {
+        const std::lock_guard<std::mutex> lock(static_mutex);
+        for (const auto& tf : msg->transforms) {
+            changed.insert(tf.child_frame_id);
+            static_transforms[tf.child_frame_id] = tf;
+        }
+    }
+    {
+        const std::lock_guard<std::mutex> lock(lidars_mutex);
+        for (const auto& kv : lidars) {
+            if (moved_by(kv.first, changed)) {
+                stale_lidars.insert(kv.first);
+            }
+        }
+    }
     const std::lock_guard<std::mutex> lock(points_mutex);
-    lidar_stamp = msg->header.stamp;
+    for (const RangeSensor& sensor : sonars) {
+        if (moved_by(sensor.frame_id, changed)) {
+            stale_sonars[sensor.id] = true;
+        }
+    }
+}
 
-    if (!have_lidar) {
-        try {
-            std::string laserFrame = msg->header.frame_id;
-            geometry_msgs::TransformStamped laser_to_base_tf =
-                tf_buffer.lookupTransform(baseFrame, laserFrame, ros::Time(0));
-
-            tf2::Transform tf;
-
-            // lidar origin
-            geometry_msgs::PointStamped origin;
-            origin.point.x = 0;
-            origin.point.y = 0;
-            origin.point.z = 0;
-            geometry_msgs::PointStamped base_origin;
-            tf2::doTransform(origin, base_origin, laser_to_base_tf);
-            fromMsg(base_origin.point, lidar_origin);
-
-            // normal vector
-            geometry_msgs::Vector3Stamped normal;
-            normal.vector.x = 1.0;
-            normal.vector.y = 0.0;
-            normal.vector.z = 0.0;
-            geometry_msgs::Vector3Stamped base_normal;
-            tf2::doTransform(normal, base_normal, laser_to_base_tf);
-            fromMsg(base_normal.vector, lidar_normal);
-
-            double min_range = msg->range_min;
-            double max_range = msg->range_max;
-            double min_angle = msg->angle_min;
-            double max_angle = msg->angle_max;
-            double angle_increment = msg->angle_increment;
-            lidar.reset(laserFrame, angle_increment, min_range, max_range, min_angle, max_angle);
-            have_lidar = true;
-
-            // Sine / Cosine Look Up Tables
-            cosLUT.reserve(array_size);
-            sinLUT.reserve(array_size);
-            double angle = msg->angle_min;
-            for (unsigned int i = 0 ; i < array_size ; i++) {
-                double cosine = std::cos(angle);
-                double sine = std::sin(angle);
-                cosLUT.push_back(std::move(cosine));
-                sinLUT.push_back(std::move(sine));
-                angle += increment;
+void ObstaclePoints::range_callback(const sensor_msgs::Range::ConstPtr &msg) {
+    trace_callback(msg->header.stamp);
+
+    // Where the robot was, to remember the reading by
+    tf2::Transform base_to_odom;
+    bool recording = memory.enabled() &&
+                     lookup_base_to_odom(msg->header.stamp, base_to_odom);
+
+    const std::lock_guard<std::mutex> lock(points_mutex);
+    RangeSensor* sensor = update_sonar(*msg);
+    if (sensor && recording) {
+        remember(*sensor, *msg, base_to_odom);
+    }
+    updates++;
+}
+
+void ObstaclePoints::range_array_callback(const move_basic::RangeArray::ConstPtr &msg) {
+    trace_callback(msg->header.stamp);
+
+    tf2::Transform base_to_odom;
+    bool recording = memory.enabled() &&
+                     lookup_base_to_odom(msg->header.stamp, base_to_odom);
+
+    // The whole batch goes in at once, so a snapshot never holds
+    // part of it
+    const std::lock_guard<std::mutex> lock(points_mutex);
+    for (const auto& range : msg->ranges) {
+        RangeSensor* sensor = update_sonar(range);
+        if (sensor && recording) {
+            remember(*sensor, range, base_to_odom);
+        }
+    }
+    updates++;
+}
+
+// Only echoes are remembered, a reading at max_range saw nothing
+
+void ObstaclePoints::remember(const RangeSensor& sensor, const sensor_msgs::Range& msg,
+                              const tf2::Transform& base_to_odom) {
+    if (!(msg.range >= msg.min_range && msg.range < msg.max_range)) {
+        return;
+    }
+    tf2::Vector3 left = base_to_odom * sensor.left_vertex;
+    tf2::Vector3 right = base_to_odom * sensor.right_vertex;
+    ObstacleMemory::Segment segment = {
+        static_cast<float>(left.x()), static_cast<float>(left.y()),
+        static_cast<float>(right.x()), static_cast<float>(right.y())};
+    memory.add(segment, msg.header.stamp.toSec());
+}
+
+RangeSensor* ObstaclePoints::update_sonar(const sensor_msgs::Range& msg) {
+    const std::string& frame = msg.header.frame_id;
+    ROS_DEBUG("Callback %s %f", frame.c_str(), msg.range);
+
+    // create sensor object if this is a new sensor, or update its
+    // geometry after a static transform change
+    std::unordered_map<std::string, int>::const_iterator it = sonar_ids.find(frame);
+    RangeSensor* existing = (it == sonar_ids.end()) ? NULL : &sonars[it->second];
+    if (!existing || (stale_sonars[existing->id] && static_tf_arrived(frame))) {
+        ROS_DEBUG("lookup %s %s", baseFrame.c_str(), frame.c_str());
+        geometry_msgs::TransformStamped sensor_to_base_tf;
+        if (!lookup_sensor_tf(frame, sensor_to_base_tf)) {
+            if (existing) {
+                // keep the old geometry and try again on the next reading
+                existing->update(msg.range, msg.header.stamp);
             }
+            return existing;
         }
-        catch (tf2::TransformException &ex) {
-            ROS_WARN("%s", ex.what());
-            return;
+
+        tf2::Transform tf;
+        tf2::Vector3 origin, left_vector, right_vector;
+
+        // sensor origin
+        geometry_msgs::PointStamped sensor_origin;
+        sensor_origin.point.x = 0;
+        sensor_origin.point.y = 0;
+        sensor_origin.point.z = 0;
+        geometry_msgs::PointStamped base_origin;
+        tf2::doTransform(sensor_origin, base_origin, sensor_to_base_tf);
+        fromMsg(base_origin.point, origin);
+        ROS_INFO("Obstacle: origin %f %f %f", origin.x(), origin.y(), origin.z());
+
+        // vectors at the edges of cone when cone height is 1m
+        double theta = msg.field_of_view / 2.0;
+        float x = std::cos(theta);
+        float y = std::sin(theta);
+
+        geometry_msgs::Vector3Stamped sensor_left;
+        sensor_left.vector.x = x;
+        sensor_left.vector.y = -y;
+        sensor_left.vector.z = 0.0;
+        geometry_msgs::Vector3Stamped base_left;
+        tf2::doTransform(sensor_left, base_left, sensor_to_base_tf);
+        fromMsg(base_left.vector, left_vector);
+
+        geometry_msgs::Vector3Stamped sensor_right;
+        sensor_right.vector.x = x;
+        sensor_right.vector.y = y;
+        sensor_right.vector.z = 0.0;
+        geometry_msgs::Vector3Stamped base_right;
+        tf2::doTransform(sensor_right, base_right, sensor_to_base_tf);
+        fromMsg(base_right.vector, right_vector);
+
+        // an existing sensor keeps its id
+        int id = existing ? existing->id : sonars.size();
+        RangeSensor sensor(id, frame, origin,
+                           left_vector, right_vector);
+        sensor.update(msg.range, msg.header.stamp);
+        if (existing) {
+            sensor.geometry = existing->geometry + 1;
+            *existing = sensor;
+            stale_sonars[id] = false;
         }
+        else {
+            sonars.push_back(sensor);
+            stale_sonars.push_back(false);
+            sonar_ids.emplace(frame, id);
+        }
+        return &sonars[id];
     }
+    existing->update(msg.range, msg.header.stamp);
+    return existing;
+}
+
+void ObstaclePoints::scan_callback(const sensor_msgs::LaserScan::ConstPtr &msg)
+{
+    trace_callback(msg->header.stamp);
+    std::string frame = msg->header.frame_id;
 
-    lidar_points.clear();
-    lidar_points.reserve(array_size);
-    for (const auto& r : msg->ranges) {
-        lidar_points.push_back(PolarLine(r, theta));
-        theta += increment;
+    LidarSensor* lidar;
+    {
+        const std::lock_guard<std::mutex> lock(lidars_mutex);
+
+        // create sensor object if this is a new lidar, or update its
+        // geometry after a static transform change
+        std::map<std::string,LidarSensor>::iterator it = lidars.find(frame);
+        bool moved = stale_lidars.count(frame) && static_tf_arrived(frame);
+        if (it == lidars.end() || moved) {
+            stale_lidars.erase(frame);
+            geometry_msgs::TransformStamped laser_to_base_tf;
+            if (!lookup_sensor_tf(frame, laser_to_base_tf)) {
+                if (it == lidars.end()) {
+                    return;
+                }
+                // keep the old geometry and try again on the next scan
+                stale_lidars.insert(frame);
+            }
+            else {
+                tf2::Vector3 lidar_origin, lidar_normal;
+
+                // lidar origin
+                geometry_msgs::PointStamped origin;
+                origin.point.x = 0;
+                origin.point.y = 0;
+                origin.point.z = 0;
+                geometry_msgs::PointStamped base_origin;
+                tf2::doTransform(origin, base_origin, laser_to_base_tf);
+                fromMsg(base_origin.point, lidar_origin);
+
+                // normal vector
+                geometry_msgs::Vector3Stamped normal;
+                normal.vector.x = 1.0;
+                normal.vector.y = 0.0;
+                normal.vector.z = 0.0;
+                geometry_msgs::Vector3Stamped base_normal;
+                tf2::doTransform(normal, base_normal, laser_to_base_tf);
+                fromMsg(base_normal.vector, lidar_normal);
+
+                if (it == lidars.end()) {
+                    std::map<std::string, ScanRoi>::const_iterator roi =
+                        lidar_rois.find(frame);
+                    it = lidars.insert(std::make_pair(frame,
+                        LidarSensor(lidars.size(), frame, lidar_origin, lidar_normal,
+                                    roi == lidar_rois.end() ? default_roi : roi->second,
+                                    scan_buffers))).first;
+                    if (max_scan_beams > 0) {
+                        it->second.reserve(max_scan_beams);
+                    }
+
+                    // publish a new table for the readers
+                    std::shared_ptr<std::vector<const LidarSensor*>> table(
+                        new std::vector<const LidarSensor*>(lidars.size()));
+                    for (const auto& kv : lidars) {
+                        (*table)[kv.second.id] = &kv.second;
+                    }
+                    std::atomic_store(&lidar_table,
+                        std::shared_ptr<const std::vector<const LidarSensor*>>(table));
+                }
+                else {
+                    it->second.set_geometry(lidar_origin, lidar_normal);
+                }
+            }
+        }
+        lidar = &it->second;
     }
+
+    // Map entries don't move, and roscpp doesn't run a subscription's
+    // callbacks concurrently, so this is the only thread updating the
+    // lidar.  No lock is held while converting and publishing the scan.
+    lidar->update(*msg);
+    updates++;
 }
 
-std::vector<tf2::Vector3> ObstaclePoints::get_points(ros::Duration max_age) {
+void ObstaclePoints::get_snapshot(ros::Duration max_age, ObstacleSnapshot& snapshot,
+                                  TransformCache* tf_cache)
+{
     ros::Time now = ros::Time::now();
-    std::vector<tf2::Vector3> points;
+    snapshot.clear();
+    snapshot.stamp = now;
 
-    const std::lock_guard<std::mutex> lock(points_mutex);
-    points.reserve(lidar_points.size());
-    ros::Duration lidar_age = now - lidar_stamp;
-    if (lidar_age < max_age) {
-	for (unsigned int i = 0 ; i < lidar_points.size() ; i++) {
-            float radius = lidar_points[i].radius;
+    // The published scans are immutable, so they are shared rather than
+    // copied, and picked up without taking a lock
+    std::shared_ptr<const std::vector<const LidarSensor*>> table =
+        std::atomic_load(&lidar_table);
+    snapshot.lidars.resize(table->size());
+    snapshot.lidar_stamps.resize(table->size());
+    snapshot.lidar_geometry.resize(table->size());
+    for (const LidarSensor* lidar : *table) {
+        std::shared_ptr<const ScanPoints> scan = lidar->points();
+        if (scan && now - scan->stamp < max_age) {
+            snapshot.lidars[lidar->id] = scan;
+            snapshot.lidar_stamps[lidar->id] = scan->stamp;
+            snapshot.lidar_geometry[lidar->id] = scan->geometry;
+        }
+    }
 
-            // ignore bogus samples
-            if (std::isnan(radius) || std::isinf(radius) || radius < lidar.min_range) continue;
+    // The remembered echoes are brought back to where the robot is now,
+    // with one transform for all of them
+    tf2::Transform odom_to_base;
+    bool recalling = false;
+    if (memory.enabled()) {
+        if (tf_cache) {
+            recalling = tf_cache->lookup(odom_frame, baseFrame, odom_to_base);
+        }
+        else {
+            geometry_msgs::TransformStamped odom_to_base_msg;
+            recalling = lookup_sensor_tf(odom_frame, odom_to_base_msg);
+            if (recalling) {
+                odom_to_base = to_transform(odom_to_base_msg);
+            }
+        }
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(points_mutex);
 
-	    float x = lidar_origin.x() + radius * (lidar_normal.x() * cosLUT[i] -
-		 lidar_normal.y() * sinLUT[i]);
+        for (const RangeSensor& sensor : sonars) {
+            ros::Duration age = now - sensor.stamp;
+            if (age < max_age) {
+               snapshot.points.push_back(sensor.left_vertex);
+               snapshot.points.push_back(sensor.right_vertex);
+               snapshot.lines.emplace_back(sensor.left_vertex, sensor.right_vertex);
+               snapshot.line_sources.push_back(ObstacleSnapshot::Source(sensor.id, sensor.stamp, sensor.geometry));
+            }
+        }
 
-	    float y = lidar_origin.y() + radius * (lidar_normal.y() * cosLUT[i] +
-		 lidar_normal.x() * sinLUT[i]);
+        // They come after the sonars as lines without a sonar, so the
+        // collision checks always check them in full
+        memory.expire(now.toSec());
+        if (recalling) {
+            memory.for_each([&](const ObstacleMemory::Segment& segment, double start) {
+                tf2::Vector3 left = odom_to_base * tf2::Vector3(segment.x0, segment.y0, 0);
+                tf2::Vector3 right = odom_to_base * tf2::Vector3(segment.x1, segment.y1, 0);
+                snapshot.points.push_back(left);
+                snapshot.points.push_back(right);
+                snapshot.lines.emplace_back(left, right);
+                snapshot.line_sources.push_back(ObstacleSnapshot::Source(-1, ros::Time(start)));
+            });
+        }
 
-	    points.push_back(tf2::Vector3(x, y, 0));
-	}
+        // Add all the test points
+        for (const auto& p : test_points) {
+            snapshot.points.push_back(p);
+        }
     }
 
-    for (const auto& kv : sensors) {
-        const RangeSensor& sensor = kv.second;
+    if (use_grid) {
+        rasterize(snapshot);
+    }
+}
 
-	ros::Duration age = now - sensor.stamp;
-        if (age < max_age) {
-           points.push_back(sensor.left_vertex);
-           points.push_back(sensor.right_vertex);
+void ObstaclePoints::rasterize(ObstacleSnapshot& snapshot) const
+{
+    ObstacleGrid& grid = snapshot.grid;
+    grid.reset(grid_resolution, grid_cells);
+    for (const auto& lidar : snapshot.lidars) {
+        if (!lidar) {
+            continue;
+        }
+        for (size_t i = 0; i < lidar->size(); i++) {
+            grid.mark(lidar->x[i], lidar->y[i]);
         }
     }
+    // The sonar cone ends are marked by their lines
+    for (const auto& line : snapshot.lines) {
+        grid.mark_line(line.first.x(), line.first.y(), line.second.x(), line.second.y());
+    }
+    const PlanarPoints& points = snapshot.points;
+    for (size_t i = 2 * snapshot.lines.size(); i < points.size(); i++) {
+        grid.mark(points.x[i], points.y[i]);
+    }
+}
 
-    // Add all the test points
-    points.insert(points.end(), test_points.begin(), test_points.end());
+std::vector<tf2::Vector3> ObstaclePoints::get_points(ros::Duration max_age) {
+    ObstacleSnapshot snapshot;
+    get_snapshot(max_age, snapshot);
 
+    std::vector<tf2::Vector3> points;
+    for (const auto& lidar : snapshot.lidars) {
+        if (!lidar) {
+            continue;
+        }
+        for (size_t i = 0; i < lidar->size(); i++) {
+            points.push_back(tf2::Vector3(lidar->x[i], lidar->y[i], 0));
+        }
+    }
+    for (size_t i = 0; i < snapshot.points.size(); i++) {
+        points.push_back(tf2::Vector3(snapshot.points.x[i], snapshot.points.y[i], 0));
+    }
     return points;
 }
 
 std::vector<ObstaclePoints::Line> ObstaclePoints::get_lines(ros::Duration max_age) {
-    ros::Time now = ros::Time::now();
+    ObstacleSnapshot snapshot;
+    get_snapshot(max_age, snapshot);
 
-    const std::lock_guard<std::mutex> lock(points_mutex);
-    std::vector<ObstaclePoints::Line> lines;
-    for (const auto& kv : sensors) {
-        const RangeSensor& sensor = kv.second;
-	ros::Duration age = now - sensor.stamp;
-	if (age < max_age) lines.emplace_back(sensor.left_vertex, sensor.right_vertex);
+    std::vector<Line> lines;
+    for (const auto& line : snapshot.lines) {
+        lines.emplace_back(tf2::Vector3(line.first.x(), line.first.y(), 0),
+                           tf2::Vector3(line.second.x(), line.second.y(), 0));
     }
-
     return lines;
 }
 
+void ObstaclePoints::reserve(size_t lidars, size_t beams, size_t sonars) {
+    {
+        const std::lock_guard<std::mutex> lock(lidars_mutex);
+        max_lidars = lidars;
+        max_scan_beams = beams;
+        if (beams > 0) {
+            for (auto& kv : this->lidars) {
+                kv.second.reserve(beams);
+            }
+        }
+    }
+
+    const std::lock_guard<std::mutex> lock(points_mutex);
+    max_sonars = sonars;
+    // The sonars are only ever added to, so update_sonar() doesn't
+    // reallocate until there are more than this
+    this->sonars.reserve(sonars);
+    stale_sonars.reserve(sonars);
+    sonar_ids.reserve(sonars);
+}
+
+void ObstaclePoints::reserve_snapshot(ObstacleSnapshot& snapshot) {
+    const std::lock_guard<std::mutex> lock(points_mutex);
+    // Each sonar gives a line, and so does each remembered echo
+    snapshot.reserve(max_lidars, max_sonars + memory.capacity());
+    if (use_grid) {
+        snapshot.grid.reset(grid_resolution, grid_cells);
+    }
+}
+
 void ObstaclePoints::add_test_point(tf2::Vector3 p) {
     const std::lock_guard<std::mutex> lock(points_mutex);
     test_points.push_back(p);
+    updates++;
 }
 
 void ObstaclePoints::clear_test_points() {
     const std::lock_guard<std::mutex> lock(points_mutex);
     test_points.clear();
+    updates++;
+}
+
+void ObstaclePoints::set_trace(LatencyTrace* trace) {
+    this->trace = trace;
+}
+
+void ObstaclePoints::trace_callback(const ros::Time& stamp) const {
+    if (trace && trace->enabled()) {
+        trace->record_callback(stamp.toSec(), ros::Time::now().toSec());
+    }
+}
+
+ScanRoi::ScanRoi() : max_range(0), min_angle(-M_PI), max_angle(M_PI),
+                     decimation_range(0)
+{
+}
+
+bool ScanRoi::contains(double angle) const
+{
+    angle = std::remainder(angle, 2 * M_PI);
+    if (min_angle <= max_angle) {
+        return (min_angle <= angle && angle <= max_angle) ||
+               // a window over the whole circle keeps the beams at +-pi
+               max_angle - min_angle >= 2 * M_PI - 1e-6;
+    }
+    return angle >= min_angle || angle <= max_angle;
+}
+
+/*
+ A lidar's scan buffers.  A scan is handed to its readers as a
+ shared_ptr whose control block is made in place in its buffer, so
+ publishing one doesn't allocate.  The last reader to let go destroys
+ the control block, and in_use is only cleared with release once that
+ is done, so the lidar only refills a buffer after reading in_use with
+ acquire sees that every reader has finished with it.
+*/
+struct ScanBuffer
+{
+    ScanPoints points;
+    std::atomic<bool> in_use;
+    // room for the control block of the published scan
+    std::aligned_storage<128, alignof(std::max_align_t)>::type control;
+
+    ScanBuffer() : in_use(false) {}
+};
+
+struct ScanPool
+{
+    std::vector<ScanBuffer> buffers;
+    // beams that reserve() asked for, applied by the next update()
+    std::atomic<size_t> requested_beams;
+
+    explicit ScanPool(size_t buffers) : buffers(buffers), requested_beams(0) {}
+};
+
+const size_t LidarSensor::DEFAULT_SCAN_BUFFERS;
+const size_t LidarSensor::MIN_SCAN_BUFFERS;
+
+// Places the control block of a published scan in its buffer, and
+// frees the buffer when the control block goes.  It holds the pool, so
+// the buffers outlast every scan published from them.
+template <typename T>
+struct ScanAllocator
+{
+    typedef T value_type;
+
+    std::shared_ptr<ScanPool> pool;
+    ScanBuffer* buffer;
+
+    ScanAllocator(const std::shared_ptr<ScanPool>& pool, ScanBuffer* buffer) :
+        pool(pool), buffer(buffer) {}
+    template <typename U>
+    ScanAllocator(const ScanAllocator<U>& other) :
+        pool(other.pool), buffer(other.buffer) {}
+
+    T* allocate(size_t n)
+    {
+        if (n * sizeof(T) > sizeof(buffer->control)) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(static_cast<void*>(&buffer->control));
+    }
+    void deallocate(T*, size_t)
+    {
+        buffer->in_use.store(false, std::memory_order_release);
+    }
+};
+
+template <typename T, typename U>
+static bool operator==(const ScanAllocator<T>& a, const ScanAllocator<U>& b)
+{
+    return a.buffer == b.buffer;
+}
+
+template <typename T, typename U>
+static bool operator!=(const ScanAllocator<T>& a, const ScanAllocator<U>& b)
+{
+    return a.buffer != b.buffer;
+}
+
+// The points belong to the buffer, only the control block goes
+struct KeepScan
+{
+    void operator()(const ScanPoints*) const {}
+};
+
+LidarSensor::LidarSensor() : lut_beams(0), geometry(0),
+                             pool(std::make_shared<ScanPool>(DEFAULT_SCAN_BUFFERS)),
+                             reserved_beams(0)
+{
+}
+
+LidarSensor::LidarSensor(int id, std::string frame_id,
+                         const tf2::Vector3& origin,
+                         const tf2::Vector3& normal,
+                         const ScanRoi& roi,
+                         size_t scan_buffers) :
+    lut_beams(0), geometry(0),
+    pool(std::make_shared<ScanPool>(std::max(scan_buffers, MIN_SCAN_BUFFERS))),
+    reserved_beams(0)
+{
+    this->id = id;
+    this->frame_id = frame_id;
+    this->origin = origin;
+    this->normal = normal;
+    this->roi = roi;
+    reset(frame_id, 0, 0, 0, 0, 0);
+    ROS_INFO("Adding lidar %s", frame_id.c_str());
 }
 
 void LidarSensor::reset(const std::string & _frame,
-                         const int _increment,
+                         const double & _increment,
                          const double & _min_range,
                          const double & _max_range,
                          const double & _min_angle,
@@ -252,10 +813,163 @@ void LidarSensor::reset(const std::string & _frame,
     this->max_angle = _max_angle;
 }
 
+void LidarSensor::set_geometry(const tf2::Vector3& origin,
+                               const tf2::Vector3& normal)
+{
+    this->origin = origin;
+    this->normal = normal;
+    geometry++;
+    // the beam directions are rebuilt on the next scan
+    lut_beams = 0;
+    beam_x.clear();
+    beam_y.clear();
+    beam_index.clear();
+}
+
+void LidarSensor::reserve(size_t beams)
+{
+    pool->requested_beams.store(beams, std::memory_order_relaxed);
+}
+
+size_t LidarSensor::scan_buffers() const
+{
+    return pool->buffers.size();
+}
+
+void LidarSensor::size_buffers(size_t beams)
+{
+    reserved_beams = beams;
+    beam_x.reserve(beams);
+    beam_y.reserve(beams);
+    beam_index.reserve(beams);
+    scan_points.reserve(beams);
+    scan_points.r_sq.reserve(beams);
+    scan_rings.reserve(beams);
+    // The buffers held by readers are sized when they are next filled
+    for (ScanBuffer& buffer : pool->buffers) {
+        if (!buffer.in_use.load(std::memory_order_acquire)) {
+            buffer.points.reserve(beams);
+            buffer.points.r_sq.reserve(beams);
+            buffer.points.ring_start.reserve(PlanarPoints::NUM_RINGS + 1);
+        }
+    }
+}
+
+void LidarSensor::update(const sensor_msgs::LaserScan& msg)
+{
+    size_t array_size = msg.ranges.size();
+
+    // Only this thread touches the buffers, so a size asked for by
+    // reserve() is applied here
+    size_t requested = pool->requested_beams.load(std::memory_order_relaxed);
+    if (requested != reserved_beams) {
+        size_buffers(requested);
+    }
+
+    // (Re)build the beam directions if the scan geometry is new.  Only
+    // the beams in the angular window are in the table, so the others
+    // cost nothing per scan.
+    if (lut_beams != array_size || min_angle != msg.angle_min ||
+        angle_increment != msg.angle_increment) {
+        reset(msg.header.frame_id, msg.angle_increment, msg.range_min,
+              msg.range_max, msg.angle_min, msg.angle_max);
+        if (reserved_beams > 0 && array_size > reserved_beams) {
+            ROS_WARN("Lidar %s has %zu beams, more than the %zu that max_scan_beams "
+                     "allows for", frame_id.c_str(), array_size, reserved_beams);
+        }
+
+        beam_x.clear();
+        beam_y.clear();
+        beam_index.clear();
+        double angle = msg.angle_min;
+        for (unsigned int i = 0 ; i < array_size ; i++) {
+            if (roi.contains(angle)) {
+                double c = std::cos(angle);
+                double s = std::sin(angle);
+                beam_x.push_back(normal.x() * c - normal.y() * s);
+                beam_y.push_back(normal.y() * c + normal.x() * s);
+                beam_index.push_back(i);
+            }
+            angle += msg.angle_increment;
+        }
+        lut_beams = array_size;
+    }
+
+    // Find a buffer that no reader holds.  The latest scan is held by
+    // latest, so it is never picked.  If readers hold them all, this
+    // scan is dropped rather than the pool grown.
+    ScanBuffer* buffer = NULL;
+    for (ScanBuffer& b : pool->buffers) {
+        if (!b.in_use.load(std::memory_order_acquire)) {
+            buffer = &b;
+            break;
+        }
+    }
+    if (!buffer) {
+        ROS_WARN_THROTTLE(1.0, "Lidar %s: all %zu scan buffers are held, dropping a scan",
+                          frame_id.c_str(), pool->buffers.size());
+        return;
+    }
+
+    // Convert to cartesian base_frame coordinates once per scan, rather
+    // than every time the points are queried, and compact out the
+    // samples that can't be obstacles.  The radius and ring of each
+    // point are worked out here too, ready for indexing.
+    const float ox = origin.x();
+    const float oy = origin.y();
+    const float range_min = min_range;
+    // NaN and inf ranges also fail the cap, so it costs nothing extra
+    const float range_cap = roi.max_range > 0 ? roi.max_range :
+                            std::numeric_limits<float>::max();
+    const float inverse_decimation = roi.decimation_range > 0 ?
+                                     1.0f / roi.decimation_range : 0.0f;
+    const size_t beams = beam_index.size();
+    scan_points.clear();
+    scan_points.reserve(beams);
+    scan_points.r_sq.reserve(beams);
+    scan_rings.clear();
+    scan_rings.reserve(beams);
+    for (size_t k = 0; k < beams; k++) {
+        uint32_t i = beam_index[k];
+        float radius = msg.ranges[i];
+
+        // ignore bogus samples, and those past the region of interest
+        if (!(radius >= range_min && radius <= range_cap)) continue;
+
+        // thin out the distant beams, which are further apart anyway
+        uint32_t stride = radius * inverse_decimation;
+        if (stride > 1 && i % stride != 0) continue;
+
+        float x = ox + radius * beam_x[k];
+        float y = oy + radius * beam_y[k];
+        float d = x * x + y * y;
+
+        scan_points.push_back(x, y);
+        scan_points.r_sq.push_back(d);
+        scan_rings.push_back(PlanarPoints::ring_of(d));
+    }
+
+    // Only this thread sets in_use, and the buffer is free until the
+    // scan is published
+    buffer->in_use.store(true, std::memory_order_relaxed);
+    buffer->points.stamp = msg.header.stamp;
+    buffer->points.geometry = geometry;
+    buffer->points.sort_by_radius(scan_points, scan_rings);
+
+    std::shared_ptr<const ScanPoints> scan(&buffer->points, KeepScan(),
+                                           ScanAllocator<ScanPoints>(pool, buffer));
+    std::atomic_store(&latest, scan);
+}
+
+std::shared_ptr<const ScanPoints> LidarSensor::points() const
+{
+    return std::atomic_load(&latest);
+}
+
 RangeSensor::RangeSensor(int id, std::string frame_id,
                          const tf2::Vector3& origin,
                          const tf2::Vector3& left_vec,
-                         const tf2::Vector3& right_vec)
+                         const tf2::Vector3& right_vec) : geometry(0)
 {
     this->id = id;
     this->frame_id = frame_id;
@@ -272,8 +986,78 @@ void RangeSensor::update(float range, ros::Time stamp)
     right_vertex = origin + right_vec * range;
 }
 
-ObstaclePoints::PolarLine::PolarLine(float radius, float theta)
+const float PlanarPoints::RING_WIDTH = 0.05;
+
+size_t PlanarPoints::ring_of(float r_sq)
+{
+    size_t ring = std::sqrt(r_sq) / RING_WIDTH;
+    return std::min(ring, NUM_RINGS - 1);
+}
+
+void PlanarPoints::sort_by_radius(const PlanarPoints& unsorted,
+                                  const std::vector<uint8_t>& rings)
+{
+    // Counting sort, so this is linear in the number of points
+    size_t n = unsorted.size();
+    x.resize(n);
+    y.resize(n);
+    r_sq.resize(n);
+    ring_start.assign(NUM_RINGS + 1, 0);
+
+    for (size_t i = 0; i < n; i++) {
+        ring_start[rings[i] + 1]++;
+    }
+    for (size_t k = 0; k < NUM_RINGS; k++) {
+        ring_start[k + 1] += ring_start[k];
+    }
+
+    // ring_start[k] is used as the insertion point for ring k, which
+    // leaves it at the start of ring k+1, so shift it back afterwards
+    for (size_t i = 0; i < n; i++) {
+        uint32_t j = ring_start[rings[i]]++;
+        x[j] = unsorted.x[i];
+        y[j] = unsorted.y[i];
+        r_sq[j] = unsorted.r_sq[i];
+    }
+    for (size_t k = NUM_RINGS; k > 0; k--) {
+        ring_start[k] = ring_start[k - 1];
+    }
+    ring_start[0] = 0;
+}
+
+void PlanarPoints::radius_range(float r_sq_min, float r_sq_max,
+                                size_t& begin, size_t& end) const
+{
+    if (ring_start.empty() || r_sq_min > r_sq_max) {
+        begin = 0;
+        end = (ring_start.empty()) ? size() : 0;
+        return;
+    }
+    begin = ring_start[ring_of(std::max(r_sq_min, 0.0f))];
+    end = ring_start[ring_of(r_sq_max) + 1];
+}
+
+void ObstacleSnapshot::clear()
+{
+    // Release the scans so that their buffers can be reused
+    for (auto& lidar : lidars) {
+        lidar.reset();
+    }
+    points.clear();
+    lines.clear();
+    lidar_stamps.clear();
+    lidar_geometry.clear();
+    line_sources.clear();
+    grid.clear();
+}
+
+void ObstacleSnapshot::reserve(size_t lidars, size_t lines)
 {
-    this->radius = radius;
-    this->theta = theta;
+    this->lidars.reserve(lidars);
+    lidar_stamps.reserve(lidars);
+    lidar_geometry.reserve(lidars);
+    // the two ends of each line are points too
+    points.reserve(2 * lines);
+    this->lines.reserve(lines);
+    line_sources.reserve(lines);
 }
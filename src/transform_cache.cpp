@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include "move_basic/transform_cache.h"
+
+TransformCache::TransformCache(tf2_ros::Buffer& tf_buffer) :
+    tf_buffer(tf_buffer), tick(1)
+{
+}
+
+void TransformCache::new_tick()
+{
+    tick++;
+}
+
+bool TransformCache::lookup(const std::string& from, const std::string& to,
+                            tf2::Transform& tf)
+{
+    Entry& entry = entries[Key(from, to)];
+    if (entry.tick == tick) {
+        tf = entry.tf;
+        return entry.valid;
+    }
+
+    std::map<Key, Entry>::const_iterator inverse = entries.find(Key(to, from));
+    if (inverse != entries.end() && inverse->second.tick == tick) {
+        entry = inverse->second;
+        entry.tf = entry.tf.inverse();
+        tf = entry.tf;
+        return entry.valid;
+    }
+
+    entry.tick = tick;
+    entry.valid = false;
+
+    // canTransform reports failure without throwing, lookupTransform can
+    // still throw if the tree changes between the two calls
+    if (!tf_buffer.canTransform(to, from, ros::Time(0))) {
+        return false;
+    }
+    try {
+        geometry_msgs::TransformStamped tfs =
+            tf_buffer.lookupTransform(to, from, ros::Time(0));
+        tf2::fromMsg(tfs.transform, entry.tf);
+        entry.valid = true;
+        tf = entry.tf;
+    }
+    catch (tf2::TransformException &ex) {
+    }
+    return entry.valid;
+}
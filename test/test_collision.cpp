@@ -33,9 +33,12 @@
 
 #include <ros/ros.h>
 #include <move_basic/collision_checker.h>
+#include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/Range.h>
 #include <tf2_ros/buffer.h>
 #include <tf2_ros/transform_listener.h>
 
+#include <random>
 #include <string>
 
 class CollisionCheckerTests : public ::testing::Test {
@@ -195,6 +198,49 @@ TEST_F(CollisionCheckerTests, obstaclesRotBackRight) {
     ASSERT_FLOAT_EQ(right_angle, 0.51400685);
 }
 
+TEST_F(CollisionCheckerTests, obstaclesRotLidar) {
+    // A single close return among many distant ones, which the
+    // radius index must not lose
+    sensor_msgs::LaserScan::Ptr msg(new sensor_msgs::LaserScan());
+    msg->header.stamp = ros::Time::now();
+    msg->header.frame_id = "base_link";
+    msg->angle_min = -M_PI;
+    msg->angle_increment = M_PI / 180;
+    msg->angle_max = M_PI;
+    msg->range_min = 0.05;
+    msg->range_max = 10;
+    msg->ranges.assign(360, 5.0);
+    msg->ranges[270] = 0.15;
+    obstacle_points->clear_test_points();
+    obstacle_points->scan_callback(msg);
+
+    float left_angle = collision_checker->obstacle_angle(true);
+    float right_angle = collision_checker->obstacle_angle(false);
+    ASSERT_FLOAT_EQ(left_angle, M_PI);
+    ASSERT_NEAR(right_angle, 1.0082601, 1e-4);
+}
+
+TEST_F(CollisionCheckerTests, obstaclesRotLongFront) {
+    // With the front longer than the back, the front corners sweep out
+    // further than the back ones, so the same point mirrored hits them
+    obstacle_points->clear_test_points();
+    obstacle_points->add_test_point(tf2::Vector3(-0.2, 0.0, 0));
+    float back_left = collision_checker->obstacle_angle(true);
+    float back_right = collision_checker->obstacle_angle(false);
+    ASSERT_LT(back_left, M_PI);
+
+    nh.setParam("robot_front_length", 0.19);
+    nh.setParam("robot_back_length", 0.09);
+    CollisionChecker checker(nh, tf_buffer, *obstacle_points);
+    nh.deleteParam("robot_front_length");
+    nh.deleteParam("robot_back_length");
+
+    obstacle_points->clear_test_points();
+    obstacle_points->add_test_point(tf2::Vector3(0.2, 0.0, 0));
+    EXPECT_FLOAT_EQ(checker.obstacle_angle(true), back_left);
+    EXPECT_FLOAT_EQ(checker.obstacle_angle(false), back_right);
+}
+
 TEST_F(CollisionCheckerTests, arcNoObstacles) {
     obstacle_points->clear_test_points();
     float t = collision_checker->obstacle_arc_angle(0.0,0.0);
@@ -203,42 +249,353 @@ TEST_F(CollisionCheckerTests, arcNoObstacles) {
     EXPECT_FLOAT_EQ(t, M_PI);
 }
 
+// Turn the point about the center of rotation in small steps until it is
+// inside the default footprint, in the frame of the robot
+
+static float swept_angle(float px, float py, double linear, double angular)
+{
+    const double cy = linear / angular;
+    const double dir = (angular > 0) ? 1.0 : -1.0;
+    const double step = 1e-4;
+    for (double theta = 0; theta < M_PI; theta += step) {
+        double c = std::cos(-dir * theta);
+        double s = std::sin(-dir * theta);
+        double x = c * px - s * (py - cy);
+        double y = s * px + c * (py - cy) + cy;
+        if (-0.19 <= x && x <= 0.09 && -0.08 <= y && y <= 0.08) {
+            return theta;
+        }
+    }
+    return M_PI;
+}
+
+TEST_F(CollisionCheckerTests, arcInPlace) {
+    // Turning in place is the same as obstacle_angle
+    for (const tf2::Vector3& p : {tf2::Vector3(0, .15, 0), tf2::Vector3(-0.05, -.15, 0),
+                                  tf2::Vector3(0.1, 0.01, 0), tf2::Vector3(-0.2, 0.01, 0)}) {
+        obstacle_points->clear_test_points();
+        obstacle_points->add_test_point(p);
+        EXPECT_NEAR(collision_checker->obstacle_arc_angle(0.0, 1.0),
+                    collision_checker->obstacle_angle(true), 1e-4);
+        EXPECT_NEAR(collision_checker->obstacle_arc_angle(0.0, -1.0),
+                    collision_checker->obstacle_angle(false), 1e-4);
+    }
+}
+
 TEST_F(CollisionCheckerTests, arcForward) {
+    // Driving a left arc passes to the left of a point straight ahead
     obstacle_points->clear_test_points();
-    obstacle_points->add_test_point(tf2::Vector3(0.1,0,0));
-    float left = collision_checker->obstacle_arc_angle(1.0,1.0);
-    float right = collision_checker->obstacle_arc_angle(1.0,-1.0);
-    EXPECT_FLOAT_EQ(left, -1.471128);
-    EXPECT_FLOAT_EQ(right, 1.471128);
+    obstacle_points->add_test_point(tf2::Vector3(0.5, 0, 0));
+    EXPECT_FLOAT_EQ(collision_checker->obstacle_arc_angle(1.0, 1.0), M_PI);
+    EXPECT_FLOAT_EQ(collision_checker->obstacle_arc_angle(1.0, -1.0), M_PI);
 
+    // but not a point on the arc
     obstacle_points->clear_test_points();
-    obstacle_points->add_test_point(tf2::Vector3(1,1,0));
-    obstacle_points->add_test_point(tf2::Vector3(1,-1,0));
-    left = collision_checker->obstacle_arc_angle(1.0,1.0);
-    right = collision_checker->obstacle_arc_angle(1.0,-1.0);
-    EXPECT_FLOAT_EQ(left, 0.0);
-    EXPECT_FLOAT_EQ(right, 0.0);
+    obstacle_points->add_test_point(tf2::Vector3(std::sin(0.5), 1 - std::cos(0.5), 0));
+    float left = collision_checker->obstacle_arc_angle(1.0, 1.0);
+    EXPECT_NEAR(left, swept_angle(std::sin(0.5), 1 - std::cos(0.5), 1.0, 1.0), 2e-4);
+    EXPECT_GT(left, 0.4);
+    EXPECT_LT(left, 0.5);
 
+    // A point inside the footprint stops it straight away
     obstacle_points->clear_test_points();
-    obstacle_points->add_test_point(tf2::Vector3(0,0,0));
-    left = collision_checker->obstacle_arc_angle(1.0,1.0);
-    right = collision_checker->obstacle_arc_angle(1.0,-1.0);
-    EXPECT_FLOAT_EQ(left, -M_PI/2);
-    EXPECT_FLOAT_EQ(right, M_PI/2);
+    obstacle_points->add_test_point(tf2::Vector3(0, 0, 0));
+    EXPECT_FLOAT_EQ(collision_checker->obstacle_arc_angle(1.0, 1.0), 0.0);
+}
 
-    obstacle_points->clear_test_points();
-    obstacle_points->add_test_point(tf2::Vector3(-1,0,0));
-    left = collision_checker->obstacle_arc_angle(1.0,1.0);
-    right = collision_checker->obstacle_arc_angle(1.0,-1.0);
-    EXPECT_FLOAT_EQ(left, M_PI);
-    EXPECT_FLOAT_EQ(right, M_PI);
-    
-    obstacle_points->clear_test_points();
-    obstacle_points->add_test_point(tf2::Vector3(1,-1,0));
-    left = collision_checker->obstacle_arc_angle(1.0,1.0);
-    right = collision_checker->obstacle_arc_angle(1.0,-1.0);
-    EXPECT_FLOAT_EQ(left, M_PI);
-    EXPECT_FLOAT_EQ(right, 0.0);
+TEST_F(CollisionCheckerTests, arcMatchesSweep) {
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<float> coord(-1.0, 1.0);
+    for (double linear : {0.5, -0.5, 0.05}) {
+        for (double angular : {1.0, -1.0, 0.3}) {
+            for (int i = 0; i < 50; i++) {
+                float x = coord(gen);
+                float y = coord(gen);
+                obstacle_points->clear_test_points();
+                obstacle_points->add_test_point(tf2::Vector3(x, y, 0));
+                EXPECT_NEAR(collision_checker->obstacle_arc_angle(linear, angular),
+                            swept_angle(x, y, linear, angular), 2e-4)
+                    << x << " " << y << " " << linear << " " << angular;
+            }
+        }
+    }
+}
+
+TEST_F(CollisionCheckerTests, arcLines) {
+    // A wall ahead, with its ends far off to the sides
+    ObstacleSnapshot obstacles;
+    obstacles.lines.emplace_back(tf2::Vector3(0.4, -3, 0), tf2::Vector3(0.4, 3, 0));
+    float angle = collision_checker->obstacle_arc_angle(obstacles, 1.0, 1.0);
+
+    // The front left corner reaches the wall first
+    float expected = M_PI;
+    for (float y = -1; y <= 1; y += 0.001) {
+        expected = std::min(expected, swept_angle(0.4, y, 1.0, 1.0));
+    }
+    EXPECT_NEAR(angle, expected, 1e-3);
+
+    // Nothing to hit turning in place
+    EXPECT_FLOAT_EQ(collision_checker->obstacle_arc_angle(obstacles, 0.0, 1.0), M_PI);
+
+    // A line through the footprint
+    obstacles.lines.clear();
+    obstacles.lines.emplace_back(tf2::Vector3(0, -3, 0), tf2::Vector3(0, 3, 0));
+    EXPECT_FLOAT_EQ(collision_checker->obstacle_arc_angle(obstacles, 1.0, 1.0), 0.0);
+}
+
+// Add a sonar reading to a snapshot the way ObstaclePoints does
+static void add_sonar(ObstacleSnapshot& obstacles, int id, double stamp,
+                      const tf2::Vector3& left, const tf2::Vector3& right)
+{
+    size_t i = obstacles.lines.size();
+    obstacles.points.x.insert(obstacles.points.x.begin() + 2 * i, {float(left.x()), float(right.x())});
+    obstacles.points.y.insert(obstacles.points.y.begin() + 2 * i, {float(left.y()), float(right.y())});
+    obstacles.lines.emplace_back(left, right);
+    obstacles.line_sources.push_back(ObstacleSnapshot::Source{id, ros::Time(stamp)});
+}
+
+TEST_F(CollisionCheckerTests, incrementalMatchesFull) {
+    std::shared_ptr<PlanarPoints> scan(new PlanarPoints);
+    scan->push_back(0.6, 0.02);
+    scan->push_back(-0.1, 0.12);
+    scan->push_back(0.05, -0.3);
+    for (size_t i = 0; i < scan->size(); i++) {
+        scan->r_sq.push_back(scan->x[i] * scan->x[i] + scan->y[i] * scan->y[i]);
+    }
+
+    ObstacleSnapshot obstacles;
+    obstacles.lidars.push_back(scan);
+    obstacles.lidar_stamps.push_back(ros::Time(1.0));
+    obstacles.lidar_geometry.push_back(0);
+    add_sonar(obstacles, 0, 1.0, tf2::Vector3(0.4, -0.2, 0), tf2::Vector3(0.5, 0.3, 0));
+    add_sonar(obstacles, 1, 1.0, tf2::Vector3(-0.5, 0.1, 0), tf2::Vector3(-0.4, -0.1, 0));
+    obstacles.points.push_back(0.0, 0.11);
+
+    for (int tick = 0; tick < 4; tick++) {
+        // The same obstacles without their sources are checked in full
+        ObstacleSnapshot full = obstacles;
+        full.lidar_stamps.clear();
+        full.line_sources.clear();
+
+        for (bool forward : {true, false}) {
+            float left, right, full_left, full_right;
+            tf2::Vector3 fl, fr, full_fl, full_fr;
+            float dist = collision_checker->obstacle_dist(obstacles, forward, left, right, fl, fr);
+            float full_dist = collision_checker->obstacle_dist(full, forward, full_left,
+                                                               full_right, full_fl, full_fr);
+            EXPECT_EQ(dist, full_dist) << tick;
+            EXPECT_EQ(left, full_left) << tick;
+            EXPECT_EQ(right, full_right) << tick;
+            EXPECT_EQ(fl, full_fl) << tick;
+            EXPECT_EQ(fr, full_fr) << tick;
+
+            EXPECT_EQ(collision_checker->obstacle_angle(obstacles, forward),
+                      collision_checker->obstacle_angle(full, forward)) << tick;
+        }
+
+        // A new reading from one sonar, or a change to where it is,
+        // replaces its cached minima
+        if (tick % 2) {
+            obstacles.line_sources[1].geometry++;
+        }
+        else {
+            obstacles.line_sources[1].stamp = ros::Time(1.0 + 0.1 * (tick + 1));
+        }
+        obstacles.lines[1].first.px += 0.1;
+        obstacles.lines[1].first.py += 0.05;
+        obstacles.points.x[2] += 0.1;
+        obstacles.points.y[2] += 0.05;
+
+        // and so does a lidar that moved, with the same scan
+        obstacles.lidar_geometry[0]++;
+        scan->x[0] -= 0.05;
+        scan->r_sq[0] = scan->x[0] * scan->x[0] + scan->y[0] * scan->y[0];
+    }
+}
+
+TEST_F(CollisionCheckerTests, obstacleStamp) {
+    ObstacleSnapshot obstacles;
+    obstacles.stamp = ros::Time(5.0);
+    add_sonar(obstacles, 0, 2.0, tf2::Vector3(0.8, -0.1, 0), tf2::Vector3(0.8, 0.1, 0));
+    add_sonar(obstacles, 1, 3.0, tf2::Vector3(0.5, -0.1, 0), tf2::Vector3(0.5, 0.1, 0));
+    add_sonar(obstacles, 2, 4.0, tf2::Vector3(-0.6, -0.1, 0), tf2::Vector3(-0.6, 0.1, 0));
+
+    float left, right;
+    tf2::Vector3 fl, fr;
+    ros::Time stamp;
+    collision_checker->obstacle_dist(obstacles, true, left, right, fl, fr, &stamp);
+    EXPECT_EQ(stamp, ros::Time(3.0));
+    collision_checker->obstacle_dist(obstacles, false, left, right, fl, fr, &stamp);
+    EXPECT_EQ(stamp, ros::Time(4.0));
+
+    // A test point was seen when the snapshot was taken
+    obstacles.points.push_back(0.3, 0);
+    collision_checker->obstacle_dist(obstacles, true, left, right, fl, fr, &stamp);
+    EXPECT_EQ(stamp, ros::Time(5.0));
+
+    ObstacleSnapshot empty;
+    collision_checker->obstacle_dist(empty, true, left, right, fl, fr, &stamp);
+    EXPECT_TRUE(stamp.isZero());
+}
+
+TEST_F(CollisionCheckerTests, rememberedStamp) {
+    nh.setParam("obstacle_memory", 2.0);
+    ObstaclePoints remembering(nh, tf_buffer);
+    nh.deleteParam("obstacle_memory");
+    CollisionChecker checker(nh, tf_buffer, remembering);
+
+    geometry_msgs::TransformStamped sonar_tf, odom_tf;
+    sonar_tf.header.frame_id = odom_tf.header.frame_id = "base_link";
+    sonar_tf.child_frame_id = "stamp_sonar";
+    sonar_tf.transform.rotation.w = 1.0;
+    odom_tf.child_frame_id = "odom";
+    odom_tf.transform.rotation.w = 1.0;
+    tf_buffer.setTransform(sonar_tf, "test", true);
+    tf_buffer.setTransform(odom_tf, "test", true);
+
+    // An echo from a while ago, that the latest ping misses
+    sensor_msgs::Range::Ptr msg(new sensor_msgs::Range());
+    msg->field_of_view = 0.0;
+    msg->min_range = 0.05;
+    msg->max_range = 5;
+    msg->radiation_type = sensor_msgs::Range::ULTRASOUND;
+    msg->header.stamp = ros::Time::now() - ros::Duration(1.5);
+    msg->header.frame_id = "stamp_sonar";
+    msg->range = 1.0;
+    remembering.range_callback(msg);
+    msg->header.stamp = ros::Time::now();
+    msg->range = 5.0;
+    remembering.range_callback(msg);
+
+    // It has been moved to where the robot is now, so it mustn't be
+    // braked for as if it were 1.5 s old
+    ObstacleSnapshot obstacles;
+    checker.get_snapshot(obstacles);
+    float left, right;
+    tf2::Vector3 fl, fr;
+    ros::Time stamp;
+    EXPECT_NEAR(checker.obstacle_dist(obstacles, true, left, right, fl, fr, &stamp),
+                1.0 - 0.09, 1e-4);
+    EXPECT_EQ(stamp, obstacles.stamp);
+}
+
+TEST_F(CollisionCheckerTests, gridBackend) {
+    ObstacleSnapshot obstacles;
+    obstacles.points.push_back(0.53, 0.01);
+    obstacles.points.push_back(-0.1, 0.31);
+    obstacles.points.push_back(0.0, -0.27);
+    obstacles.lines.emplace_back(tf2::Vector3(-0.6, -0.2, 0), tf2::Vector3(-0.6, 0.2, 0));
+
+    ObstacleSnapshot cells = obstacles;
+    cells.grid.reset(0.05, 128);
+    for (size_t i = 0; i < obstacles.points.size(); i++) {
+        cells.grid.mark(obstacles.points.x[i], obstacles.points.y[i]);
+    }
+    const auto& line = obstacles.lines[0];
+    cells.grid.mark_line(line.first.x(), line.first.y(), line.second.x(), line.second.y());
+
+    for (bool forward : {true, false}) {
+        float left, right, cells_left, cells_right;
+        tf2::Vector3 fl, fr;
+        float dist = collision_checker->obstacle_dist(obstacles, forward, left, right, fl, fr);
+        float cells_dist = collision_checker->obstacle_dist(cells, forward, cells_left,
+                                                            cells_right, fl, fr);
+        EXPECT_LE(cells_dist, dist);
+        EXPECT_NEAR(cells_dist, dist, 0.051);
+        EXPECT_LE(cells_left, left);
+        EXPECT_NEAR(cells_left, left, 0.051);
+        EXPECT_LE(cells_right, right);
+        EXPECT_NEAR(cells_right, right, 0.051);
+    }
+
+    // Turning is limited by a cell next to the robot
+    EXPECT_FLOAT_EQ(collision_checker->obstacle_angle(cells, true), M_PI);
+    cells.grid.mark(0.12, 0.05);
+    EXPECT_LT(collision_checker->obstacle_angle(cells, true), M_PI);
+    cells.grid.clear();
+    EXPECT_FLOAT_EQ(collision_checker->obstacle_angle(cells, true), M_PI);
+}
+
+TEST_F(CollisionCheckerTests, polygonFootprint) {
+    // A robot carrying an arm out to its front left
+    const std::string arm = "[[0.3, 0.2], [0.1, 0.2], [-0.19, 0.08], [-0.19, -0.08], [0.09, -0.08]]";
+    nh.setParam("footprint", arm);
+    CollisionChecker checker(nh, tf_buffer, *obstacle_points);
+    nh.setParam("footprint", "[[0, 0], [0.1, 0.1]]");
+    CollisionChecker fallback(nh, tf_buffer, *obstacle_points);
+    nh.deleteParam("footprint");
+
+    std::vector<float> x, y;
+    PolygonFootprint footprint;
+    ASSERT_TRUE(parse_footprint(arm, x, y));
+    ASSERT_TRUE(footprint.set(x, y));
+
+    // Beside the rectangle but in front of the arm
+    ObstacleSnapshot obstacles;
+    obstacles.points.push_back(0.5, 0.15);
+    float left, right;
+    tf2::Vector3 fl, fr;
+    EXPECT_NEAR(checker.obstacle_dist(obstacles, true, left, right, fl, fr),
+                0.5 - (0.09 + 0.21 * 0.23 / 0.28), 1e-5);
+    EXPECT_FLOAT_EQ(fallback.obstacle_dist(obstacles, true, left, right, fl, fr), 10.0 - 0.09);
+
+    // The arm sweeps the left side of the arc
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<float> coord(-1.0, 1.0);
+    for (double angular : {1.0, -1.0}) {
+        for (int i = 0; i < 50; i++) {
+            float px = coord(gen);
+            float py = coord(gen);
+            obstacles.points.x.assign(1, px);
+            obstacles.points.y.assign(1, py);
+
+            const double cy = 0.5 / angular;
+            const double dir = (angular > 0) ? 1.0 : -1.0;
+            float expected = M_PI;
+            for (double theta = 0; theta < M_PI; theta += 1e-4) {
+                double c = std::cos(-dir * theta);
+                double s = std::sin(-dir * theta);
+                if (footprint.inside(c * px - s * (py - cy), s * px + c * (py - cy) + cy)) {
+                    expected = theta;
+                    break;
+                }
+            }
+            EXPECT_NEAR(checker.obstacle_arc_angle(obstacles, 0.5, angular), expected, 2e-4)
+                << px << " " << py << " " << angular;
+        }
+    }
+}
+
+TEST(FootprintKernelTests, matchesScalar) {
+    FootprintBand band;
+    band.width = 0.08;
+    band.front_length = 0.09;
+    band.back_length = 0.19;
+
+    // An odd count so that the left over points are checked too, with
+    // some points exactly on the footprint boundaries
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> coord(-1.0, 1.0);
+    std::vector<float> x, y;
+    for (int i = 0; i < 1003; i++) {
+        x.push_back(coord(gen));
+        y.push_back(coord(gen));
+    }
+    x[5] = band.front_length; y[5] = 0;
+    x[6] = 0.5; y[6] = band.width;
+    x[7] = -band.back_length; y[7] = 0.5;
+    x[8] = 0; y[8] = 0;
+
+    for (size_t n : {0u, 3u, 8u, 17u, 1003u}) {
+        FootprintDistances scalar = {10, 10, 10, 10};
+        FootprintDistances vector = {10, 10, 10, 10};
+        footprint_dist_scalar(x.data(), y.data(), n, band, scalar);
+        footprint_dist(x.data(), y.data(), n, band, vector);
+        EXPECT_EQ(scalar.forward, vector.forward) << footprint_kernel_name() << " " << n;
+        EXPECT_EQ(scalar.back, vector.back) << footprint_kernel_name() << " " << n;
+        EXPECT_EQ(scalar.left, vector.left) << footprint_kernel_name() << " " << n;
+        EXPECT_EQ(scalar.right, vector.right) << footprint_kernel_name() << " " << n;
+    }
 }
 
 int main(int argc, char **argv) {
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <move_basic/footprint.h>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+// The default footprint, and a robot carrying an arm out to its front left
+static const FootprintBand band = {0.08, 0.09, 0.19};
+static const std::vector<float> arm_x = {0.3, 0.1, -0.19, -0.19, 0.09};
+static const std::vector<float> arm_y = {0.2, 0.2, 0.08, -0.08, -0.08};
+
+// Clearance from the point to an edge of the footprint when moved by
+// (dx, dy) in small steps, or none
+static float stepped_dist(const PolygonFootprint& footprint, float x, float y,
+                          float dx, float dy, float none)
+{
+    for (float s = 0; s < none; s += 1e-4) {
+        if (footprint.inside(x - s * dx, y - s * dy)) {
+            return s;
+        }
+    }
+    return none;
+}
+
+TEST(FootprintTests, parse) {
+    std::vector<float> x, y;
+    ASSERT_TRUE(parse_footprint("[[0.2, 0.15], [-0.2, 0.15],[-0.2,-0.15] , [0.2, -0.15]] ", x, y));
+    EXPECT_EQ(x, std::vector<float>({0.2, -0.2, -0.2, 0.2}));
+    EXPECT_EQ(y, std::vector<float>({0.15, 0.15, -0.15, -0.15}));
+
+    EXPECT_FALSE(parse_footprint("", x, y));
+    EXPECT_FALSE(parse_footprint("[[0.2, 0.15], [-0.2, 0.15]]", x, y));
+    EXPECT_FALSE(parse_footprint("[[0.2, 0.15], [-0.2, 0.15], [0, x]]", x, y));
+    EXPECT_FALSE(parse_footprint("[[0.2, 0.15], [-0.2, 0.15], [0, 0]] extra", x, y));
+}
+
+TEST(FootprintTests, convex) {
+    PolygonFootprint footprint;
+    EXPECT_TRUE(footprint.set(arm_x, arm_y));
+
+    // Either way around
+    std::vector<float> x(arm_x.rbegin(), arm_x.rend());
+    std::vector<float> y(arm_y.rbegin(), arm_y.rend());
+    EXPECT_TRUE(footprint.set(x, y));
+    EXPECT_FLOAT_EQ(footprint.bounds().front_length, 0.3);
+    EXPECT_FLOAT_EQ(footprint.bounds().back_length, 0.19);
+    EXPECT_FLOAT_EQ(footprint.bounds().width, 0.2);
+
+    // A notch, a line and a repeated corner aren't
+    EXPECT_FALSE(footprint.set({0.2, 0, -0.2, -0.2, 0.2}, {0.2, 0.05, 0.2, -0.2, -0.2}));
+    EXPECT_FALSE(footprint.set({0, 0.1, 0.2}, {0, 0.1, 0.2}));
+    EXPECT_FALSE(footprint.set({0.2, 0.2, -0.2, 0.2}, {0.2, 0.2, 0, -0.2}));
+    EXPECT_FALSE(footprint.set({0.2, -0.2}, {0.2, -0.2}));
+}
+
+TEST(FootprintTests, rectangleMatches) {
+    // The rectangle as a polygon gives the same answers as the closed form
+    RectangleFootprint rectangle(band);
+    PolygonFootprint polygon;
+    ASSERT_TRUE(polygon.set({0.09, -0.19, -0.19, 0.09}, {0.08, 0.08, -0.08, -0.08}));
+
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<float> coord(-0.5, 0.5);
+    for (int i = 0; i < 1000; i++) {
+        float x = coord(gen);
+        float y = coord(gen);
+        FootprintDistances a = {10, 10, 10, 10};
+        FootprintDistances b = {10, 10, 10, 10};
+        rectangle.points_dist(&x, &y, 1, a);
+        polygon.points_dist(&x, &y, 1, b);
+        EXPECT_NEAR(a.forward, b.forward, 1e-5) << x << " " << y;
+        EXPECT_NEAR(a.back, b.back, 1e-5) << x << " " << y;
+        EXPECT_NEAR(a.left, b.left, 1e-5) << x << " " << y;
+        EXPECT_NEAR(a.right, b.right, 1e-5) << x << " " << y;
+        EXPECT_EQ(rectangle.inside(x, y), polygon.inside(x, y)) << x << " " << y;
+
+        for (bool left : {true, false}) {
+            float angle_a = M_PI, angle_b = M_PI;
+            rectangle.rotation(x, y, x*x + y*y, left, angle_a);
+            polygon.rotation(x, y, x*x + y*y, left, angle_b);
+            EXPECT_NEAR(angle_a, angle_b, 1e-4) << x << " " << y;
+        }
+    }
+}
+
+TEST(FootprintTests, polygonDist) {
+    PolygonFootprint footprint;
+    ASSERT_TRUE(footprint.set(arm_x, arm_y));
+    const FootprintBand& bounds = footprint.bounds();
+
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<float> coord(-0.6, 0.6);
+    for (int i = 0; i < 200; i++) {
+        float x = coord(gen);
+        float y = coord(gen);
+        if (footprint.inside(x, y)) {
+            continue;
+        }
+        FootprintDistances dist = {10, 10, 10, 10};
+        footprint.points_dist(&x, &y, 1, dist);
+        EXPECT_NEAR(dist.forward - bounds.front_length,
+                    stepped_dist(footprint, x, y, 1, 0, 10 - bounds.front_length), 2e-4)
+            << x << " " << y;
+        EXPECT_NEAR(dist.back - bounds.back_length,
+                    stepped_dist(footprint, x, y, -1, 0, 10 - bounds.back_length), 2e-4)
+            << x << " " << y;
+        float up = stepped_dist(footprint, x, y, 0, 1, 10 - bounds.width);
+        float down = stepped_dist(footprint, x, y, 0, -1, 10 - bounds.width);
+        if (up < 10 - bounds.width) {
+            EXPECT_NEAR(dist.left - bounds.width, up, 2e-4) << x << " " << y;
+        }
+        if (down < 10 - bounds.width) {
+            EXPECT_NEAR(dist.right - bounds.width, down, 2e-4) << x << " " << y;
+        }
+    }
+
+    // A line is as close as the closest point along it
+    std::uniform_real_distribution<float> far(0.35, 1.0);
+    for (int i = 0; i < 100; i++) {
+        float x0 = far(gen), y0 = coord(gen);
+        float x1 = far(gen), y1 = coord(gen);
+        FootprintDistances line = {10, 10, 10, 10};
+        FootprintDistances points = {10, 10, 10, 10};
+        footprint.line_dist(x0, y0, x1, y1, line);
+        for (float t = 0; t <= 1; t += 1e-4) {
+            float x = x0 + t * (x1 - x0);
+            float y = y0 + t * (y1 - y0);
+            footprint.points_dist(&x, &y, 1, points);
+        }
+        EXPECT_NEAR(line.forward, points.forward, 1e-3) << x0 << " " << y0 << " " << x1 << " " << y1;
+        EXPECT_LE(line.forward, points.forward);
+    }
+}
+
+TEST(FootprintTests, polygonRotation) {
+    PolygonFootprint footprint;
+    ASSERT_TRUE(footprint.set(arm_x, arm_y));
+
+    std::mt19937 gen(9);
+    std::uniform_real_distribution<float> coord(-0.45, 0.45);
+    for (int i = 0; i < 100; i++) {
+        float x = coord(gen);
+        float y = coord(gen);
+        if (footprint.inside(x, y)) {
+            continue;
+        }
+        for (bool left : {true, false}) {
+            float angle = M_PI;
+            footprint.rotation(x, y, x*x + y*y, left, angle);
+
+            // The obstacle turns the other way relative to the robot
+            float expected = M_PI;
+            const float dir = left ? -1 : 1;
+            for (float theta = 0; theta < M_PI; theta += 1e-4) {
+                float c = std::cos(dir * theta);
+                float s = std::sin(dir * theta);
+                if (footprint.inside(c * x - s * y, s * x + c * y)) {
+                    expected = theta;
+                    break;
+                }
+            }
+            EXPECT_NEAR(angle, expected, 2e-4) << x << " " << y << " " << left;
+        }
+    }
+}
+
+TEST(FootprintTests, polygonGrid) {
+    PolygonFootprint footprint;
+    ASSERT_TRUE(footprint.set(arm_x, arm_y));
+
+    ObstacleGrid grid;
+    grid.reset(0.01, 128);
+    grid.mark(0.5, 0.15);
+    grid.mark(0.0, -0.3);
+
+    FootprintDistances cells = {10, 10, 10, 10};
+    footprint.grid_dist(grid, cells);
+    float x[] = {grid.cell_center(grid.index_of(0.5)), grid.cell_center(grid.index_of(0.0))};
+    float y[] = {grid.cell_center(grid.index_of(0.15)), grid.cell_center(grid.index_of(-0.3))};
+    FootprintDistances points = {10, 10, 10, 10};
+    footprint.points_dist(x, y, 2, points);
+    EXPECT_FLOAT_EQ(cells.forward, points.forward);
+    EXPECT_FLOAT_EQ(cells.right, points.right);
+    EXPECT_FLOAT_EQ(cells.back, 10);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
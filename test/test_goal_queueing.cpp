@@ -271,6 +271,87 @@ TEST_F(GoalQueueSuite, goalCancelling) {
 	finishExecuting(); // Finish the cancelled goal
 }
 
+TEST_F(GoalQueueSuite, acceptLatency) {
+	move_base_msgs::MoveBaseGoal goal;
+	goal.target_pose.pose.position.x = 3.0;
+	cli->sendGoal(goal);
+	ros::spinOnce();
+	sleepExecuting();
+	EXPECT_TRUE(got_goal);
+
+	// Goals are dispatched when they arrive, not on a polling period
+	EXPECT_LT(qserv->lastAcceptLatency().toSec(), 0.05);
+	finishExecuting();
+}
+
+TEST_F(GoalQueueSuite, queuedGoalsInOrder) {
+	move_base_msgs::MoveBaseGoal goal;
+	qserv->setQueueDepth(3);
+
+	goal.target_pose.pose.position.x = 3.0;
+	cli->sendGoal(goal);
+	ros::spinOnce();
+	sleepExecuting();
+	ASSERT_TRUE(got_goal);
+	ASSERT_EQ(3.0, received_goal->target_pose.pose.position.x);
+
+	// Both goals wait behind the first, neither bumps the other
+	goal.target_pose.pose.position.x = 7.0;
+	cli->sendGoal(goal);
+	goal.target_pose.pose.position.x = 13.0;
+	cli->sendGoal(goal);
+	ros::Duration(1.0).sleep();
+	ros::spinOnce();
+	EXPECT_EQ(2u, qserv->pendingGoals());
+
+	finishExecuting(); // Finish 1st goal
+	sleepExecuting();
+	EXPECT_FALSE(goal_preempted);
+	EXPECT_TRUE(next_goal_available);
+	EXPECT_EQ(7.0, received_goal->target_pose.pose.position.x);
+
+	finishExecuting(); // Finish 2nd goal
+	sleepExecuting();
+	EXPECT_FALSE(goal_preempted);
+	EXPECT_FALSE(next_goal_available);
+	EXPECT_EQ(13.0, received_goal->target_pose.pose.position.x);
+	finishExecuting();
+}
+
+TEST_F(GoalQueueSuite, cancelQueuedGoal) {
+	move_base_msgs::MoveBaseGoal goal;
+	qserv->setQueueDepth(3);
+
+	goal.target_pose.pose.position.x = 3.0;
+	cli->sendGoal(goal);
+	ros::spinOnce();
+	sleepExecuting();
+	ASSERT_TRUE(got_goal);
+
+	goal.target_pose.pose.position.x = 7.0;
+	cli->sendGoal(goal);
+	goal.target_pose.pose.position.x = 13.0;
+	cli->sendGoal(goal);
+	ros::Duration(1.0).sleep();
+	ros::spinOnce();
+
+	// Cancelling the last goal only removes it from the queue
+	cli->cancelGoal();
+	ros::Duration(1.0).sleep();
+	ros::spinOnce();
+	EXPECT_EQ(1u, qserv->pendingGoals());
+	EXPECT_EQ(actionlib::SimpleClientGoalState::RECALLED, cli->getState().state_);
+	EXPECT_EQ(3.0, received_goal->target_pose.pose.position.x);
+
+	finishExecuting(); // Finish 1st goal
+	sleepExecuting();
+	EXPECT_FALSE(goal_preempted);
+	EXPECT_EQ(7.0, received_goal->target_pose.pose.position.x);
+	finishExecuting();
+	ros::Duration(0.5).sleep();
+	EXPECT_EQ(0u, qserv->pendingGoals());
+}
+
 // Two more TEST_F missing
 
 int main(int argc, char **argv) {
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <move_basic/latency_trace.h>
+
+#include <sstream>
+#include <string>
+
+static LatencyTrace::Cycle make_cycle(double sensor, double step)
+{
+    LatencyTrace::Cycle cycle;
+    for (int k = 0; k < LatencyTrace::NUM_STAGES; k++) {
+        cycle.time[k] = sensor + k * step;
+    }
+    return cycle;
+}
+
+TEST(LatencyTraceTests, disabled) {
+    LatencyTrace trace;
+    trace.record_callback(1.0, 1.1);
+    trace.record_cycle(make_cycle(1.0, 0.01));
+    LatencyTrace::Summary summary = trace.summarize();
+    EXPECT_EQ(summary.callback.count, 0u);
+    EXPECT_EQ(summary.end_to_end.count, 0u);
+}
+
+TEST(LatencyTraceTests, percentiles) {
+    LatencyTrace trace(100);
+    trace.enable(true);
+    for (int i = 1; i <= 100; i++) {
+        trace.record_callback(10.0, 10.0 + 0.001 * i);
+    }
+    LatencyTrace::Summary summary = trace.summarize();
+    EXPECT_EQ(summary.callback.count, 100u);
+    EXPECT_NEAR(summary.callback.p50, 0.051, 1e-9);
+    EXPECT_NEAR(summary.callback.p90, 0.091, 1e-9);
+    EXPECT_NEAR(summary.callback.p99, 0.1, 1e-9);
+    EXPECT_NEAR(summary.callback.max, 0.1, 1e-9);
+
+    // The buffer keeps the latest, so the slow ones are pushed out
+    for (int i = 0; i < 100; i++) {
+        trace.record_callback(20.0, 20.002);
+    }
+    summary = trace.summarize();
+    EXPECT_EQ(summary.callback.count, 100u);
+    EXPECT_NEAR(summary.callback.max, 0.002, 1e-9);
+}
+
+TEST(LatencyTraceTests, stages) {
+    LatencyTrace trace;
+    trace.enable(true);
+    trace.record_cycle(make_cycle(5.0, 0.01));
+
+    // A command without sensor readings behind it only counts from its
+    // snapshot on
+    LatencyTrace::Cycle partial = make_cycle(6.0, 0.02);
+    partial.time[LatencyTrace::SENSOR] = 0;
+    trace.record_cycle(partial);
+
+    LatencyTrace::Summary summary = trace.summarize();
+    EXPECT_EQ(summary.interval[LatencyTrace::SENSOR].count, 1u);
+    EXPECT_NEAR(summary.interval[LatencyTrace::SENSOR].max, 0.01, 1e-9);
+    EXPECT_EQ(summary.interval[LatencyTrace::QUERY_END].count, 2u);
+    EXPECT_NEAR(summary.interval[LatencyTrace::QUERY_END].max, 0.02, 1e-9);
+    EXPECT_EQ(summary.end_to_end.count, 1u);
+    EXPECT_NEAR(summary.end_to_end.max, 0.04, 1e-9);
+}
+
+TEST(LatencyTraceTests, chromeTrace) {
+    LatencyTrace trace;
+    trace.enable(true);
+    trace.record_callback(1.0, 1.005);
+    trace.record_cycle(make_cycle(1.0, 0.01));
+
+    std::ostringstream out;
+    trace.write_chrome_trace(out);
+    std::string json = out.str();
+    EXPECT_NE(json.find("\"traceEvents\""), std::string::npos);
+    EXPECT_NE(json.find("\"name\":\"callback\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                        "\"ts\":1000000.0,\"dur\":5000.0"), std::string::npos);
+    EXPECT_NE(json.find("\"name\":\"command\""), std::string::npos);
+    EXPECT_EQ(json.find("\"name\":\"sensor\""), std::string::npos);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <move_basic/loop_stats.h>
+
+#include <chrono>
+#include <thread>
+
+TEST(LoopStatsTests, empty) {
+    LoopStats stats;
+    stats.start(0.02);
+    LoopStats::Summary summary = stats.take();
+    EXPECT_EQ(summary.period, 0.02);
+    EXPECT_EQ(summary.iterations, 0u);
+    EXPECT_EQ(summary.overruns, 0u);
+    EXPECT_EQ(summary.mean_duration, 0);
+    EXPECT_EQ(summary.mean_jitter, 0);
+}
+
+TEST(LoopStatsTests, overruns) {
+    LoopStats stats;
+    stats.start(0.01);
+    for (double duration : {0.001, 0.004, 0.006, 0.009, 0.012, 0.03}) {
+        stats.record(duration);
+    }
+    LoopStats::Summary summary = stats.take();
+    EXPECT_EQ(summary.iterations, 6u);
+    EXPECT_EQ(summary.overruns, 2u);
+    EXPECT_EQ(summary.total_overruns, 2u);
+    EXPECT_NEAR(summary.mean_duration, 0.062 / 6, 1e-9);
+    EXPECT_EQ(summary.max_duration, 0.03);
+    for (size_t k = 0; k < LoopStats::NUM_BUCKETS; k++) {
+        EXPECT_EQ(summary.histogram[k], 1u) << k;
+    }
+
+    // A new window, the total carries on
+    stats.record(0.02);
+    summary = stats.take();
+    EXPECT_EQ(summary.iterations, 1u);
+    EXPECT_EQ(summary.overruns, 1u);
+    EXPECT_EQ(summary.total_overruns, 3u);
+}
+
+TEST(LoopStatsTests, jitter) {
+    LoopStats stats;
+    stats.start(0.01);
+    for (int i = 0; i < 5; i++) {
+        stats.record(0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    }
+    LoopStats::Summary summary = stats.take();
+    // four intervals of 30 ms, each 20 ms late
+    EXPECT_GT(summary.mean_jitter, 0.015);
+    EXPECT_GE(summary.max_jitter, summary.mean_jitter);
+
+    // A restart doesn't count the gap
+    stats.start(0.01);
+    stats.record(0);
+    summary = stats.take();
+    EXPECT_EQ(summary.mean_jitter, 0);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <move_basic/obstacle_grid.h>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+TEST(ObstacleGridTests, disabled) {
+    ObstacleGrid grid;
+    EXPECT_FALSE(grid.enabled());
+
+    FootprintBand band = {0.08, 0.09, 0.19};
+    FootprintDistances dist = {10, 10, 10, 10};
+    grid.footprint_dist(band, dist);
+    EXPECT_EQ(dist.forward, 10);
+    EXPECT_EQ(dist.left, 10);
+}
+
+TEST(ObstacleGridTests, mark) {
+    ObstacleGrid grid;
+    grid.reset(0.05, 100);
+    // rounded up to a whole number of words
+    EXPECT_EQ(grid.size(), 128);
+
+    grid.mark(0.01, 0.01);
+    grid.mark(-0.01, -0.01);
+    grid.mark(3.0, -2.0);
+    grid.mark(10.0, 0);  // off the grid
+
+    EXPECT_TRUE(grid.occupied(grid.index_of(0.01), grid.index_of(0.01)));
+    EXPECT_TRUE(grid.occupied(grid.index_of(-0.01), grid.index_of(-0.01)));
+    EXPECT_TRUE(grid.occupied(grid.index_of(3.0), grid.index_of(-2.0)));
+    EXPECT_FALSE(grid.occupied(grid.index_of(0.01), grid.index_of(-0.01)));
+    EXPECT_EQ(grid.index_of(0.01), 64);
+    EXPECT_EQ(grid.index_of(-0.01), 63);
+
+    int count = 0;
+    grid.for_each_cell(-4, 4, -4, 4, [&](float, float) { count++; });
+    EXPECT_EQ(count, 3);
+
+    grid.clear();
+    count = 0;
+    grid.for_each_cell(-4, 4, -4, 4, [&](float, float) { count++; });
+    EXPECT_EQ(count, 0);
+}
+
+TEST(ObstacleGridTests, markLine) {
+    ObstacleGrid grid;
+    grid.reset(0.05, 128);
+    grid.mark_line(0.5, -1.0, 0.5, 1.0);
+    int col = grid.index_of(0.5);
+    for (int row = grid.index_of(-1.0); row <= grid.index_of(1.0); row++) {
+        EXPECT_TRUE(grid.occupied(col, row)) << row;
+    }
+    EXPECT_FALSE(grid.occupied(col, grid.index_of(1.1)));
+
+    // A bogus segment is ignored
+    grid.mark_line(0, 0, INFINITY, 0);
+    grid.mark_line(0, 0, 1e30, 0);
+}
+
+TEST(ObstacleGridTests, bogusCoordinates) {
+    ObstacleGrid grid;
+    grid.reset(0.05, 128);
+    EXPECT_EQ(grid.index_of(NAN), -1);
+    EXPECT_EQ(grid.index_of(INFINITY), 128);
+    EXPECT_EQ(grid.index_of(-INFINITY), -1);
+    EXPECT_EQ(grid.index_of(1e30), 128);
+    EXPECT_EQ(grid.index_of(-1e30), -1);
+
+    grid.mark(NAN, 0);
+    grid.mark(1e30, -1e30);
+    grid.mark(0, INFINITY);
+    int count = 0;
+    grid.for_each_cell(-INFINITY, INFINITY, -1e30, NAN, [&](float, float) { count++; });
+    grid.for_each_cell(-4, 4, -4, 4, [&](float, float) { count++; });
+    EXPECT_EQ(count, 0);
+}
+
+TEST(ObstacleGridTests, matchesPoints) {
+    const float resolution = 0.05;
+    FootprintBand band = {0.08, 0.09, 0.19};
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<float> coord(-3.0, 3.0);
+
+    for (int trial = 0; trial < 50; trial++) {
+        std::vector<float> x, y;
+        ObstacleGrid grid;
+        grid.reset(resolution, 128);
+        for (int i = 0; i < 20; i++) {
+            x.push_back(coord(gen));
+            y.push_back(coord(gen));
+            grid.mark(x.back(), y.back());
+        }
+
+        FootprintDistances exact = {10, 10, 10, 10};
+        FootprintDistances cells = {10, 10, 10, 10};
+        footprint_dist_scalar(x.data(), y.data(), x.size(), band, exact);
+        grid.footprint_dist(band, cells);
+
+        // Never further than the points
+        EXPECT_LE(cells.forward, exact.forward);
+        EXPECT_LE(cells.back, exact.back);
+        EXPECT_LE(cells.left, exact.left);
+        EXPECT_LE(cells.right, exact.right);
+        if (exact.forward < 10) {
+            EXPECT_GT(cells.forward, band.front_length - 1e-6);
+        }
+        EXPECT_GE(cells.left, 0);
+        EXPECT_GE(cells.right, 0);
+    }
+}
+
+TEST(ObstacleGridTests, withinOneCell) {
+    const float resolution = 0.05;
+    FootprintBand band = {0.08, 0.09, 0.19};
+    ObstacleGrid grid;
+    grid.reset(resolution, 128);
+
+    // One point on each side
+    const float x[] = {1.03, -0.72, 0.0, 0.01};
+    const float y[] = {0.02, -0.05, 0.61, -0.43};
+    for (int i = 0; i < 4; i++) {
+        grid.mark(x[i], y[i]);
+    }
+    FootprintDistances exact = {10, 10, 10, 10};
+    FootprintDistances cells = {10, 10, 10, 10};
+    footprint_dist_scalar(x, y, 4, band, exact);
+    grid.footprint_dist(band, cells);
+
+    EXPECT_NEAR(cells.forward, exact.forward, resolution);
+    EXPECT_NEAR(cells.back, exact.back, resolution);
+    EXPECT_NEAR(cells.left, exact.left, resolution);
+    EXPECT_NEAR(cells.right, exact.right, resolution);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <move_basic/obstacle_memory.h>
+
+#include <vector>
+
+static ObstacleMemory::Segment segment(float x)
+{
+    ObstacleMemory::Segment s = {x, 0, x, 1};
+    return s;
+}
+
+static std::vector<float> held(const ObstacleMemory& memory)
+{
+    std::vector<float> xs;
+    memory.for_each([&xs](const ObstacleMemory::Segment& s, double) {
+        xs.push_back(s.x0);
+    });
+    return xs;
+}
+
+TEST(ObstacleMemoryTests, disabled) {
+    ObstacleMemory memory;
+    EXPECT_FALSE(memory.enabled());
+    EXPECT_FALSE(memory.add(segment(1), 10.0));
+    EXPECT_EQ(memory.size(), 0u);
+}
+
+TEST(ObstacleMemoryTests, expiry) {
+    // Buckets of 0.1s
+    ObstacleMemory memory;
+    memory.reset(0.8, 80);
+    for (int i = 0; i < 8; i++) {
+        ASSERT_TRUE(memory.add(segment(i), 10.05 + 0.1 * i));
+    }
+    EXPECT_EQ(memory.size(), 8u);
+
+    // Newest first, each with when its bucket began
+    std::vector<double> starts;
+    memory.for_each([&starts](const ObstacleMemory::Segment&, double start) {
+        starts.push_back(start);
+    });
+    ASSERT_EQ(starts.size(), 8u);
+    EXPECT_NEAR(starts[0], 10.7, 1e-9);
+    EXPECT_NEAR(starts[7], 10.0, 1e-9);
+
+    // Ageing drops whole buckets
+    memory.expire(10.85);
+    EXPECT_EQ(held(memory), (std::vector<float>{7, 6, 5, 4, 3, 2, 1}));
+    memory.expire(11.25);
+    EXPECT_EQ(held(memory), (std::vector<float>{7, 6, 5}));
+    memory.expire(20.0);
+    EXPECT_EQ(memory.size(), 0u);
+}
+
+TEST(ObstacleMemoryTests, lateAndFull) {
+    ObstacleMemory memory;
+    memory.reset(0.8, 16);
+    ASSERT_TRUE(memory.add(segment(0), 10.05));
+    ASSERT_TRUE(memory.add(segment(1), 10.35));
+
+    // A late segment still goes in by its age, unless it is too old
+    ASSERT_TRUE(memory.add(segment(2), 10.15));
+    ASSERT_FALSE(memory.add(segment(3), 9.0));
+    EXPECT_EQ(held(memory), (std::vector<float>{1, 2, 0}));
+
+    // Each bucket holds a fixed share of the budget
+    ASSERT_TRUE(memory.add(segment(4), 10.36));
+    ASSERT_FALSE(memory.add(segment(5), 10.37));
+    EXPECT_EQ(memory.size(), 4u);
+    EXPECT_EQ(memory.dropped(), 2u);
+}
+
+int main(int argc, char **argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
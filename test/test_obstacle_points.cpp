@@ -37,7 +37,11 @@
 #include <tf2_ros/transform_listener.h>
 #include <tf2_ros/transform_broadcaster.h>
 #include <sensor_msgs/Range.h>
+#include <sensor_msgs/LaserScan.h>
+#include <geometry_msgs/TransformStamped.h>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "move_basic/obstacle_points.h"
 
@@ -99,6 +103,295 @@ TEST_F(ObstaclePointsTests, testPoints) {
     ASSERT_EQ(lines.size(), 0u);
 }
 
+TEST_F(ObstaclePointsTests, snapshot) {
+    ObstacleSnapshot snapshot;
+    uint64_t updates = obstacle_points->update_count();
+    obstacle_points->add_test_point(tf2::Vector3(1.0,0.0,0.0));
+    obstacle_points->add_test_point(tf2::Vector3(2.0,0.0,0.0));
+    ASSERT_EQ(obstacle_points->update_count(), updates + 2);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_THAT(snapshot.points.x, ElementsAre(1.0, 2.0));
+    ASSERT_THAT(snapshot.points.y, ElementsAre(0.0, 0.0));
+    ASSERT_EQ(snapshot.lines.size(), 0u);
+
+    // Taking a snapshot is not an update
+    ASSERT_EQ(obstacle_points->update_count(), updates + 2);
+
+    // Refreshing the snapshot replaces the previous contents
+    obstacle_points->clear_test_points();
+    obstacle_points->add_test_point(tf2::Vector3(3.0,0.0,0.0));
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_THAT(snapshot.points.x, ElementsAre(3.0));
+    ASSERT_THAT(snapshot.points.y, ElementsAre(0.0));
+    obstacle_points->clear_test_points();
+}
+
+TEST_F(ObstaclePointsTests, scanCompaction) {
+    sensor_msgs::LaserScan::Ptr msg(new sensor_msgs::LaserScan());
+    msg->header.stamp = ros::Time::now();
+    msg->header.frame_id = "base_link";
+    msg->angle_min = 0;
+    msg->angle_increment = M_PI / 4;
+    msg->angle_max = M_PI;
+    msg->range_min = 0.05;
+    msg->range_max = 10;
+    msg->ranges = {1.0, NAN, INFINITY, 0.01, 2.0};
+    obstacle_points->scan_callback(msg);
+
+    // Only the valid samples make it into the snapshot
+    ObstacleSnapshot snapshot;
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lidars.size(), 1u);
+    ASSERT_EQ(snapshot.lidars[0]->size(), 2u);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 1.0, 0.001);
+    ASSERT_NEAR(snapshot.lidars[0]->y[0], 0.0, 0.001);
+    ASSERT_NEAR(snapshot.lidars[0]->x[1], -2.0, 0.001);
+    ASSERT_NEAR(snapshot.lidars[0]->y[1], 0.0, 0.001);
+    ASSERT_EQ(snapshot.points.size(), 0u);
+
+    // The points are indexed by their distance from base_link
+    size_t begin, end;
+    snapshot.lidars[0]->radius_range(0.0, 1.5 * 1.5, begin, end);
+    ASSERT_EQ(begin, 0u);
+    ASSERT_EQ(end, 1u);
+    snapshot.lidars[0]->radius_range(1.9 * 1.9, 2.1 * 2.1, begin, end);
+    ASSERT_EQ(begin, 1u);
+    ASSERT_EQ(end, 2u);
+}
+
+TEST_F(ObstaclePointsTests, twoLidars) {
+    // Front lidar facing forward, rear lidar facing backward
+    geometry_msgs::TransformStamped front_tf, rear_tf;
+    front_tf.header.frame_id = rear_tf.header.frame_id = "base_link";
+    front_tf.child_frame_id = "front_laser";
+    front_tf.transform.translation.x = 0.2;
+    front_tf.transform.rotation.w = 1.0;
+    rear_tf.child_frame_id = "rear_laser";
+    rear_tf.transform.translation.x = -0.2;
+    rear_tf.transform.rotation.z = 1.0;
+    rear_tf.transform.rotation.w = 0.0;
+    tf_buffer.setTransform(front_tf, "test", true);
+    tf_buffer.setTransform(rear_tf, "test", true);
+
+    sensor_msgs::LaserScan::Ptr front(new sensor_msgs::LaserScan());
+    front->header.stamp = ros::Time::now();
+    front->header.frame_id = "front_laser";
+    front->angle_min = 0;
+    front->angle_increment = M_PI / 2;
+    front->range_min = 0.05;
+    front->range_max = 10;
+    front->ranges = {1.0};
+    sensor_msgs::LaserScan::Ptr rear(new sensor_msgs::LaserScan(*front));
+    rear->header.frame_id = "rear_laser";
+    rear->ranges = {2.0, 3.0};
+
+    obstacle_points->scan_callback(front);
+    obstacle_points->scan_callback(rear);
+
+    // Each lidar uses its own transform and look up tables
+    ObstacleSnapshot snapshot;
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lidars.size(), 2u);
+    ASSERT_EQ(snapshot.lidars[0]->size(), 1u);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 1.2, 0.001);
+    ASSERT_NEAR(snapshot.lidars[0]->y[0], 0.0, 0.001);
+    ASSERT_EQ(snapshot.lidars[1]->size(), 2u);
+    ASSERT_NEAR(snapshot.lidars[1]->x[0], -2.2, 0.001);
+    ASSERT_NEAR(snapshot.lidars[1]->y[0], 0.0, 0.001);
+    ASSERT_NEAR(snapshot.lidars[1]->x[1], -0.2, 0.001);
+    ASSERT_NEAR(snapshot.lidars[1]->y[1], -3.0, 0.001);
+
+    // A new scan from one lidar leaves the other alone
+    front->ranges = {0.5};
+    obstacle_points->scan_callback(front);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 0.7, 0.001);
+    ASSERT_EQ(snapshot.lidars[1]->size(), 2u);
+}
+
+TEST_F(ObstaclePointsTests, staticTfChange) {
+    geometry_msgs::TransformStamped laser_tf;
+    laser_tf.header.frame_id = "base_link";
+    laser_tf.child_frame_id = "moving_laser";
+    laser_tf.transform.translation.x = 0.2;
+    laser_tf.transform.rotation.w = 1.0;
+    tf_buffer.setTransform(laser_tf, "test", true);
+
+    sensor_msgs::LaserScan::Ptr scan(new sensor_msgs::LaserScan());
+    scan->header.stamp = ros::Time::now();
+    scan->header.frame_id = "moving_laser";
+    scan->angle_min = 0;
+    scan->angle_increment = M_PI / 2;
+    scan->range_min = 0.05;
+    scan->range_max = 10;
+    scan->ranges = {1.0};
+    obstacle_points->scan_callback(scan);
+
+    // The sensor transform is only resolved again after /tf_static changes
+    laser_tf.transform.translation.x = 0.5;
+    tf_buffer.setTransform(laser_tf, "test", true);
+    obstacle_points->scan_callback(scan);
+
+    ObstacleSnapshot snapshot;
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lidars.size(), 1u);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 1.2, 0.001);
+    uint32_t geometry = snapshot.lidar_geometry[0];
+
+    // Static transforms of other frames leave the lidar where it was
+    geometry_msgs::TransformStamped other_tf(laser_tf);
+    other_tf.child_frame_id = "other_frame";
+    tf2_msgs::TFMessage::Ptr tf_static(new tf2_msgs::TFMessage());
+    tf_static->transforms.push_back(other_tf);
+    obstacle_points->tf_static_callback(tf_static);
+    obstacle_points->scan_callback(scan);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 1.2, 0.001);
+    ASSERT_EQ(snapshot.lidar_geometry[0], geometry);
+
+    tf_static->transforms.push_back(laser_tf);
+    obstacle_points->tf_static_callback(tf_static);
+    obstacle_points->scan_callback(scan);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lidars.size(), 1u);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 1.5, 0.001);
+    ASSERT_NE(snapshot.lidar_geometry[0], geometry);
+}
+
+TEST_F(ObstaclePointsTests, staticTfBeforeBuffer) {
+    geometry_msgs::TransformStamped laser_tf;
+    laser_tf.header.frame_id = "base_link";
+    laser_tf.child_frame_id = "late_laser";
+    laser_tf.transform.translation.x = 0.2;
+    laser_tf.transform.rotation.w = 1.0;
+    tf_buffer.setTransform(laser_tf, "test", true);
+
+    sensor_msgs::LaserScan::Ptr scan(new sensor_msgs::LaserScan());
+    scan->header.stamp = ros::Time::now();
+    scan->header.frame_id = "late_laser";
+    scan->angle_min = 0;
+    scan->angle_increment = M_PI / 2;
+    scan->range_min = 0.05;
+    scan->range_max = 10;
+    scan->ranges = {1.0};
+    obstacle_points->scan_callback(scan);
+
+    // The callback can run before the listener has updated the buffer
+    laser_tf.transform.translation.x = 0.5;
+    tf2_msgs::TFMessage::Ptr tf_static(new tf2_msgs::TFMessage());
+    tf_static->transforms.push_back(laser_tf);
+    obstacle_points->tf_static_callback(tf_static);
+    obstacle_points->scan_callback(scan);
+
+    ObstacleSnapshot snapshot;
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 1.2, 0.001);
+    uint32_t geometry = snapshot.lidar_geometry[0];
+
+    // The lidar stays stale until the buffer has the new transform
+    tf_buffer.setTransform(laser_tf, "test", true);
+    obstacle_points->scan_callback(scan);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_NEAR(snapshot.lidars[0]->x[0], 1.5, 0.001);
+    ASSERT_NE(snapshot.lidar_geometry[0], geometry);
+
+    // The same for a sonar
+    geometry_msgs::TransformStamped sonar_tf(laser_tf);
+    sonar_tf.child_frame_id = "late_sonar";
+    tf_buffer.setTransform(sonar_tf, "test", true);
+    sensor_msgs::Range::Ptr range(new sensor_msgs::Range());
+    range->field_of_view = 0.0;
+    range->min_range = 0.05;
+    range->max_range = 10;
+    range->radiation_type = sensor_msgs::Range::ULTRASOUND;
+    range->header.stamp = ros::Time::now();
+    range->header.frame_id = "late_sonar";
+    range->range = 1.0;
+    obstacle_points->range_callback(range);
+
+    sonar_tf.transform.translation.x = 0.7;
+    tf_static->transforms.assign(1, sonar_tf);
+    obstacle_points->tf_static_callback(tf_static);
+    obstacle_points->range_callback(range);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 1u);
+    ASSERT_NEAR(snapshot.lines[0].first.x(), 1.5, 0.001);
+
+    tf_buffer.setTransform(sonar_tf, "test", true);
+    obstacle_points->range_callback(range);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_NEAR(snapshot.lines[0].first.x(), 1.7, 0.001);
+}
+
+TEST_F(ObstaclePointsTests, heldScanUnchanged) {
+    sensor_msgs::LaserScan::Ptr scan(new sensor_msgs::LaserScan());
+    scan->header.stamp = ros::Time::now();
+    scan->header.frame_id = "base_link";
+    scan->angle_min = 0;
+    scan->angle_increment = M_PI / 2;
+    scan->range_min = 0.05;
+    scan->range_max = 10;
+    scan->ranges = {1.0};
+    obstacle_points->scan_callback(scan);
+
+    ObstacleSnapshot held;
+    obstacle_points->get_snapshot(ros::Duration(10), held);
+    ASSERT_EQ(held.lidars.size(), 1u);
+    ASSERT_NEAR(held.lidars[0]->x[0], 1.0, 0.001);
+
+    // Newer scans go into other buffers while one is held
+    for (float range : {2.0, 3.0, 4.0}) {
+        scan->ranges = {range};
+        obstacle_points->scan_callback(scan);
+    }
+    ObstacleSnapshot latest;
+    obstacle_points->get_snapshot(ros::Duration(10), latest);
+    ASSERT_NEAR(latest.lidars[0]->x[0], 4.0, 0.001);
+    ASSERT_NEAR(held.lidars[0]->x[0], 1.0, 0.001);
+    ASSERT_NE(held.lidars[0], latest.lidars[0]);
+}
+
+TEST_F(ObstaclePointsTests, scanPool) {
+    sensor_msgs::LaserScan scan;
+    scan.header.frame_id = "pool_laser";
+    scan.angle_min = 0;
+    scan.angle_increment = M_PI / 2;
+    scan.range_min = 0.05;
+    scan.range_max = 10;
+
+    // Too few buffers are rounded up
+    LidarSensor small(0, "pool_laser", tf2::Vector3(0, 0, 0), tf2::Vector3(1, 0, 0),
+                      ScanRoi(), 1);
+    ASSERT_EQ(small.scan_buffers(), LidarSensor::MIN_SCAN_BUFFERS);
+
+    const size_t buffers = 4;
+    std::unique_ptr<LidarSensor> lidar(new LidarSensor(0, "pool_laser",
+        tf2::Vector3(0, 0, 0), tf2::Vector3(1, 0, 0), ScanRoi(), buffers));
+    ASSERT_EQ(lidar->scan_buffers(), buffers);
+    std::vector<std::shared_ptr<const ScanPoints>> held;
+    for (size_t i = 0; i < buffers; i++) {
+        scan.ranges = {1.0f + i};
+        lidar->update(scan);
+        held.push_back(lidar->points());
+    }
+
+    // With every buffer held a scan is dropped, and the pool doesn't grow
+    scan.ranges = {9.0};
+    lidar->update(scan);
+    ASSERT_EQ(lidar->points(), held.back());
+    ASSERT_NEAR(lidar->points()->x[0], buffers, 0.001);
+
+    // Letting go of a scan frees its buffer for the next one
+    held.erase(held.begin());
+    lidar->update(scan);
+    ASSERT_NEAR(lidar->points()->x[0], 9.0, 0.001);
+    ASSERT_NEAR(held[0]->x[0], 2.0, 0.001);
+
+    // The scans outlive the lidar
+    lidar.reset();
+    ASSERT_NEAR(held.back()->x[0], buffers, 0.001);
+}
+
 TEST_F(ObstaclePointsTests, singleSonar) {
     ros::Duration(0.1).sleep(); // If we don't do this the publish never happens for some reason
     sensor_msgs::Range msg;
@@ -151,6 +444,249 @@ TEST_F(ObstaclePointsTests, singleSonar) {
     ASSERT_THAT(lines, ElementsAre(Pair(points[0], points[1])));
 }
 
+TEST_F(ObstaclePointsTests, scanRoi) {
+    sensor_msgs::LaserScan scan;
+    scan.header.stamp = ros::Time::now();
+    scan.header.frame_id = "roi_laser";
+    scan.angle_min = -M_PI;
+    scan.angle_increment = M_PI / 4;
+    scan.range_min = 0.05;
+    scan.range_max = 20;
+    // Beams at -180, -135, ... 135 degrees
+    scan.ranges = {1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+
+    // Only the beams in the window ahead are kept
+    ScanRoi roi;
+    roi.min_angle = -M_PI / 2;
+    roi.max_angle = M_PI / 4;
+    LidarSensor ahead(0, "roi_laser", tf2::Vector3(0, 0, 0), tf2::Vector3(1, 0, 0), roi);
+    ahead.update(scan);
+    ASSERT_EQ(ahead.points()->size(), 4u);
+
+    // A window can wrap around behind the scanner
+    roi.min_angle = 3 * M_PI / 4;
+    roi.max_angle = -3 * M_PI / 4;
+    LidarSensor behind(1, "roi_laser", tf2::Vector3(0, 0, 0), tf2::Vector3(1, 0, 0), roi);
+    behind.update(scan);
+    ASSERT_EQ(behind.points()->size(), 3u);
+    for (size_t i = 0; i < 3; i++) {
+        ASSERT_LT(behind.points()->x[i], -0.7);
+    }
+
+    // Long ranges are capped, and the distant beams thinned
+    ScanRoi cap;
+    cap.max_range = 5.0;
+    cap.decimation_range = 2.0;
+    scan.ranges = {1.0, 1.0, 3.0, 3.0, 4.5, 4.5, 4.5, 6.0};
+    LidarSensor capped(2, "roi_laser", tf2::Vector3(0, 0, 0), tf2::Vector3(1, 0, 0), cap);
+    capped.update(scan);
+    // all four up to 3m away, beams 4 and 6 of those at 4.5m, none past 5m
+    ASSERT_EQ(capped.points()->size(), 6u);
+}
+
+TEST_F(ObstaclePointsTests, sonarTable) {
+    geometry_msgs::TransformStamped front_tf, rear_tf;
+    front_tf.header.frame_id = rear_tf.header.frame_id = "base_link";
+    front_tf.child_frame_id = "front_sonar";
+    front_tf.transform.translation.x = 0.1;
+    front_tf.transform.rotation.w = 1.0;
+    rear_tf.child_frame_id = "rear_sonar";
+    rear_tf.transform.translation.x = -0.1;
+    rear_tf.transform.rotation.z = 1.0;
+    rear_tf.transform.rotation.w = 0.0;
+    tf_buffer.setTransform(front_tf, "test", true);
+    tf_buffer.setTransform(rear_tf, "test", true);
+
+    sensor_msgs::Range::Ptr rear(new sensor_msgs::Range());
+    rear->field_of_view = 0.0;
+    rear->min_range = 0.05;
+    rear->max_range = 10;
+    rear->radiation_type = sensor_msgs::Range::ULTRASOUND;
+    rear->header.stamp = ros::Time::now();
+    rear->header.frame_id = "rear_sonar";
+    rear->range = 1.0;
+    sensor_msgs::Range::Ptr front(new sensor_msgs::Range(*rear));
+    front->header.frame_id = "front_sonar";
+    front->range = 2.0;
+
+    // The sonars are kept in the order they were first seen, and each
+    // later reading replaces the last one from its sonar
+    obstacle_points->range_callback(rear);
+    obstacle_points->range_callback(front);
+    front->range = 0.5;
+    obstacle_points->range_callback(front);
+
+    ObstacleSnapshot snapshot;
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 2u);
+    ASSERT_EQ(snapshot.line_sources[0].id, 0);
+    ASSERT_NEAR(snapshot.lines[0].first.x(), -1.1, 0.001);
+    ASSERT_EQ(snapshot.line_sources[1].id, 1);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 0.6, 0.001);
+
+    // The geometry is only looked up again after /tf_static changes
+    // the sonar's frame
+    front_tf.transform.translation.x = 0.3;
+    rear_tf.transform.translation.x = -0.3;
+    tf_buffer.setTransform(front_tf, "test", true);
+    tf_buffer.setTransform(rear_tf, "test", true);
+    obstacle_points->range_callback(front);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 0.6, 0.001);
+    uint32_t geometry = snapshot.line_sources[1].geometry;
+
+    tf2_msgs::TFMessage::Ptr tf_static(new tf2_msgs::TFMessage());
+    tf_static->transforms.push_back(front_tf);
+    obstacle_points->tf_static_callback(tf_static);
+    obstacle_points->range_callback(front);
+    obstacle_points->range_callback(rear);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 2u);
+    ASSERT_EQ(snapshot.line_sources[1].id, 1);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 0.8, 0.001);
+    ASSERT_NE(snapshot.line_sources[1].geometry, geometry);
+    ASSERT_NEAR(snapshot.lines[0].first.x(), -1.1, 0.001);
+}
+
+TEST_F(ObstaclePointsTests, sonarArray) {
+    geometry_msgs::TransformStamped sonar_tf;
+    sonar_tf.header.frame_id = "base_link";
+    sonar_tf.transform.rotation.w = 1.0;
+
+    move_basic::RangeArray::Ptr ring(new move_basic::RangeArray());
+    ring->header.stamp = ros::Time::now();
+    for (int i = 0; i < 12; i++) {
+        sonar_tf.child_frame_id = "ring_sonar_" + std::to_string(i);
+        sonar_tf.transform.translation.y = 0.1 * i;
+        tf_buffer.setTransform(sonar_tf, "test", true);
+
+        sensor_msgs::Range range;
+        range.field_of_view = 0.0;
+        range.min_range = 0.05;
+        range.max_range = 10;
+        range.radiation_type = sensor_msgs::Range::ULTRASOUND;
+        range.header.stamp = ring->header.stamp;
+        range.header.frame_id = sonar_tf.child_frame_id;
+        range.range = 1.0 + i;
+        ring->ranges.push_back(range);
+    }
+
+    // Every reading of the batch is kept
+    obstacle_points->range_array_callback(ring);
+    ObstacleSnapshot snapshot;
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 12u);
+    for (int i = 0; i < 12; i++) {
+        ASSERT_EQ(snapshot.line_sources[i].id, i);
+        ASSERT_NEAR(snapshot.lines[i].first.x(), 1.0 + i, 0.001);
+        ASSERT_NEAR(snapshot.lines[i].first.y(), 0.1 * i, 0.001);
+    }
+
+    // Sonars first seen in a batch are the same ones on /sonars
+    sensor_msgs::Range::Ptr single(new sensor_msgs::Range(ring->ranges[3]));
+    single->range = 0.5;
+    obstacle_points->range_callback(single);
+    obstacle_points->get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 12u);
+    ASSERT_NEAR(snapshot.lines[3].first.x(), 0.5, 0.001);
+}
+
+TEST_F(ObstaclePointsTests, sonarMemory) {
+    nh.setParam("obstacle_memory", 0.8);
+    ObstaclePoints remembering(nh, tf_buffer);
+    nh.deleteParam("obstacle_memory");
+
+    geometry_msgs::TransformStamped sonar_tf, odom_tf;
+    sonar_tf.header.frame_id = odom_tf.header.frame_id = "base_link";
+    sonar_tf.child_frame_id = "memory_sonar";
+    sonar_tf.transform.rotation.w = 1.0;
+    odom_tf.child_frame_id = "odom";
+    odom_tf.transform.rotation.w = 1.0;
+    tf_buffer.setTransform(sonar_tf, "test", true);
+    tf_buffer.setTransform(odom_tf, "test", true);
+
+    sensor_msgs::Range::Ptr msg(new sensor_msgs::Range());
+    msg->field_of_view = 0.0;
+    msg->min_range = 0.05;
+    msg->max_range = 5;
+    msg->radiation_type = sensor_msgs::Range::ULTRASOUND;
+    msg->header.stamp = ros::Time::now();
+    msg->header.frame_id = "memory_sonar";
+    msg->range = 1.0;
+    remembering.range_callback(msg);
+
+    // The next ping misses the obstacle, which is still remembered
+    msg->range = 5.0;
+    remembering.range_callback(msg);
+    ObstacleSnapshot snapshot;
+    remembering.get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 2u);
+    ASSERT_EQ(snapshot.line_sources[0].id, 0);
+    ASSERT_NEAR(snapshot.lines[0].first.x(), 5.0, 0.001);
+    ASSERT_EQ(snapshot.line_sources[1].id, -1);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 1.0, 0.001);
+    ASSERT_EQ(snapshot.points.size(), 4u);
+
+    // It stays where it was seen as the robot drives towards it
+    odom_tf.transform.translation.x = -0.4;
+    tf_buffer.setTransform(odom_tf, "test", true);
+    remembering.get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 2u);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 0.6, 0.001);
+    ASSERT_NEAR(snapshot.points.x[2], 0.6, 0.001);
+
+    // With a cache the pose is looked up once per tick
+    TransformCache tf_cache(tf_buffer);
+    remembering.get_snapshot(ros::Duration(10), snapshot, &tf_cache);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 0.6, 0.001);
+    odom_tf.transform.translation.x = -0.5;
+    tf_buffer.setTransform(odom_tf, "test", true);
+    remembering.get_snapshot(ros::Duration(10), snapshot, &tf_cache);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 0.6, 0.001);
+    tf_cache.new_tick();
+    remembering.get_snapshot(ros::Duration(10), snapshot, &tf_cache);
+    ASSERT_NEAR(snapshot.lines[1].first.x(), 0.5, 0.001);
+}
+
+TEST_F(ObstaclePointsTests, reservedBuffers) {
+    nh.setParam("max_sonars", 8);
+    ObstaclePoints reserved(nh, tf_buffer);
+    nh.deleteParam("max_sonars");
+
+    geometry_msgs::TransformStamped sonar_tf;
+    sonar_tf.header.frame_id = "base_link";
+    sonar_tf.transform.rotation.w = 1.0;
+
+    ObstacleSnapshot snapshot;
+    reserved.reserve_snapshot(snapshot);
+    ASSERT_GE(snapshot.lines.capacity(), 8u);
+    const ObstacleSnapshot::Line* lines = snapshot.lines.data();
+    const float* points = snapshot.points.x.data();
+
+    // Filling the snapshot with as many sonars as it was sized for
+    // keeps its buffers where they are
+    for (int i = 0; i < 8; i++) {
+        sonar_tf.child_frame_id = "reserved_sonar_" + std::to_string(i);
+        sonar_tf.transform.translation.y = 0.1 * i;
+        tf_buffer.setTransform(sonar_tf, "test", true);
+
+        sensor_msgs::Range::Ptr range(new sensor_msgs::Range());
+        range->field_of_view = 0.0;
+        range->min_range = 0.05;
+        range->max_range = 10;
+        range->radiation_type = sensor_msgs::Range::ULTRASOUND;
+        range->header.stamp = ros::Time::now();
+        range->header.frame_id = sonar_tf.child_frame_id;
+        range->range = 1.0;
+        reserved.range_callback(range);
+    }
+    reserved.get_snapshot(ros::Duration(10), snapshot);
+    ASSERT_EQ(snapshot.lines.size(), 8u);
+    ASSERT_EQ(snapshot.lines.data(), lines);
+    ASSERT_EQ(snapshot.points.x.data(), points);
+    ASSERT_NEAR(snapshot.lines[7].second.y(), 0.7, 0.001);
+}
+
 int main(int argc, char **argv) {
     ros::init(argc, argv, "obstacle_points_test");
     ros::start();
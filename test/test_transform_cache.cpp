@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2021, Ubiquity Robotics
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the FreeBSD Project.
+ *
+ */
+
+#include <gtest/gtest.h>
+
+#include <ros/ros.h>
+#include <tf2_ros/buffer.h>
+#include <geometry_msgs/TransformStamped.h>
+
+#include "move_basic/transform_cache.h"
+
+class TransformCacheTests : public ::testing::Test {
+protected:
+    void set_odom(double x) {
+        geometry_msgs::TransformStamped tfs;
+        tfs.header.stamp = ros::Time::now();
+        tfs.header.frame_id = "odom";
+        tfs.child_frame_id = "base_link";
+        tfs.transform.translation.x = x;
+        tfs.transform.rotation.w = 1.0;
+        tf_buffer.setTransform(tfs, "test", true);
+    }
+
+    tf2_ros::Buffer tf_buffer;
+};
+
+TEST_F(TransformCacheTests, sameTick) {
+    TransformCache cache(tf_buffer);
+    tf2::Transform tf;
+
+    set_odom(1.0);
+    ASSERT_TRUE(cache.lookup("base_link", "odom", tf));
+    ASSERT_NEAR(tf.getOrigin().x(), 1.0, 0.001);
+
+    // Later lookups in the same tick see the cached transform
+    set_odom(2.0);
+    ASSERT_TRUE(cache.lookup("base_link", "odom", tf));
+    ASSERT_NEAR(tf.getOrigin().x(), 1.0, 0.001);
+
+    // as does the lookup in the other direction
+    ASSERT_TRUE(cache.lookup("odom", "base_link", tf));
+    ASSERT_NEAR(tf.getOrigin().x(), -1.0, 0.001);
+
+    cache.new_tick();
+    ASSERT_TRUE(cache.lookup("base_link", "odom", tf));
+    ASSERT_NEAR(tf.getOrigin().x(), 2.0, 0.001);
+}
+
+TEST_F(TransformCacheTests, missingFrame) {
+    TransformCache cache(tf_buffer);
+    tf2::Transform tf;
+
+    // Failures are reported without exceptions, and retried the next tick
+    ASSERT_FALSE(cache.lookup("base_link", "map", tf));
+    ASSERT_FALSE(cache.lookup("base_link", "map", tf));
+
+    geometry_msgs::TransformStamped tfs;
+    tfs.header.stamp = ros::Time::now();
+    tfs.header.frame_id = "map";
+    tfs.child_frame_id = "base_link";
+    tfs.transform.translation.y = 3.0;
+    tfs.transform.rotation.w = 1.0;
+    tf_buffer.setTransform(tfs, "test", true);
+    ASSERT_FALSE(cache.lookup("base_link", "map", tf));
+
+    cache.new_tick();
+    ASSERT_TRUE(cache.lookup("base_link", "map", tf));
+    ASSERT_NEAR(tf.getOrigin().y(), 3.0, 0.001);
+}
+
+int main(int argc, char **argv) {
+    ros::init(argc, argv, "transform_cache_test");
+    ros::start();
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}